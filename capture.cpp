@@ -0,0 +1,721 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct MoCaptureJob
+{
+    MoReadback          readback;
+    uint32_t            slot;
+    const std::uint8_t* pPixels;
+    uint32_t            rowPitch;
+    uint32_t            frame;
+};
+
+struct MoCapture_T
+{
+    std::string               pathPattern;
+    MoCaptureFormat           format;
+    VkExtent2D                extent;
+    VkBool32                  swizzle;
+    uint32_t                  queueDepth;
+    // numbered as recorded, dropped frames included
+    uint32_t                  nextFrame;
+    uint32_t                  droppedFrames;
+    // slot and frame number of the readbacks recorded and not taken yet, oldest first
+    std::deque<std::pair<uint32_t, uint32_t>> recorded;
+    std::vector<std::thread>  workers;
+    std::mutex                mutex;
+    std::condition_variable   wake;
+    std::condition_variable   idle;
+    std::deque<MoCaptureJob>  queue;
+    uint32_t                  busy;
+    // encoded, their slots are released on the thread recording readbacks
+    std::vector<MoCaptureJob> done;
+    bool                      quit;
+};
+
+struct MoSharedRing_T
+{
+    std::string         name;
+    MoSharedRingHeader* pHeader;
+    std::uint8_t*       pSlots;
+    size_t              size;
+    MoReadback          readback;
+    // published frames whose readback slot is the shared slot itself, released once consumed
+    std::deque<uint64_t> imported;
+    std::deque<uint32_t> importedSlots;
+};
+
+struct MoTiledImage_T
+{
+    FILE*                     file;
+    long long                 dataOffset;
+    VkExtent2D                extent;
+    VkExtent2D                tileExtent;
+    uint32_t                  columns;
+    uint32_t                  rows;
+    // a write to the file failed, reported by moDestroyTiledImage
+    VkBool32                  failed;
+    VkBool32                  swizzle;
+    std::vector<std::uint8_t> row;
+    // slot and tile of the readbacks recorded and not written yet, oldest first
+    std::deque<std::pair<uint32_t, uint32_t>> recorded;
+};
+
+static void putBigEndian(std::vector<std::uint8_t> & out, uint32_t value)
+{
+    out.push_back((std::uint8_t)(value >> 24));
+    out.push_back((std::uint8_t)(value >> 16));
+    out.push_back((std::uint8_t)(value >> 8));
+    out.push_back((std::uint8_t)value);
+}
+
+// see qoiformat.org, pixels are tightly packed RGBA
+static void encodeQoi(const std::uint8_t *pPixels, VkExtent2D extent, std::vector<std::uint8_t> & out)
+{
+    out.reserve(14 + (size_t)extent.width * extent.height * 5 + 8);
+    out.insert(out.end(), {'q', 'o', 'i', 'f'});
+    putBigEndian(out, extent.width);
+    putBigEndian(out, extent.height);
+    out.push_back(4);
+    out.push_back(0);
+
+    std::uint8_t seen[64][4] = {};
+    std::uint8_t previous[4] = {0, 0, 0, 255};
+    uint32_t run = 0;
+    const size_t pixelCount = (size_t)extent.width * extent.height;
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        const std::uint8_t *pixel = pPixels + i * 4;
+        if (memcmp(pixel, previous, 4) == 0)
+        {
+            if (++run == 62 || i + 1 == pixelCount)
+            {
+                out.push_back((std::uint8_t)(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0)
+        {
+            out.push_back((std::uint8_t)(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        const uint32_t hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+        if (memcmp(seen[hash], pixel, 4) == 0)
+        {
+            out.push_back((std::uint8_t)hash);
+        }
+        else if (pixel[3] == previous[3])
+        {
+            const int8_t dr = (int8_t)(pixel[0] - previous[0]);
+            const int8_t dg = (int8_t)(pixel[1] - previous[1]);
+            const int8_t db = (int8_t)(pixel[2] - previous[2]);
+            const int8_t drg = (int8_t)(dr - dg);
+            const int8_t dbg = (int8_t)(db - dg);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out.push_back((std::uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            }
+            else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+            {
+                out.push_back((std::uint8_t)(0x80 | (dg + 32)));
+                out.push_back((std::uint8_t)((drg + 8) << 4 | (dbg + 8)));
+            }
+            else
+            {
+                out.insert(out.end(), {0xFE, pixel[0], pixel[1], pixel[2]});
+            }
+            memcpy(seen[hash], pixel, 4);
+        }
+        else
+        {
+            out.insert(out.end(), {0xFF, pixel[0], pixel[1], pixel[2], pixel[3]});
+            memcpy(seen[hash], pixel, 4);
+        }
+        memcpy(previous, pixel, 4);
+    }
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+static uint32_t crc32(const std::uint8_t *pData, size_t size, uint32_t crc = 0)
+{
+    static uint32_t table[256] = {};
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    });
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ pData[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putPngChunk(std::vector<std::uint8_t> & out, const char *type, const std::uint8_t *pData, size_t size)
+{
+    putBigEndian(out, (uint32_t)size);
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), pData, pData + size);
+    putBigEndian(out, crc32(out.data() + start, out.size() - start));
+}
+
+// rows are unfiltered and deflate blocks stored, the file is only a little larger than the pixels
+static void encodePng(const std::uint8_t *pPixels, VkExtent2D extent, std::vector<std::uint8_t> & out)
+{
+    const size_t rowSize = (size_t)extent.width * 4;
+    std::vector<std::uint8_t> raw;
+    raw.reserve((rowSize + 1) * extent.height);
+    for (uint32_t row = 0; row < extent.height; ++row)
+    {
+        raw.push_back(0);
+        raw.insert(raw.end(), pPixels + row * rowSize, pPixels + (row + 1) * rowSize);
+    }
+
+    std::vector<std::uint8_t> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    uint32_t a = 1, b = 0;
+    for (size_t offset = 0; offset < raw.size() || offset == 0;)
+    {
+        const size_t size = std::min<size_t>(65535, raw.size() - offset);
+        const bool last = offset + size == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back((std::uint8_t)size);
+        zlib.push_back((std::uint8_t)(size >> 8));
+        zlib.push_back((std::uint8_t)~size);
+        zlib.push_back((std::uint8_t)(~size >> 8));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + size);
+        // adler-32, reduced once per block which stays well below overflow
+        for (size_t i = offset; i < offset + size; ++i)
+        {
+            a += raw[i];
+            b += a;
+            if ((i & 4095) == 4095) { a %= 65521; b %= 65521; }
+        }
+        a %= 65521;
+        b %= 65521;
+        offset += size;
+        if (last)
+            break;
+    }
+    putBigEndian(zlib, b << 16 | a);
+
+    static const std::uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.reserve(zlib.size() + 64);
+    out.insert(out.end(), signature, signature + 8);
+    std::vector<std::uint8_t> header;
+    putBigEndian(header, extent.width);
+    putBigEndian(header, extent.height);
+    header.insert(header.end(), {8, 6, 0, 0, 0});
+    putPngChunk(out, "IHDR", header.data(), header.size());
+    putPngChunk(out, "IDAT", zlib.data(), zlib.size());
+    putPngChunk(out, "IEND", nullptr, 0);
+}
+
+// each chroma sample averages a 2x2 block, odd sizes repeat the last row or column
+static void encodeYuv420(const std::uint8_t *pPixels, VkExtent2D extent, std::vector<std::uint8_t> & out)
+{
+    const uint32_t width = extent.width, height = extent.height;
+    const uint32_t chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    out.resize((size_t)width * height + 2 * (size_t)chromaWidth * chromaHeight);
+    std::uint8_t *pY = out.data();
+    std::uint8_t *pU = pY + (size_t)width * height;
+    std::uint8_t *pV = pU + (size_t)chromaWidth * chromaHeight;
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            const std::uint8_t *pixel = pPixels + ((size_t)y * width + x) * 4;
+            pY[(size_t)y * width + x] = (std::uint8_t)(((66 * pixel[0] + 129 * pixel[1] + 25 * pixel[2] + 128) >> 8) + 16);
+        }
+    }
+    for (uint32_t y = 0; y < chromaHeight; ++y)
+    {
+        for (uint32_t x = 0; x < chromaWidth; ++x)
+        {
+            int r = 0, g = 0, b = 0;
+            for (uint32_t j = 0; j < 2; ++j)
+            {
+                for (uint32_t i = 0; i < 2; ++i)
+                {
+                    const std::uint8_t *pixel = pPixels + ((size_t)std::min(2 * y + j, height - 1) * width + std::min(2 * x + i, width - 1)) * 4;
+                    r += pixel[0]; g += pixel[1]; b += pixel[2];
+                }
+            }
+            r /= 4; g /= 4; b /= 4;
+            pU[(size_t)y * chromaWidth + x] = (std::uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            pV[(size_t)y * chromaWidth + x] = (std::uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+static void encodeFrame(MoCapture capture, const MoCaptureJob & job, std::vector<std::uint8_t> & rgba, std::vector<std::uint8_t> & encoded)
+{
+    rgba.resize((size_t)capture->extent.width * capture->extent.height * 4);
+    MoPixelConversionInfo conversion = {};
+    conversion.pSource = job.pPixels;
+    conversion.sourceRowPitch = job.rowPitch;
+    conversion.pDestination = rgba.data();
+    conversion.extent = capture->extent;
+    conversion.swizzle = capture->swizzle;
+    conversion.forceAlpha = VK_TRUE;
+    // the workers already run in parallel
+    conversion.threadCount = 1;
+    moConvertPixels(&conversion);
+
+    encoded.clear();
+    switch (capture->format)
+    {
+    case MO_CAPTURE_FORMAT_QOI: encodeQoi(rgba.data(), capture->extent, encoded); break;
+    case MO_CAPTURE_FORMAT_PNG: encodePng(rgba.data(), capture->extent, encoded); break;
+    case MO_CAPTURE_FORMAT_YUV420: encodeYuv420(rgba.data(), capture->extent, encoded); break;
+    default: break;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), capture->pathPattern.c_str(), job.frame);
+    // one large sequential write per frame
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr || fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size())
+        fprintf(stderr, "Error writing capture frame %s\n", path);
+    if (file != nullptr)
+        fclose(file);
+}
+
+static void captureWorker(MoCapture capture)
+{
+    // the converted and encoded pixels, buffers are reused from frame to frame
+    std::vector<std::uint8_t> rgba, encoded;
+    std::unique_lock<std::mutex> lock(capture->mutex);
+    for (;;)
+    {
+        capture->wake.wait(lock, [capture]() { return capture->quit || !capture->queue.empty(); });
+        if (capture->queue.empty())
+            return;
+        MoCaptureJob job = capture->queue.front();
+        capture->queue.pop_front();
+        ++capture->busy;
+
+        lock.unlock();
+        encodeFrame(capture, job, rgba, encoded);
+        lock.lock();
+
+        --capture->busy;
+        capture->done.push_back(job);
+        capture->idle.notify_all();
+    }
+}
+
+void moCreateCapture(const MoCaptureCreateInfo *pCreateInfo, MoCapture *pCapture)
+{
+    MoCapture capture = *pCapture = new MoCapture_T();
+    capture->pathPattern = pCreateInfo->pPathPattern;
+    capture->format = pCreateInfo->format;
+    capture->extent = pCreateInfo->extent;
+    capture->swizzle = pCreateInfo->swizzle;
+    capture->queueDepth = pCreateInfo->queueDepth == 0 ? 4 : pCreateInfo->queueDepth;
+    capture->nextFrame = 0;
+    capture->droppedFrames = 0;
+    capture->busy = 0;
+    capture->quit = false;
+    const uint32_t workerCount = pCreateInfo->workerCount == 0 ? 2 : pCreateInfo->workerCount;
+    for (uint32_t i = 0; i < workerCount; ++i)
+        capture->workers.emplace_back(captureWorker, capture);
+}
+
+void moDestroyCapture(MoCapture capture)
+{
+    moFlushCapture(capture);
+    {
+        std::lock_guard<std::mutex> lock(capture->mutex);
+        capture->quit = true;
+    }
+    capture->wake.notify_all();
+    for (std::thread & worker : capture->workers)
+        worker.join();
+    delete capture;
+}
+
+VkResult moRecordCapture(MoCapture capture, MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout)
+{
+    uint32_t slot;
+    VkResult result = moRecordReadback(readback, frameIndex, source, sourceExtent, layout, &slot);
+    std::lock_guard<std::mutex> lock(capture->mutex);
+    if (result == VK_SUCCESS)
+        capture->recorded.emplace_back(slot, capture->nextFrame++);
+    else if (result == VK_NOT_READY)
+    {
+        // its number is skipped, so the gap shows in the file names
+        ++capture->nextFrame;
+        ++capture->droppedFrames;
+    }
+    return result;
+}
+
+uint32_t moCaptureDroppedFrames(MoCapture capture)
+{
+    std::lock_guard<std::mutex> lock(capture->mutex);
+    return capture->droppedFrames;
+}
+
+uint32_t moCaptureReadbacks(MoCapture capture, MoReadback readback)
+{
+    uint32_t queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(capture->mutex);
+        for (const MoCaptureJob & job : capture->done)
+            moReleaseReadback(job.readback, job.slot);
+        capture->done.clear();
+
+        while (capture->queue.size() + capture->busy < capture->queueDepth)
+        {
+            MoCaptureJob job = {};
+            job.readback = readback;
+            if (moTakeReadback(readback, &job.slot, &job.pPixels, &job.rowPitch) != VK_SUCCESS)
+                break;
+            // slots complete in the order they were recorded
+            assert(!capture->recorded.empty() && capture->recorded.front().first == job.slot);
+            job.frame = capture->recorded.front().second;
+            capture->recorded.pop_front();
+            capture->queue.push_back(job);
+            ++queued;
+        }
+    }
+    if (queued > 0)
+        capture->wake.notify_all();
+    return queued;
+}
+
+void moFlushCapture(MoCapture capture)
+{
+    std::unique_lock<std::mutex> lock(capture->mutex);
+    capture->idle.wait(lock, [capture]() { return capture->queue.empty() && capture->busy == 0; });
+    for (const MoCaptureJob & job : capture->done)
+        moReleaseReadback(job.readback, job.slot);
+    capture->done.clear();
+}
+
+static bool seekFile(FILE *file, long long offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+VkResult moCreateTiledImage(const MoTiledImageCreateInfo *pCreateInfo, MoTiledImage *pImage)
+{
+    MoTiledImage image = *pImage = new MoTiledImage_T();
+    image->extent = pCreateInfo->extent;
+    image->tileExtent = pCreateInfo->tileExtent;
+    image->columns = (image->extent.width + image->tileExtent.width - 1) / image->tileExtent.width;
+    image->rows = (image->extent.height + image->tileExtent.height - 1) / image->tileExtent.height;
+    image->failed = VK_FALSE;
+    image->swizzle = pCreateInfo->swizzle;
+    image->row.resize(image->tileExtent.width * 4);
+
+    image->file = fopen(pCreateInfo->pPath, "wb");
+    if (image->file == nullptr)
+    {
+        image->failed = VK_TRUE;
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+    image->dataOffset = fprintf(image->file, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                                image->extent.width, image->extent.height);
+    if (image->dataOffset < 0)
+        image->failed = VK_TRUE;
+    return VK_SUCCESS;
+}
+
+VkBool32 moDestroyTiledImage(MoTiledImage image)
+{
+    // buffered writes may only fail once flushed
+    const bool closed = image->file != nullptr && fclose(image->file) == 0;
+    const VkBool32 written = closed && !image->failed ? VK_TRUE : VK_FALSE;
+    delete image;
+    return written;
+}
+
+uint32_t moTiledImageTileCount(MoTiledImage image)
+{
+    return image->columns * image->rows;
+}
+
+// tiles along the right and bottom edges hang over the image, their projection keeps the same scale as the others
+static VkRect2D tileRect(MoTiledImage image, uint32_t tileIndex, bool clip)
+{
+    VkRect2D tile = {};
+    tile.offset.x = int32_t((tileIndex % image->columns) * image->tileExtent.width);
+    tile.offset.y = int32_t((tileIndex / image->columns) * image->tileExtent.height);
+    tile.extent = image->tileExtent;
+    if (clip)
+    {
+        tile.extent.width = std::min(tile.extent.width, image->extent.width - tile.offset.x);
+        tile.extent.height = std::min(tile.extent.height, image->extent.height - tile.offset.y);
+    }
+    return tile;
+}
+
+void moGetTile(MoTiledImage image, uint32_t tileIndex, const linalg::aliases::float4x4 & projection, VkRect2D *pRect, linalg::aliases::float4x4 *pTileProjection)
+{
+    moTileProjection(projection, image->extent, tileRect(image, tileIndex, false), pTileProjection);
+    *pRect = tileRect(image, tileIndex, true);
+}
+
+VkResult moRecordTile(MoTiledImage image, uint32_t tileIndex, MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout)
+{
+    uint32_t slot;
+    VkResult result = moRecordReadback(readback, frameIndex, source, sourceExtent, layout, &slot);
+    if (result == VK_SUCCESS)
+        image->recorded.emplace_back(slot, tileIndex);
+    return result;
+}
+
+uint32_t moWriteTiles(MoTiledImage image, MoReadback readback)
+{
+    uint32_t written = 0;
+    const std::uint8_t *pPixels;
+    uint32_t rowPitch;
+    // slots complete in the order they were recorded
+    while (!image->recorded.empty() && moPollReadback(readback, image->recorded.front().first, &pPixels, &rowPitch) == VK_SUCCESS)
+    {
+        const uint32_t slot = image->recorded.front().first;
+        const VkRect2D tile = tileRect(image, image->recorded.front().second, true);
+        image->recorded.pop_front();
+
+        MoPixelConversionInfo conversion = {};
+        conversion.pDestination = image->row.data();
+        conversion.extent = {tile.extent.width, 1};
+        conversion.swizzle = image->swizzle;
+        conversion.forceAlpha = VK_TRUE;
+        conversion.threadCount = 1;
+        for (uint32_t y = 0; y < tile.extent.height; ++y)
+        {
+            conversion.pSource = pPixels + size_t(y) * rowPitch;
+            moConvertPixels(&conversion);
+            if (image->failed ||
+                !seekFile(image->file, image->dataOffset + ((long long)(tile.offset.y + y) * image->extent.width + tile.offset.x) * 4) ||
+                fwrite(image->row.data(), 4, tile.extent.width, image->file) != tile.extent.width)
+            {
+                image->failed = VK_TRUE;
+                break;
+            }
+        }
+        moReleaseReadback(readback, slot);
+        ++written;
+    }
+    return written;
+}
+
+VkResult moFlushTiledImage(MoTiledImage image, MoReadback readback)
+{
+    while (!image->recorded.empty())
+    {
+        const std::uint8_t *pPixels;
+        VkResult result = moWaitReadback(readback, image->recorded.front().first, &pPixels, nullptr);
+        if (result != VK_SUCCESS)
+            return result;
+        moWriteTiles(image, readback);
+    }
+    if (image->failed || fflush(image->file) != 0)
+        image->failed = VK_TRUE;
+    return VK_SUCCESS;
+}
+
+VkResult moCreateSharedRing(const MoSharedRingCreateInfo *pCreateInfo, MoSharedRing *pRing)
+{
+    *pRing = VK_NULL_HANDLE;
+#if !defined(__unix__) && !defined(__APPLE__)
+    return VK_ERROR_FEATURE_NOT_PRESENT;
+#else
+    // both powers of two
+    const uint64_t alignment = std::max<uint64_t>((uint64_t)sysconf(_SC_PAGESIZE), pCreateInfo->device->minImportedHostPointerAlignment);
+    const uint32_t slotCount = pCreateInfo->slotCount == 0 ? 4 : pCreateInfo->slotCount;
+    const uint32_t rowPitch = pCreateInfo->extent.width * 4;
+    const uint64_t slotStride = ((uint64_t)rowPitch * pCreateInfo->extent.height + alignment - 1) / alignment * alignment;
+    const uint64_t size = alignment + slotStride * slotCount;
+
+    const int fd = shm_open(pCreateInfo->pName, O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    void *pMemory = ftruncate(fd, (off_t)size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (pMemory == MAP_FAILED)
+    {
+        shm_unlink(pCreateInfo->pName);
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+
+    MoSharedRing ring = *pRing = new MoSharedRing_T();
+    ring->name = pCreateInfo->pName;
+    ring->size = size;
+    ring->readback = VK_NULL_HANDLE;
+
+    // consumers only rely on lock free atomics being plain memory shared between processes
+    ring->pHeader = new (pMemory) MoSharedRingHeader();
+    assert(ring->pHeader->head.is_lock_free());
+    ring->pHeader->slotCount = slotCount;
+    ring->pHeader->width = pCreateInfo->extent.width;
+    ring->pHeader->height = pCreateInfo->extent.height;
+    ring->pHeader->rowPitch = rowPitch;
+    ring->pHeader->slotOffset = alignment;
+    ring->pHeader->slotStride = slotStride;
+    ring->pHeader->head.store(0, std::memory_order_relaxed);
+    ring->pHeader->tail.store(0, std::memory_order_relaxed);
+    ring->pSlots = (std::uint8_t*)pMemory + alignment;
+
+    MoReadbackCreateInfo readbackInfo = {};
+    readbackInfo.format = pCreateInfo->format;
+    readbackInfo.extent = pCreateInfo->extent;
+    readbackInfo.slotCount = slotCount;
+    readbackInfo.pHostMemory = ring->pSlots;
+    readbackInfo.hostMemoryStride = slotStride;
+    VkResult result = moCreateReadback(&readbackInfo, &ring->readback);
+    if (result != VK_SUCCESS)
+    {
+        ring->pHeader->~MoSharedRingHeader();
+        munmap(pMemory, size);
+        shm_unlink(pCreateInfo->pName);
+        delete ring;
+        *pRing = VK_NULL_HANDLE;
+        return result;
+    }
+
+    // written last, consumers wait for it before reading the rest of the header
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->pHeader->magic = MO_SHARED_RING_MAGIC;
+    return VK_SUCCESS;
+#endif
+}
+
+void moDestroySharedRing(MoSharedRing ring)
+{
+    // the readback's memory is freed once its frames retire, the mapping has to outlive it
+    moDestroyReadback(ring->readback);
+    moFlushDeletions();
+#if defined(__unix__) || defined(__APPLE__)
+    ring->pHeader->~MoSharedRingHeader();
+    munmap(ring->pHeader, ring->size);
+    shm_unlink(ring->name.c_str());
+#endif
+    delete ring;
+}
+
+MoReadback moSharedRingReadback(MoSharedRing ring)
+{
+    return ring->readback;
+}
+
+uint32_t moPublishSharedRing(MoSharedRing ring)
+{
+    MoSharedRingHeader *pHeader = ring->pHeader;
+    const uint64_t tail = pHeader->tail.load(std::memory_order_acquire);
+    while (!ring->imported.empty() && ring->imported.front() < tail)
+    {
+        moReleaseReadback(ring->readback, ring->importedSlots.front());
+        ring->imported.pop_front();
+        ring->importedSlots.pop_front();
+    }
+
+    uint32_t published = 0;
+    uint64_t head = pHeader->head.load(std::memory_order_relaxed);
+    while (head - tail < pHeader->slotCount)
+    {
+        uint32_t slot;
+        const std::uint8_t *pPixels;
+        uint32_t rowPitch;
+        if (moTakeReadback(ring->readback, &slot, &pPixels, &rowPitch) != VK_SUCCESS)
+            break;
+
+        // readback slots are recorded and taken round robin, so frame head is in slot head % slotCount either way
+        std::uint8_t *pShared = ring->pSlots + (head % pHeader->slotCount) * pHeader->slotStride;
+        if (pPixels == pShared)
+        {
+            ring->imported.push_back(head);
+            ring->importedSlots.push_back(slot);
+        }
+        else
+        {
+            MoPixelConversionInfo conversion = {};
+            conversion.pSource = pPixels;
+            conversion.sourceRowPitch = rowPitch;
+            conversion.pDestination = pShared;
+            conversion.destinationRowPitch = pHeader->rowPitch;
+            conversion.extent = {pHeader->width, pHeader->height};
+            moConvertPixels(&conversion);
+            moReleaseReadback(ring->readback, slot);
+        }
+        pHeader->head.store(++head, std::memory_order_release);
+        ++published;
+    }
+    return published;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2018 Patrick Pelletier
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
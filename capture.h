@@ -0,0 +1,185 @@
+#pragma once
+
+#include "phong.h"
+
+#include <atomic>
+
+#define MO_SHARED_RING_MAGIC 0x52534F4D // "MOSR"
+
+typedef enum MoCaptureFormat {
+    MO_CAPTURE_FORMAT_QOI = 0,
+    MO_CAPTURE_FORMAT_PNG = 1,    // stored, uncompressed deflate blocks keep encoding as fast as a copy
+    MO_CAPTURE_FORMAT_YUV420 = 2, // raw planar Y, U then V, BT.601 limited range
+    MO_CAPTURE_FORMAT_MAX_ENUM = 0x7FFFFFFF
+} MoCaptureFormat;
+
+typedef struct MoCaptureCreateInfo {
+    // printf pattern given the capture's frame number, e.g. "frame%05u.qoi"
+    const char*     pPathPattern;
+    MoCaptureFormat format;
+    // of the readback the frames are taken from
+    VkExtent2D      extent;
+    // the readback holds BGRA pixels, as copied from most swap chains
+    VkBool32        swizzle;
+    // encoding threads, 2 when 0
+    uint32_t        workerCount;
+    // frames queued or being encoded, 4 when 0; once reached, completed readbacks wait in their slots
+    uint32_t        queueDepth;
+} MoCaptureCreateInfo;
+
+// encodes readback frames to disk on a pool of worker threads, see moCreateCapture
+typedef struct MoCapture_T* MoCapture;
+
+// start the capture workers
+void moCreateCapture(const MoCaptureCreateInfo* pCreateInfo, MoCapture* pCapture);
+
+// finish the queued frames and stop the workers
+void moDestroyCapture(MoCapture capture);
+
+// record the readback of a frame, rendered into source, as moRecordReadback; on VK_NOT_READY the workers are behind,
+// the frame is dropped and counted, see moCaptureDroppedFrames; frames are numbered here, dropped ones included, so
+// the numbers of dropped frames are missing from the files written
+VkResult moRecordCapture(MoCapture capture, MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout);
+
+// frames moRecordCapture dropped so far because the readback ring was full
+uint32_t moCaptureDroppedFrames(MoCapture capture);
+
+// take completed readbacks, oldest first, and queue them for encoding while the queue has room; never blocks
+// slots are released by a later call once encoded, so a full queue makes moRecordCapture drop frames
+// returns how many frames were queued
+uint32_t moCaptureReadbacks(MoCapture capture, MoReadback readback);
+
+// wait for the queued frames to be written and release their slots
+void moFlushCapture(MoCapture capture);
+
+typedef struct MoTiledImageCreateInfo {
+    // written as a binary PAM (P7, RGB_ALPHA), each tile straight to its rows in the file
+    const char* pPath;
+    // of the whole image, which may exceed maxImageDimension2D
+    VkExtent2D  extent;
+    // of the offscreen target and readback the tiles are rendered and copied with
+    VkExtent2D  tileExtent;
+    // the readback holds BGRA pixels
+    VkBool32    swizzle;
+} MoTiledImageCreateInfo;
+
+// an image rendered tile by tile into one offscreen target, see moCreateTiledImage
+typedef struct MoTiledImage_T* MoTiledImage;
+
+// create the output file; the memory used does not depend on the image's size, only on the tile's
+// render tile i with the projection from moGetTile, record its readback with moRecordTile, then call moWriteTiles
+// VK_ERROR_INITIALIZATION_FAILED when the file cannot be opened, the image then writes nothing and still has to be destroyed
+VkResult moCreateTiledImage(const MoTiledImageCreateInfo* pCreateInfo, MoTiledImage* pImage);
+
+// close the output file; VK_FALSE when writing any of it failed, the file is then incomplete
+VkBool32 moDestroyTiledImage(MoTiledImage image);
+
+// tiles covering the image, row by row
+uint32_t moTiledImageTileCount(MoTiledImage image);
+
+// the pixels of the image tile i covers and its projection, see moTileProjection
+void moGetTile(MoTiledImage image, uint32_t tileIndex, const linalg::aliases::float4x4 & projection, VkRect2D* pRect, linalg::aliases::float4x4* pTileProjection);
+
+// record the readback of tile i, rendered into source, as moRecordReadback; on VK_NOT_READY nothing was recorded
+// and the tile has to be recorded again, in a later frame
+VkResult moRecordTile(MoTiledImage image, uint32_t tileIndex, MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout);
+
+// write completed readbacks, oldest first, to their tiles and release their slots; never blocks
+// with more readback slots than frames in flight, calling it after each acquire leaves the next slot free
+// returns how many tiles were written
+uint32_t moWriteTiles(MoTiledImage image, MoReadback readback);
+
+// wait for every recorded tile to be written, VK_NOT_READY when one's frame was not submitted yet
+VkResult moFlushTiledImage(MoTiledImage image, MoReadback readback);
+
+typedef struct MoSharedRingCreateInfo {
+    // whose minImportedHostPointerAlignment the header and every slot are aligned to, along with the page size
+    MoDevice    device;
+    // shm_open name such as "/meshoui", consumers open and map it read/write
+    const char* pName;
+    // of the copied images, as MoReadbackCreateInfo
+    VkFormat    format;
+    VkExtent2D  extent;
+    // frames between the GPU and the consumer, 4 when 0
+    uint32_t    slotCount;
+} MoSharedRingCreateInfo;
+
+// the GPU copies straight into the shared memory when the instance and device were created with externalMemoryHost,
+// otherwise moPublishSharedRing copies each frame in
+
+// at the start of the shared memory; frame n is in slot n % slotCount, the consumer reads frames tail to head - 1
+// once head is loaded and stores tail once done with them, neither side ever waits for the other
+typedef struct MoSharedRingHeader {
+    uint32_t              magic;
+    uint32_t              slotCount;
+    uint32_t              width;
+    uint32_t              height;
+    uint32_t              rowPitch;   // bytes, 4 per pixel in the format of the copied image
+    uint32_t              reserved;
+    uint64_t              slotOffset; // bytes from the start of the shared memory, the size of the header's pages
+    uint64_t              slotStride; // both depend on the device, consumers use them rather than a fixed alignment
+    std::atomic<uint64_t> head;       // frames published, written by the producer
+    std::atomic<uint64_t> tail;       // frames consumed, written by the consumer
+} MoSharedRingHeader;
+
+// readback slots in POSIX shared memory for consumers in other processes, see moCreateSharedRing
+typedef struct MoSharedRing_T* MoSharedRing;
+
+// create the shared memory and the readback copying into it; the slots import the shared memory with
+// VK_EXT_external_memory_host so frames reach the consumer without a CPU copy, and are copied into it otherwise
+// VK_ERROR_INITIALIZATION_FAILED when the shared memory cannot be created or mapped, VK_ERROR_FEATURE_NOT_PRESENT
+// without POSIX shared memory, or the error of moCreateReadback; the ring is then VK_NULL_HANDLE
+VkResult moCreateSharedRing(const MoSharedRingCreateInfo* pCreateInfo, MoSharedRing* pRing);
+
+// free the readback and unlink the shared memory
+void moDestroySharedRing(MoSharedRing ring);
+
+// the readback to record frames into with moRecordReadback
+MoReadback moSharedRingReadback(MoSharedRing ring);
+
+// publish completed readbacks, oldest first, and release the slots of consumed frames; never blocks
+// frames wait in the readback while the consumer is behind, so moRecordReadback returns VK_NOT_READY
+// returns how many frames were published
+uint32_t moPublishSharedRing(MoSharedRing ring);
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2018 Patrick Pelletier
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -10,6 +10,9 @@ layout(location = 1) in vec2 vertexTexcoord;
 layout(location = 2) in vec3 vertexNormal;
 layout(location = 3) in vec3 vertexTangent;
 layout(location = 4) in vec3 vertexBitangent;
+#ifdef COMPILING_INSTANCED
+layout(location = 5) in mat4 instanceModel;
+#endif
 layout(push_constant) uniform uPushConstant
 {
     mat4 uniformModel;
@@ -19,8 +22,13 @@ layout(push_constant) uniform uPushConstant
 
 void main()
 {
-    outData.vertex = vec3(pc.uniformModel * vec4(vertexPosition, 1.0));
-    gl_Position = pc.uniformProjection * pc.uniformView * pc.uniformModel * vec4(vertexPosition, 1.0);
+#ifdef COMPILING_INSTANCED
+    mat4 model = instanceModel;
+#else
+    mat4 model = pc.uniformModel;
+#endif
+    outData.vertex = vec3(model * vec4(vertexPosition, 1.0));
+    gl_Position = pc.uniformProjection * pc.uniformView * model * vec4(vertexPosition, 1.0);
 }
 #endif
 
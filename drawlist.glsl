@@ -0,0 +1,184 @@
+#version 450 core
+
+#ifdef COMPILING_COMPUTE
+layout(local_size_x = 64) in;
+
+struct DrawObject
+{
+    mat4 model;
+    vec4 boundingSphere;
+    uint firstIndex;
+    uint indexCount;
+    int  vertexOffset;
+    uint bucket;
+    uint bucketBase;
+};
+
+struct DrawCommand
+{
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int  vertexOffset;
+    uint firstInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Objects
+{
+    DrawObject objects[];
+};
+layout(std430, binding = 1) writeonly buffer Commands
+{
+    DrawCommand commands[];
+};
+layout(std430, binding = 2) buffer Counts
+{
+    uint counts[];
+};
+layout(std430, binding = 3) writeonly buffer Instances
+{
+    mat4 instances[];
+};
+layout(std140, binding = 4) uniform Cull
+{
+    mat4 viewProjection;
+    vec4 planes[6];
+    vec2 depthSize;
+    uint pyramidLevels;
+} cull;
+layout(binding = 5) uniform sampler2D depthPyramid;
+// one entry per object, whether the late phase found it visible, kept from frame to frame
+layout(std430, binding = 6) buffer Visibility
+{
+    uint visibility[];
+};
+layout(push_constant) uniform uPushConstant
+{
+    uint objectCount;
+    uint firstInstance;
+    uint frustum;
+    uint occlusion;
+    uint phase;
+    uint base;
+} pc;
+
+bool outsideFrustum(vec3 center, float radius)
+{
+    for (int i = 0; i < 6; ++i)
+        if (dot(cull.planes[i].xyz, center) + cull.planes[i].w < -radius)
+            return true;
+    return false;
+}
+
+bool occluded(vec3 center, float radius)
+{
+    // screen rectangle and nearest depth of the sphere's box, as this frame's camera sees it
+    vec2 lower = vec2(1.0);
+    vec2 upper = vec2(0.0);
+    float nearest = 1.0;
+    for (int i = 0; i < 8; ++i)
+    {
+        vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = cull.viewProjection * vec4(corner, 1.0);
+        if (clip.w <= 0.0)
+            return false;
+        vec3 ndc = clip.xyz / clip.w;
+        lower = min(lower, ndc.xy * 0.5 + 0.5);
+        upper = max(upper, ndc.xy * 0.5 + 0.5);
+        nearest = min(nearest, ndc.z);
+    }
+    ivec2 first = ivec2(clamp(lower, 0.0, 1.0) * cull.depthSize);
+    ivec2 last = ivec2(clamp(upper, 0.0, 1.0) * cull.depthSize);
+
+    // texel x of level n covers depth texels [x << (n + 1), (x + 1) << (n + 1)), pick the level where the rectangle spans 2x2 texels
+    ivec2 span = max(last - first, ivec2(1));
+    int level = max(0, int(ceil(log2(float(max(span.x, span.y))))) - 1);
+    if (any(greaterThan((last >> (level + 1)) - (first >> (level + 1)), ivec2(1))))
+        ++level;
+    if (level >= int(cull.pyramidLevels))
+        return false;
+
+    // odd sizes fold their last row and column into the last texel
+    ivec2 levelLast = textureSize(depthPyramid, level) - 1;
+    first = min(first >> (level + 1), levelLast);
+    last = min(last >> (level + 1), levelLast);
+    float farthest = max(max(texelFetch(depthPyramid, first, level).r, texelFetch(depthPyramid, ivec2(last.x, first.y), level).r),
+                         max(texelFetch(depthPyramid, ivec2(first.x, last.y), level).r, texelFetch(depthPyramid, last, level).r));
+    return nearest > farthest;
+}
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= pc.objectCount)
+        return;
+
+    DrawObject object = objects[index];
+    vec3 center = (object.model * vec4(object.boundingSphere.xyz, 1.0)).xyz;
+    float scale = max(max(length(object.model[0].xyz), length(object.model[1].xyz)), length(object.model[2].xyz));
+    float radius = object.boundingSphere.w * scale;
+    bool inside = pc.frustum == 0 || !outsideFrustum(center, radius);
+    if (pc.phase == 0)
+    {
+        // early phase, with occlusion only what the last late phase found visible is drawn
+        if (!inside || (pc.occlusion != 0 && visibility[index] == 0))
+            return;
+    }
+    else
+    {
+        // late phase, everything is tested against this frame's depth pyramid and what the early phase skipped is drawn
+        bool visible = inside && (pc.occlusion == 0 || !occluded(center, radius));
+        bool drawn = inside && visibility[index] != 0;
+        visibility[index] = visible ? 1 : 0;
+        if (!visible || drawn)
+            return;
+    }
+
+    // commands of a bucket are packed from its base, in no particular order
+    uint slot = pc.base + object.bucketBase + atomicAdd(counts[pc.base + object.bucket], 1);
+    commands[slot] = DrawCommand(object.indexCount, 1, object.firstIndex, object.vertexOffset, pc.firstInstance != 0 ? slot : 0);
+    instances[slot] = object.model;
+}
+#endif
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2018 Patrick Pelletier
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
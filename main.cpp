@@ -7,11 +7,15 @@
 #include <GLFW/glfw3.h>
 
 #include "phong.h"
+#include "scene.h"
 
 #include <linalg.h>
 
+#include <algorithm>
+#include <cstring>
 #include <experimental/filesystem>
 #include <functional>
+#include <unordered_map>
 #include <vector>
 
 #include <assimp/Importer.hpp>
@@ -201,6 +205,9 @@ struct MoHandles
 {
     std::vector<MoMaterial> materials;
     std::vector<MoMesh>     meshes;
+    // the meshes uploaded once more for draw lists, when loaded with a mesh pool
+    MoMeshPool                               meshPool;
+    std::unordered_map<MoMesh, MoMeshRange>  meshRanges;
 };
 
 void moDestroyHandles(MoHandles & handles)
@@ -209,6 +216,8 @@ void moDestroyHandles(MoHandles & handles)
         moDestroyMaterial(material);
     for (auto mesh : handles.meshes)
         moDestroyMesh(mesh);
+    if (handles.meshPool)
+        moDestroyMeshPool(handles.meshPool);
 }
 
 void parseNodes(const aiScene * scene, const std::vector<MoMaterial> & materials,
@@ -230,7 +239,7 @@ void parseNodes(const aiScene * scene, const std::vector<MoMaterial> & materials
     }
 }
 
-void load(const std::string & filename, MoHandles & handles, std::vector<MoNode> & nodes)
+void load(const std::string & filename, MoHandles & handles, std::vector<MoNode> & nodes, bool meshPool)
 {
     if (!filename.empty() && std::filesystem::exists(filename))
     {
@@ -280,6 +289,17 @@ void load(const std::string & filename, MoHandles & handles, std::vector<MoNode>
             handles.materials.push_back(materials[materialIdx]);
         }
 
+        if (meshPool && !handles.meshPool)
+        {
+            MoMeshPoolCreateInfo poolInfo = {};
+            for (uint32_t meshIdx = 0; meshIdx < scene->mNumMeshes; ++meshIdx)
+            {
+                poolInfo.vertexCapacity += scene->mMeshes[meshIdx]->mNumVertices;
+                poolInfo.indexCapacity += scene->mMeshes[meshIdx]->mNumFaces * 3;
+            }
+            moCreateMeshPool(&poolInfo, &handles.meshPool);
+        }
+
         std::vector<MoMesh> meshes(scene->mNumMeshes);
         for (uint32_t meshIdx = 0; meshIdx < scene->mNumMeshes; ++meshIdx)
         {
@@ -333,8 +353,12 @@ void load(const std::string & filename, MoHandles & handles, std::vector<MoNode>
             meshInfo.pNormals = normals.data();
             meshInfo.pTangents = tangents.data();
             meshInfo.pBitangents = bitangents.data();
+            meshInfo.lodCount = MO_MESH_LOD_COUNT;
             moCreateMesh(&meshInfo, &meshes[meshIdx]);
             handles.meshes.push_back(meshes[meshIdx]);
+            MoMeshRange range;
+            if (meshPool && moCreateMeshRange(handles.meshPool, &meshInfo, &range) == VK_SUCCESS)
+                handles.meshRanges[meshes[meshIdx]] = range;
         }
 
         nodes.push_back({std::filesystem::canonical(filename).c_str(), identity,
@@ -352,11 +376,30 @@ int main(int argc, char** argv)
     VkSurfaceKHR                 surface = VK_NULL_HANDLE;
     VkSurfaceFormatKHR           surfaceFormat = {};
     uint32_t                     frameIndex = 0;
+    // no tearing, lowest latency first, paced so that mailbox does not spin
+    const VkPresentModeKHR       presentModes[] = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_KHR };
     VkPipelineCache              pipelineCache = VK_NULL_HANDLE;
     const VkAllocationCallbacks* allocator = VK_NULL_HANDLE;
 
     MoInputs                     inputs = {};
 
+    // --draw-list draws the scene's unblended drawables with one indirect draw per material, culled on the GPU
+    // --record-contexts records each pass into its own secondary command buffer
+    bool useDrawList = false, useRecordContexts = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--draw-list") == 0)
+            useDrawList = true;
+        else if (strcmp(argv[i], "--record-contexts") == 0)
+            useRecordContexts = true;
+    }
+    if (useDrawList && useRecordContexts)
+    {
+        // indirect draws are recorded into the frame's primary command buffer
+        printf("--draw-list is ignored with --record-contexts\n");
+        useDrawList = false;
+    }
+
     // Initialization
     {
         int width, height;
@@ -395,6 +438,7 @@ int main(int argc, char** argv)
             createInfo.debugReport = VK_TRUE;
             createInfo.pDebugReportCallback = vk_debug_report;
 #endif
+            createInfo.memoryBudget = VK_TRUE;
             createInfo.pCheckVkResultFn = vk_check_result;
             moCreateInstance(&createInfo, &instance);
         }
@@ -424,6 +468,7 @@ int main(int argc, char** argv)
             createInfo.requestFormatsCount = 4;
             createInfo.requestColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
             createInfo.pSurfaceFormat = &surfaceFormat;
+            createInfo.memoryBudget = VK_TRUE;
             createInfo.pCheckVkResultFn = vk_check_result;
             moCreateDevice(&createInfo, &device);
         }
@@ -436,9 +481,13 @@ int main(int argc, char** argv)
             createInfo.surfaceFormat = surfaceFormat;
             createInfo.extent = {(uint32_t)width, (uint32_t)height};
             createInfo.vsync = VK_TRUE;
+            createInfo.pPresentModes = presentModes;
+            createInfo.presentModeCount = 2;
+            createInfo.frameCount = 3;
             createInfo.pAllocator = allocator;
             createInfo.pCheckVkResultFn = vk_check_result;
             moCreateSwapChain(&createInfo, &swapChain);
+            moSetTargetFrameTime(swapChain, 1.f / 120.f);
         }
     }
 
@@ -453,19 +502,23 @@ int main(int argc, char** argv)
         initInfo.pipelineCache = pipelineCache;
         initInfo.descriptorPool = device->descriptorPool;
         initInfo.pSwapChainSwapBuffers = swapChain->images;
-        initInfo.swapChainSwapBufferCount = MO_FRAME_COUNT;
+        initInfo.swapChainSwapBufferCount = swapChain->imageCount;
         initInfo.pSwapChainCommandBuffers = swapChain->frames;
-        initInfo.swapChainCommandBufferCount = MO_FRAME_COUNT;
+        initInfo.swapChainCommandBufferCount = swapChain->frameCount;
         initInfo.depthBuffer = swapChain->depthBuffer;
         initInfo.swapChainKHR = swapChain->swapChainKHR;
         initInfo.renderPass = swapChain->renderPass;
         initInfo.extent = swapChain->extent;
+        initInfo.pEnabledFeatures = &device->enabledFeatures;
+        initInfo.drawIndirectCount = device->drawIndirectCount;
+        initInfo.externalMemoryHost = device->externalMemoryHost;
+        initInfo.memoryBudget = device->memoryBudget;
         initInfo.pAllocator = allocator;
         initInfo.pCheckVkResultFn = device->pCheckVkResultFn;
         moInit(&initInfo);
     }
 
-    MoHandles handles;
+    MoHandles handles = {};
     MoNode root{"__root", identity, nullptr, nullptr, {}};
     MoCamera camera{"__default_camera", {0.f, 10.f, 30.f}, 0.f, 0.f};
     MoLight light{"__default_light", translation_matrix(float3{-300.f, 300.f, 150.f})};
@@ -495,14 +548,46 @@ int main(int argc, char** argv)
             std::ifstream fileStream("dome.frag.spv", std::ifstream::binary);
             mo_dome_shader_frag_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
         }
+        std::vector<char> mo_dome_shader_inst_vert_spv;
+        {
+            std::ifstream fileStream("dome.inst.vert.spv", std::ifstream::binary);
+            mo_dome_shader_inst_vert_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+        }
         pipelineCreateInfo.pVertexShader = (std::uint32_t*)mo_dome_shader_vert_spv.data();
         pipelineCreateInfo.vertexShaderSize = mo_dome_shader_vert_spv.size();
         pipelineCreateInfo.pFragmentShader = (std::uint32_t*)mo_dome_shader_frag_spv.data();
         pipelineCreateInfo.fragmentShaderSize = mo_dome_shader_frag_spv.size();
+        if (!mo_dome_shader_inst_vert_spv.empty())
+        {
+            pipelineCreateInfo.pInstancedVertexShader = (std::uint32_t*)mo_dome_shader_inst_vert_spv.data();
+            pipelineCreateInfo.instancedVertexShaderSize = mo_dome_shader_inst_vert_spv.size();
+        }
         pipelineCreateInfo.flags = MO_PIPELINE_FEATURE_NONE;
         moCreatePipeline(&pipelineCreateInfo, &domePipeline);
     }
 
+    // dome, depth and shaded passes
+    MoRecordContext recordContexts[3] = {};
+    if (useRecordContexts)
+    {
+        for (MoRecordContext & context : recordContexts)
+            moCreateRecordContext(&context);
+    }
+
+    // Scene
+    std::vector<const MoNode *> drawables;
+    std::vector<uint32_t> drawableNodes;
+    std::vector<uint32_t> nodeDrawables;
+    MoDrawList drawList = VK_NULL_HANDLE;
+    std::vector<uint32_t> drawableObjects;
+    MoScene scene;
+    moCreateScene(&scene);
+    MoBvh bvh;
+    {
+        MoBvhCreateInfo bvhCreateInfo = {};
+        moCreateBvh(&bvhCreateInfo, &bvh);
+    }
+
     // Main loop
     while (!glfwWindowShouldClose(window))
     {
@@ -511,8 +596,69 @@ int main(int argc, char** argv)
 
         if (!fileToLoad.empty())
         {
-            load(fileToLoad, handles, root.children);
+            load(fileToLoad, handles, root.children, useDrawList);
             fileToLoad = "";
+
+            // flatten the node tree, parents first
+            moDestroyScene(scene);
+            moCreateScene(&scene);
+            drawables.clear();
+            drawableNodes.clear();
+            std::function<void(const MoNode &, uint32_t)> flatten = [&](const MoNode & node, uint32_t parent)
+            {
+                const uint32_t index = moAddSceneNode(scene, parent, node.model);
+                if (node.material && node.mesh)
+                {
+                    drawables.push_back(&node);
+                    drawableNodes.push_back(index);
+                }
+                for (const MoNode & child : node.children)
+                {
+                    flatten(child, index);
+                }
+            };
+            flatten(root, MO_SCENE_NO_PARENT);
+            moUpdateScene(scene);
+
+            nodeDrawables.assign(scene->parents.size(), ~0u);
+            std::vector<MoBox> boxes(drawables.size());
+            for (size_t i = 0; i < drawables.size(); ++i)
+            {
+                nodeDrawables[drawableNodes[i]] = (uint32_t)i;
+                moTransformBox(&drawables[i]->mesh->aabb, scene->worlds[drawableNodes[i]], &boxes[i]);
+            }
+
+            moDestroyBvh(bvh);
+            MoBvhCreateInfo bvhCreateInfo = {};
+            bvhCreateInfo.pBoxes = boxes.data();
+            bvhCreateInfo.count = (uint32_t)boxes.size();
+            moCreateBvh(&bvhCreateInfo, &bvh);
+
+            if (useDrawList)
+            {
+                // blended drawables are sorted on the CPU and stay out of it
+                std::vector<MoDrawObject> objects;
+                drawableObjects.assign(drawables.size(), ~0u);
+                for (size_t i = 0; i < drawables.size(); ++i)
+                {
+                    auto range = handles.meshRanges.find(drawables[i]->mesh);
+                    if (range == handles.meshRanges.end() || drawables[i]->material->materialClass == MO_MATERIAL_CLASS_BLENDED)
+                        continue;
+                    drawableObjects[i] = (uint32_t)objects.size();
+                    objects.push_back({scene->worlds[drawableNodes[i]], range->second, drawables[i]->material});
+                }
+                if (drawList)
+                    moDestroyDrawList(drawList);
+                drawList = VK_NULL_HANDLE;
+                if (!objects.empty())
+                {
+                    MoDrawListCreateInfo drawListInfo = {};
+                    drawListInfo.pool = handles.meshPool;
+                    drawListInfo.maxObjects = (uint32_t)objects.size();
+                    moCreateDrawList(&drawListInfo, &drawList);
+                    moSetDrawListObjects(drawList, objects.data(), (uint32_t)objects.size());
+                }
+            }
         }
 
         {
@@ -533,9 +679,45 @@ int main(int argc, char** argv)
             }
         }
 
+        // only moved nodes are recomputed, and only their bounds refit
+        moUpdateScene(scene);
+        for (uint32_t node : scene->updated)
+        {
+            const uint32_t i = nodeDrawables[node];
+            if (i == ~0u)
+                continue;
+            MoBox box;
+            moTransformBox(&drawables[i]->mesh->aabb, scene->worlds[node], &box);
+            moSetBvhBox(bvh, i, &box);
+            if (drawList && drawableObjects[i] != ~0u)
+                moSetDrawListModel(drawList, drawableObjects[i], scene->worlds[node]);
+        }
+        moRefitBvh(bvh);
+
         // Frame begin
         VkSemaphore imageAcquiredSemaphore;
-        moBeginSwapChain(swapChain, &frameIndex, &imageAcquiredSemaphore);
+        moAcquireSwapChain(swapChain, &frameIndex, &imageAcquiredSemaphore);
+        if (drawList)
+        {
+            // the early draw commands are built before the render pass, the late ones once it drew them
+            MoDrawListCullInfo cullInfo = {};
+            cullInfo.viewProjection = mul(projection_matrix, inverse(camera.model()));
+            cullInfo.frustum = VK_TRUE;
+            cullInfo.occlusion = VK_TRUE;
+            moDispatchDrawList(drawList, frameIndex, &cullInfo);
+        }
+        moBeginRenderPass(swapChain, frameIndex, recordContexts[0] ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+
+        // draws go to the pass being recorded, or straight to the frame
+        MoRecordContext context = VK_NULL_HANDLE;
+        auto beginPass = [&](uint32_t pass) { context = recordContexts[pass]; if (context) moRecordBegin(context, frameIndex); };
+        auto endPass = [&]() { if (context) moRecordEnd(context); };
+        auto setPMV = [&](const MoPushConstant* pPMV) { if (context) moRecordSetPMV(context, pPMV); else moSetPMV(pPMV); };
+        auto bindMaterial = [&](MoMaterial material) { if (context) moRecordBindMaterial(context, material); else moBindMaterial(material); };
+        auto drawMesh = [&](MoMesh mesh) { if (context) moRecordDrawMesh(context, mesh); else moDrawMesh(mesh); };
+        auto drawMeshLod = [&](MoMesh mesh, uint32_t lod) { if (context) moRecordDrawMeshLod(context, mesh, lod); else moDrawMeshLod(mesh, lod); };
+
+        moProfileBegin("dome");
         moPipelineOverride(domePipeline);
         moBegin(frameIndex);
 
@@ -554,11 +736,14 @@ int main(int argc, char** argv)
             pmv.view = view;
             {
                 pmv.model = identity;
-                moSetPMV(&pmv);
-                moBindMaterial(domeMaterial);
-                moDrawMesh(sphereMesh);
+                beginPass(0);
+                setPMV(&pmv);
+                bindMaterial(domeMaterial);
+                drawMesh(sphereMesh);
+                endPass();
             }
         }
+        moProfileEnd();
         moPipelineOverride();
         moBegin(frameIndex);
         {
@@ -571,22 +756,88 @@ int main(int argc, char** argv)
             MoPushConstant pmv = {};
             pmv.projection = projection_matrix;
             pmv.view = inverse(camera.model());
-            std::function<void(const MoNode &, const float4x4 &)> draw = [&](const MoNode & node, const float4x4 & model)
+
+            std::vector<uint32_t> visible((drawables.size() + 31) / 32);
+            moCullBvh(bvh, mul(pmv.projection, pmv.view), visible.data());
+
+            // both passes must draw the same level of detail for depths to match
+            // blended drawables go last, farthest first
+            std::vector<std::pair<uint32_t, uint32_t>> drawn;
+            std::vector<std::pair<float, std::pair<uint32_t, uint32_t>>> blended;
+            for (size_t i = 0; i < drawables.size(); ++i)
             {
-                if (node.material && node.mesh)
+                if ((visible[i / 32] & (1u << (i % 32))) == 0)
+                    continue;
+                // culled and drawn by the draw list
+                if (drawList && drawableObjects[i] != ~0u)
+                    continue;
+                pmv.model = scene->worlds[drawableNodes[i]];
+                const uint32_t lod = moSelectMeshLod(drawables[i]->mesh, &pmv, (float)swapChain->extent.height);
+                if (drawables[i]->material->materialClass == MO_MATERIAL_CLASS_BLENDED)
                 {
-                    moBindMaterial(node.material);
-                    pmv.model = model;
-                    moSetPMV(&pmv);
-                    moDrawMesh(node.mesh);
+                    const float4 center = mul(pmv.view, mul(pmv.model, float4(drawables[i]->mesh->boundingSphere.xyz(), 1.f)));
+                    blended.emplace_back(center.z, std::make_pair((uint32_t)i, lod));
                 }
-                for (const MoNode & child : node.children)
+                else
                 {
-                    draw(child, mul(model, child.model));
+                    drawn.emplace_back((uint32_t)i, lod);
                 }
-            };
-            draw(root, root.model);
+            }
+            std::sort(blended.begin(), blended.end(), [](const std::pair<float, std::pair<uint32_t, uint32_t>> & l, const std::pair<float, std::pair<uint32_t, uint32_t>> & r) { return l.first < r.first; });
+            for (const auto & draw : blended)
+                drawn.push_back(draw.second);
+
+            // lay depth down first so that the phong pass shades each visible pixel once
+            // only opaque drawables write depth here, alpha tested and blended ones would hide what is behind them
+            moSetDrawPass(MO_DRAW_PASS_DEPTH_ONLY);
+            beginPass(1);
+            if (drawList)
+            {
+                // its models are its own, only the view and projection are used
+                setPMV(&pmv);
+                moDrawIndirect(drawList);
+            }
+            for (const auto & draw : drawn)
+            {
+                if (drawables[draw.first]->material->materialClass != MO_MATERIAL_CLASS_OPAQUE)
+                    continue;
+                // the pass pipeline is picked by the bound material's class
+                bindMaterial(drawables[draw.first]->material);
+                pmv.model = scene->worlds[drawableNodes[draw.first]];
+                setPMV(&pmv);
+                drawMeshLod(drawables[draw.first]->mesh, draw.second);
+            }
+            endPass();
+            moSetDrawPass(MO_DRAW_PASS_SHADED_EQUAL);
+            beginPass(2);
+            if (drawList)
+            {
+                setPMV(&pmv);
+                moDrawIndirect(drawList);
+
+                // objects left out of the early draws are tested against their depth and drawn late, depth first again
+                moSuspendRenderPass(swapChain, frameIndex);
+                moBuildDepthPyramid(frameIndex);
+                moDispatchDrawListLate(drawList, frameIndex);
+                moResumeRenderPass(swapChain, frameIndex);
+                moBegin(frameIndex);
+                moSetDrawPass(MO_DRAW_PASS_DEPTH_ONLY);
+                setPMV(&pmv);
+                moDrawIndirect(drawList, MO_DRAW_LIST_PHASE_LATE);
+                moSetDrawPass(MO_DRAW_PASS_SHADED_EQUAL);
+                moDrawIndirect(drawList, MO_DRAW_LIST_PHASE_LATE);
+            }
+            for (const auto & draw : drawn)
+            {
+                bindMaterial(drawables[draw.first]->material);
+                pmv.model = scene->worlds[drawableNodes[draw.first]];
+                setPMV(&pmv);
+                drawMeshLod(drawables[draw.first]->mesh, draw.second);
+            }
+            endPass();
         }
+        if (recordContexts[0])
+            moExecuteRecords(recordContexts, 3);
 
         // Frame end
         VkResult err = moEndSwapChain(swapChain, &frameIndex, &imageAcquiredSemaphore);
@@ -608,6 +859,8 @@ int main(int argc, char** argv)
             recreateInfo.surfaceFormat = surfaceFormat;
             recreateInfo.extent = {(uint32_t)width, (uint32_t)height};
             recreateInfo.vsync = VK_TRUE;
+            recreateInfo.pPresentModes = presentModes;
+            recreateInfo.presentModeCount = 2;
             moRecreateSwapChain(&recreateInfo, swapChain);
             err = VK_SUCCESS;
         }
@@ -618,11 +871,23 @@ int main(int argc, char** argv)
     moDestroyPipeline(domePipeline);
     moDestroyMaterial(domeMaterial);
 
+    // Scene
+    if (drawList)
+        moDestroyDrawList(drawList);
+    for (MoRecordContext context : recordContexts)
+    {
+        if (context)
+            moDestroyRecordContext(context);
+    }
+    moDestroyBvh(bvh);
+    moDestroyScene(scene);
+
     // Meshoui cleanup
     moDestroyHandles(handles);
     moDestroyMesh(sphereMesh);
 
     // Cleanup
+    moFlushDeletions();
     moShutdown();
     moDestroySwapChain(device, swapChain);
     vkDestroySurfaceKHR(instance, surface, allocator);
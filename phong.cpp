@@ -5,12 +5,33 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
 #include <numeric>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__AVX__) || ((defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// the AVX2 pixel conversion is built for its own target when the file is not, and picked once the CPU is known
+#if defined(__AVX2__)
+#define MO_AVX2_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MO_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
 using namespace linalg;
 using namespace linalg::aliases;
 
@@ -18,25 +39,251 @@ static VkDebugReportCallbackEXT     g_DebugReport   = VK_NULL_HANDLE;
 static MoDevice                     g_Device        = VK_NULL_HANDLE;
 static MoSwapChain                  g_SwapChain     = VK_NULL_HANDLE;
 static VkInstance                   g_Instance      = VK_NULL_HANDLE;
+// instance extensions enabled by moCreateInstance that optional device extensions depend on
+static VkBool32                     g_InstanceProperties2 = VK_FALSE;
+static VkBool32                     g_InstanceExternalMemoryCapabilities = VK_FALSE;
 static VkPipelineCache              g_PipelineCache = VK_NULL_HANDLE;
 static MoPipeline                   g_Pipeline      = VK_NULL_HANDLE;
 static MoPipeline                   g_StashedPipeline = VK_NULL_HANDLE;
 static uint32_t                     g_FrameIndex = 0;
 static const VkAllocationCallbacks* g_Allocator     = VK_NULL_HANDLE;
+static VkPipeline                   g_BoundPipeline = VK_NULL_HANDLE;
+static VkSubpassContents            g_SubpassContents = VK_SUBPASS_CONTENTS_INLINE;
+static MoDrawPass                   g_DrawPass = MO_DRAW_PASS_SHADED;
+static MoMaterialClass              g_MaterialClass = MO_MATERIAL_CLASS_OPAQUE;
+static VkDescriptorSetLayout        g_DrawListSetLayout = VK_NULL_HANDLE;
+static VkPipelineLayout             g_DrawListPipelineLayout = VK_NULL_HANDLE;
+static VkPipeline                   g_DrawListPipeline = VK_NULL_HANDLE;
+static PFN_vkCmdDrawIndexedIndirectCountKHR g_CmdDrawIndexedIndirectCount = nullptr;
+static PFN_vkGetPhysicalDeviceMemoryProperties2KHR g_GetPhysicalDeviceMemoryProperties2 = nullptr;
+// running totals of the memory allocated, they outlive moShutdown since swap chains can be destroyed after it
+// record contexts may allocate from their own threads
+static std::mutex                   g_MemoryMutex;
+static VkDeviceSize                 g_MemoryCategories[MO_MEMORY_CATEGORY_COUNT] = {};
+static VkDeviceSize                 g_MemoryHeaps[VK_MAX_MEMORY_HEAPS] = {};
+static uint32_t                     g_AllocationCount = 0;
+static VkDescriptorSetLayout        g_DepthPyramidSetLayout = VK_NULL_HANDLE;
+static VkPipelineLayout             g_DepthPyramidPipelineLayout = VK_NULL_HANDLE;
+static VkPipeline                   g_DepthPyramidPipeline = VK_NULL_HANDLE;
+
+// per-instance model matrices written during a frame, blocks are chained when full and coalesced once the frame comes round again
+struct MoInstanceRing
+{
+    std::vector<MoDeviceBuffer> blocks;
+    uint32_t                    block;
+    VkDeviceSize                offset;
+};
+static MoInstanceRing               g_InstanceRing[MO_FRAME_COUNT];
+static const VkDeviceSize           g_InstanceBlockSize = 1024 * sizeof(linalg::aliases::float4x4);
+
+// one per recording thread, each with its own pools so that no two threads ever touch the same command pool
+struct MoRecordContext_T
+{
+    VkCommandPool   pool[MO_FRAME_COUNT];
+    VkCommandBuffer buffer[MO_FRAME_COUNT];
+    MoInstanceRing  instanceRing[MO_FRAME_COUNT];
+    MoPipeline      pipeline;
+    MoDrawPass      drawPass;
+    MoMaterialClass materialClass;
+    VkPipeline      boundPipeline;
+    uint32_t        frameIndex;
+    // added to the frame's by moExecuteRecords
+    MoFrameStats    stats;
+};
+
+#define MO_DEPTH_PYRAMID_LEVELS 16
+
+// max depth of the frame, level 0 is half the size of the depth buffer, rounded down like any mip level
+struct MoDepthPyramid
+{
+    VkImage         image;
+    VkDeviceMemory  memory;
+    uint32_t        heapIndex;
+    VkDeviceSize    allocationSize;
+    VkImageView     view;
+    VkImageView     levelViews[MO_DEPTH_PYRAMID_LEVELS];
+    VkDescriptorSet levelSets[MO_DEPTH_PYRAMID_LEVELS];
+    VkSampler       sampler;
+    uint32_t        levelCount;
+    VkExtent2D      depthExtent;
+    VkImage         depthImage;
+    VkBool32        valid;
+    uint32_t        generation;
+};
+static MoDepthPyramid               g_DepthPyramid;
+
+// destroyed once every frame submitted before it was queued has retired
+struct MoDeletion
+{
+    uint64_t              serial;
+    std::function<void()> destroy;
+};
+static std::vector<MoDeletion>      g_Deletions;
+static uint64_t                     g_SubmitSerial = 0;
+static uint64_t                     g_RetiredSerial = 0;
+static std::vector<MoView>          g_Views;
+static MoPushConstant               g_PushConstant = {}; // as last set with moSetPMV, restored once the views are cleared
+static bool                         g_RestoreView = false; // views were cleared, the next draw restores g_PushConstant's
+static MoFrameStats                 g_FrameStats = {};
+static MoFrameStats                 g_LastFrameStats = {};
+static uint64_t                     g_RecordStart = 0;
+
+// timestamps of the scopes recorded in one frame, read back once the frame is reused
+struct MoProfileRecord
+{
+    const char* pName;
+    VkPipeline  pipeline;
+    uint32_t    parent;
+    uint32_t    depth;
+    uint32_t    query;  // of its begin timestamp, the end one follows
+    bool        leaf;   // moBegin and pipeline switch scopes
+};
+struct MoProfileFrame
+{
+    std::vector<MoProfileRecord> scopes;
+    std::vector<uint32_t>        open;
+    uint32_t                     queryCount;
+    bool                         recorded;
+};
+static VkQueryPool                  g_ProfileQueries = VK_NULL_HANDLE;
+static MoProfileFrame               g_ProfileFrames[MO_FRAME_COUNT];
+static uint32_t                     g_ProfileFrame = ~0u; // being recorded, ~0u when none is
+static std::vector<MoProfileScope>  g_Profile;
+static float                        g_TimestampPeriod = 1.f;
+static uint64_t                     g_TimestampMask = ~0ull;
+
+// mirrors the push constant in hiz.glsl
+struct MoDepthPyramidConstant
+{
+    int32_t sourceSize[2];
+    int32_t destinationSize[2];
+};
+
+// mirrors DrawObject in drawlist.glsl (std430)
+struct MoDrawObjectGPU
+{
+    linalg::aliases::float4x4 model;
+    linalg::aliases::float4   boundingSphere;
+    uint32_t                  firstIndex;
+    uint32_t                  indexCount;
+    int32_t                   vertexOffset;
+    uint32_t                  bucket;
+    uint32_t                  bucketBase;
+    uint32_t                  padding[3];
+};
+
+// mirrors the push constant in drawlist.glsl
+struct MoDrawListConstant
+{
+    uint32_t objectCount;
+    uint32_t firstInstance;
+    uint32_t frustum;
+    uint32_t occlusion;
+    uint32_t phase;
+    uint32_t base;  // first command, count and instance of the phase
+};
+
+// mirrors the Cull uniform block in drawlist.glsl (std140)
+struct MoDrawListCull
+{
+    linalg::aliases::float4x4 viewProjection;
+    linalg::aliases::float4   planes[6];
+    linalg::aliases::float2   depthSize;
+    uint32_t                  pyramidLevels;
+    uint32_t                  padding;
+};
+
+// objects sharing a material, drawn with one indirect draw
+struct MoDrawListBucket
+{
+    MoMaterial material;
+    uint32_t   firstCommand;
+    uint32_t   commandCount;
+};
+
+struct MoDrawList_T
+{
+    MoMeshPool                    pool;
+    uint32_t                      maxObjects;
+    std::vector<MoDrawObjectGPU>  objects;
+    std::vector<MoDrawListBucket> buckets;
+    uint32_t                      version;
+    // objects are copied once per frame when they change so that updates never race the GPU
+    MoDeviceBuffer                objectBuffer[MO_FRAME_COUNT];
+    uint32_t                      objectVersion[MO_FRAME_COUNT];
+    std::vector<MoDrawListBucket> frameBuckets[MO_FRAME_COUNT];
+    MoDeviceBuffer                commandBuffer[MO_FRAME_COUNT];
+    MoDeviceBuffer                countBuffer[MO_FRAME_COUNT];
+    MoDeviceBuffer                instanceBuffer[MO_FRAME_COUNT];
+    MoDeviceBuffer                cullBuffer[MO_FRAME_COUNT];
+    VkDescriptorSet               descriptorSet[MO_FRAME_COUNT];
+    uint32_t                      pyramidGeneration[MO_FRAME_COUNT];
+    // what the last late phase found visible, reset when the objects change
+    MoDeviceBuffer                visibilityBuffer;
+    VkBool32                      resetVisibility;
+    // as requested by the early phase of the frame being recorded
+    VkBool32                      cullFrustum;
+    VkBool32                      cullOcclusion;
+    VkBool32                      late[MO_FRAME_COUNT];
+};
+
+struct MoReadbackSlot
+{
+    MoDeviceBuffer      buffer;
+    const std::uint8_t* pPixels;  // persistently mapped
+    VkFence             fence;    // of the frame the copy was recorded in
+    uint64_t            serial;
+    VkBool32            pending;  // recorded and not yet released
+    VkBool32            taken;    // handed out by moTakeReadback
+    VkBool32            imported; // the buffer's memory is the caller's host memory
+};
+
+struct MoReadback_T
+{
+    VkExtent2D                  extent;
+    uint32_t                    rowPitch;
+    std::vector<MoReadbackSlot> slots;
+    // slots are recorded into round robin, so the one after the last recorded is the oldest
+    uint32_t                    next;
+    void                      (*pCallback)(const std::uint8_t* pPixels, VkExtent2D extent, uint32_t rowPitch, void* pUserData);
+    void*                       pUserData;
+};
 
 template <typename T, size_t N> size_t countof(T (& arr)[N]) { return std::extent<T[N]>::value; }
 
-static uint32_t memoryType(VkPhysicalDevice physicalDevice, VkMemoryPropertyFlags properties, uint32_t type_bits)
+static uint32_t memoryType(MoDevice device, VkMemoryPropertyFlags properties, uint32_t type_bits)
 {
-    VkPhysicalDeviceMemoryProperties prop;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &prop);
+    const VkPhysicalDeviceMemoryProperties & prop = device->memoryProperties;
     for (uint32_t i = 0; i < prop.memoryTypeCount; i++)
         if ((prop.memoryTypes[i].propertyFlags & properties) == properties && type_bits & (1<<i))
             return i;
     return 0xFFFFFFFF;
 }
 
-static void createBuffer(MoDevice device, MoDeviceBuffer *pDeviceBuffer, VkDeviceSize size, VkBufferUsageFlags usage)
+// account for an allocation of memoryTypeIndex, returns the heap to release it from
+static uint32_t trackMemory(MoDevice device, uint32_t memoryTypeIndex, VkDeviceSize size, MoMemoryCategory category)
+{
+    const VkPhysicalDeviceMemoryProperties & prop = device->memoryProperties;
+    const uint32_t heapIndex = memoryTypeIndex < prop.memoryTypeCount ? prop.memoryTypes[memoryTypeIndex].heapIndex : 0;
+    std::lock_guard<std::mutex> lock(g_MemoryMutex);
+    g_MemoryCategories[category] += size;
+    g_MemoryHeaps[heapIndex] += size;
+    ++g_AllocationCount;
+    return heapIndex;
+}
+
+static void releaseMemory(uint32_t heapIndex, VkDeviceSize size, MoMemoryCategory category)
+{
+    if (size == 0)
+        return;
+    std::lock_guard<std::mutex> lock(g_MemoryMutex);
+    g_MemoryCategories[category] -= size;
+    g_MemoryHeaps[heapIndex] -= size;
+    --g_AllocationCount;
+}
+
+// properties are preferred, the buffer is host visible either way
+static void createBuffer(MoDevice device, MoDeviceBuffer *pDeviceBuffer, VkDeviceSize size, VkBufferUsageFlags usage, MoMemoryCategory category, VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
 {
     MoDeviceBuffer deviceBuffer = *pDeviceBuffer = new MoDeviceBuffer_T();
     *deviceBuffer = {};
@@ -59,9 +306,15 @@ static void createBuffer(MoDevice device, MoDeviceBuffer *pDeviceBuffer, VkDevic
         VkMemoryAllocateInfo alloc_info = {};
         alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
         alloc_info.allocationSize = req.size;
-        alloc_info.memoryTypeIndex = memoryType(device->physicalDevice, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
+        alloc_info.memoryTypeIndex = memoryType(device, properties | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
+        if (alloc_info.memoryTypeIndex == 0xFFFFFFFF)
+            alloc_info.memoryTypeIndex = memoryType(device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
         err = vkAllocateMemory(device->device, &alloc_info, g_Allocator, &deviceBuffer->memory);
         device->pCheckVkResultFn(err);
+        deviceBuffer->memoryProperties = device->memoryProperties.memoryTypes[alloc_info.memoryTypeIndex].propertyFlags;
+        deviceBuffer->category = category;
+        deviceBuffer->heapIndex = trackMemory(device, alloc_info.memoryTypeIndex, req.size, category);
+        deviceBuffer->allocationSize = req.size;
     }
 
     err = vkBindBufferMemory(device->device, deviceBuffer->buffer, deviceBuffer->memory, 0);
@@ -69,19 +322,22 @@ static void createBuffer(MoDevice device, MoDeviceBuffer *pDeviceBuffer, VkDevic
     deviceBuffer->size = size;
 }
 
-static void uploadBuffer(MoDevice device, MoDeviceBuffer deviceBuffer, VkDeviceSize dataSize, const void *pData)
+static void uploadBuffer(MoDevice device, MoDeviceBuffer deviceBuffer, VkDeviceSize dataSize, const void *pData, VkDeviceSize offset = 0)
 {
+    // memoryAlignment is a multiple of nonCoherentAtomSize, flushed ranges must start on one
+    const VkDeviceSize mapOffset = offset - offset % device->memoryAlignment;
     VkResult err;
     {
         void* dest = nullptr;
-        err = vkMapMemory(device->device, deviceBuffer->memory, 0, dataSize, 0, &dest);
+        err = vkMapMemory(device->device, deviceBuffer->memory, mapOffset, offset - mapOffset + dataSize, 0, &dest);
         device->pCheckVkResultFn(err);
-        memcpy(dest, pData, dataSize);
+        memcpy((uint8_t*)dest + (offset - mapOffset), pData, dataSize);
     }
     {
         VkMappedMemoryRange range = {};
         range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
         range.memory = deviceBuffer->memory;
+        range.offset = mapOffset;
         range.size = VK_WHOLE_SIZE;
         err = vkFlushMappedMemoryRanges(device->device, 1, &range);
         device->pCheckVkResultFn(err);
@@ -94,10 +350,58 @@ static void deleteBuffer(MoDevice device, MoDeviceBuffer deviceBuffer)
 {
     vkDestroyBuffer(device->device, deviceBuffer->buffer, g_Allocator);
     vkFreeMemory(device->device, deviceBuffer->memory, g_Allocator);
+    releaseMemory(deviceBuffer->heapIndex, deviceBuffer->allocationSize, deviceBuffer->category);
     delete deviceBuffer;
 }
 
-static void createBuffer(MoDevice device, MoImageBuffer *pImageBuffer, const VkExtent3D & extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspectMask)
+static void resetInstanceRing(MoDevice device, MoInstanceRing & ring)
+{
+    if (ring.blocks.size() > 1)
+    {
+        // the frame's fence has signaled, replace the chain with a single block large enough for all of it
+        VkDeviceSize size = 0;
+        for (MoDeviceBuffer block : ring.blocks)
+        {
+            size += block->size;
+            deleteBuffer(device, block);
+        }
+        ring.blocks.resize(1);
+        createBuffer(device, &ring.blocks[0], size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_UNIFORM);
+    }
+    ring.block = 0;
+    ring.offset = 0;
+}
+
+static void deleteInstanceRing(MoDevice device, MoInstanceRing & ring)
+{
+    for (MoDeviceBuffer block : ring.blocks)
+        deleteBuffer(device, block);
+    ring.blocks.clear();
+    ring.block = 0;
+    ring.offset = 0;
+}
+
+static void allocateInstances(MoDevice device, MoInstanceRing & ring, VkDeviceSize size, MoDeviceBuffer *pDeviceBuffer, VkDeviceSize *pOffset)
+{
+    // offsets stay aligned so that the flushed ranges respect nonCoherentAtomSize
+    VkDeviceSize offset = ((ring.offset + device->memoryAlignment - 1) / device->memoryAlignment) * device->memoryAlignment;
+    while (ring.block < ring.blocks.size() && offset + size > ring.blocks[ring.block]->size)
+    {
+        ++ring.block;
+        offset = 0;
+    }
+    if (ring.block == ring.blocks.size())
+    {
+        VkDeviceSize blockSize = ring.blocks.empty() ? g_InstanceBlockSize : ring.blocks.back()->size * 2;
+        ring.blocks.emplace_back();
+        createBuffer(device, &ring.blocks.back(), std::max(size, blockSize), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_UNIFORM);
+    }
+    *pDeviceBuffer = ring.blocks[ring.block];
+    *pOffset = offset;
+    ring.offset = offset + size;
+}
+
+static void createBuffer(MoDevice device, MoImageBuffer *pImageBuffer, const VkExtent3D & extent, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspectMask, MoMemoryCategory category)
 {
     MoImageBuffer imageBuffer = *pImageBuffer = new MoImageBuffer_T();
     *imageBuffer = {};
@@ -125,9 +429,12 @@ static void createBuffer(MoDevice device, MoImageBuffer *pImageBuffer, const VkE
         VkMemoryAllocateInfo alloc_info = {};
         alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
         alloc_info.allocationSize = req.size;
-        alloc_info.memoryTypeIndex = memoryType(device->physicalDevice, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits);
+        alloc_info.memoryTypeIndex = memoryType(device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits);
         err = vkAllocateMemory(device->device, &alloc_info, g_Allocator, &imageBuffer->memory);
         device->pCheckVkResultFn(err);
+        imageBuffer->category = category;
+        imageBuffer->heapIndex = trackMemory(device, alloc_info.memoryTypeIndex, req.size, category);
+        imageBuffer->allocationSize = req.size;
         err = vkBindImageMemory(device->device, imageBuffer->image, imageBuffer->memory, 0);
         device->pCheckVkResultFn(err);
     }
@@ -196,9 +503,357 @@ static void deleteBuffer(MoDevice device, MoImageBuffer imageBuffer)
     vkDestroyImageView(device->device, imageBuffer->view, g_Allocator);
     vkDestroyImage(device->device, imageBuffer->image, g_Allocator);
     vkFreeMemory(device->device, imageBuffer->memory, g_Allocator);
+    releaseMemory(imageBuffer->heapIndex, imageBuffer->allocationSize, imageBuffer->category);
     delete imageBuffer;
 }
 
+// the sampler and the level descriptor sets outlive the pyramid's image, they are rewritten here
+static void createDepthPyramid(MoDevice device, MoDepthPyramid & pyramid, MoImageBuffer depthBuffer, VkExtent2D depthExtent)
+{
+    const VkExtent2D extent = {std::max(1u, depthExtent.width / 2), std::max(1u, depthExtent.height / 2)};
+    pyramid.levelCount = 1;
+    while (pyramid.levelCount < MO_DEPTH_PYRAMID_LEVELS && (std::max(extent.width, extent.height) >> pyramid.levelCount) > 0)
+        ++pyramid.levelCount;
+    pyramid.depthExtent = depthExtent;
+    pyramid.depthImage = depthBuffer->image;
+    pyramid.valid = VK_FALSE;
+    ++pyramid.generation;
+
+    VkResult err;
+    {
+        VkImageCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        info.imageType = VK_IMAGE_TYPE_2D;
+        info.format = VK_FORMAT_R32_SFLOAT;
+        info.extent = {extent.width, extent.height, 1};
+        info.mipLevels = pyramid.levelCount;
+        info.arrayLayers = 1;
+        info.samples = VK_SAMPLE_COUNT_1_BIT;
+        info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        err = vkCreateImage(device->device, &info, g_Allocator, &pyramid.image);
+        device->pCheckVkResultFn(err);
+    }
+    {
+        VkMemoryRequirements req;
+        vkGetImageMemoryRequirements(device->device, pyramid.image, &req);
+        VkMemoryAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = req.size;
+        alloc_info.memoryTypeIndex = memoryType(device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits);
+        err = vkAllocateMemory(device->device, &alloc_info, g_Allocator, &pyramid.memory);
+        device->pCheckVkResultFn(err);
+        pyramid.heapIndex = trackMemory(device, alloc_info.memoryTypeIndex, req.size, MO_MEMORY_CATEGORY_ATTACHMENT);
+        pyramid.allocationSize = req.size;
+        err = vkBindImageMemory(device->device, pyramid.image, pyramid.memory, 0);
+        device->pCheckVkResultFn(err);
+    }
+    {
+        VkImageViewCreateInfo view_info = {};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = pyramid.image;
+        view_info.format = VK_FORMAT_R32_SFLOAT;
+        view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+        view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+        view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+        view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = pyramid.levelCount;
+        view_info.subresourceRange.baseArrayLayer = 0;
+        view_info.subresourceRange.layerCount = 1;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        err = vkCreateImageView(device->device, &view_info, g_Allocator, &pyramid.view);
+        device->pCheckVkResultFn(err);
+        view_info.subresourceRange.levelCount = 1;
+        for (uint32_t level = 0; level < pyramid.levelCount; ++level)
+        {
+            view_info.subresourceRange.baseMipLevel = level;
+            err = vkCreateImageView(device->device, &view_info, g_Allocator, &pyramid.levelViews[level]);
+            device->pCheckVkResultFn(err);
+        }
+    }
+    if (g_DepthPyramidPipeline != VK_NULL_HANDLE)
+    {
+        VkDescriptorSetLayout descriptorSetLayout[MO_DEPTH_PYRAMID_LEVELS] = {};
+        for (size_t i = 0; i < MO_DEPTH_PYRAMID_LEVELS; ++i)
+            descriptorSetLayout[i] = g_DepthPyramidSetLayout;
+        VkDescriptorSetAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = device->descriptorPool;
+        alloc_info.descriptorSetCount = MO_DEPTH_PYRAMID_LEVELS;
+        alloc_info.pSetLayouts = descriptorSetLayout;
+        err = vkAllocateDescriptorSets(device->device, &alloc_info, pyramid.levelSets);
+        device->pCheckVkResultFn(err);
+
+        // each level is reduced from the one above it, level 0 from the depth buffer itself
+        for (uint32_t level = 0; level < pyramid.levelCount; ++level)
+        {
+            VkDescriptorImageInfo imageInfo[2] = {};
+            imageInfo[0].sampler = pyramid.sampler;
+            imageInfo[0].imageView = level == 0 ? depthBuffer->view : pyramid.levelViews[level - 1];
+            imageInfo[0].imageLayout = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+            imageInfo[1].imageView = pyramid.levelViews[level];
+            imageInfo[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+            VkWriteDescriptorSet descriptorWrite[2] = {};
+            for (uint32_t binding = 0; binding < 2; ++binding)
+            {
+                descriptorWrite[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrite[binding].dstSet = pyramid.levelSets[level];
+                descriptorWrite[binding].dstBinding = binding;
+                descriptorWrite[binding].dstArrayElement = 0;
+                descriptorWrite[binding].descriptorCount = 1;
+                descriptorWrite[binding].pImageInfo = &imageInfo[binding];
+            }
+            descriptorWrite[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrite[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            vkUpdateDescriptorSets(device->device, (uint32_t)countof(descriptorWrite), descriptorWrite, 0, nullptr);
+        }
+    }
+}
+
+// box and sphere centered on it, loose but cheap
+static void computeBounds(const float3 *pVertices, uint32_t vertexCount, MoBox *pBox, float4 *pSphere)
+{
+    MoBox box = {float3(0.f), float3(0.f)};
+    if (vertexCount > 0)
+        box.min = box.max = pVertices[0];
+    for (uint32_t i = 1; i < vertexCount; ++i)
+    {
+        box.min = linalg::min(box.min, pVertices[i]);
+        box.max = linalg::max(box.max, pVertices[i]);
+    }
+    const float3 center = (box.min + box.max) * 0.5f;
+    float radius2 = 0.f;
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        radius2 = std::max(radius2, linalg::length2(pVertices[i] - center));
+    *pBox = box;
+    *pSphere = float4(center, std::sqrt(radius2));
+}
+
+// sum of squared distances to planes, weighted by the area of the triangles they come from
+struct MoQuadric
+{
+    float a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+    float weight;
+};
+
+static void addPlane(MoQuadric & q, const float4 & plane, float weight)
+{
+    q.a00 += weight * plane.x * plane.x; q.a01 += weight * plane.x * plane.y; q.a02 += weight * plane.x * plane.z; q.a03 += weight * plane.x * plane.w;
+    q.a11 += weight * plane.y * plane.y; q.a12 += weight * plane.y * plane.z; q.a13 += weight * plane.y * plane.w;
+    q.a22 += weight * plane.z * plane.z; q.a23 += weight * plane.z * plane.w;
+    q.a33 += weight * plane.w * plane.w;
+    q.weight += weight;
+}
+
+static void addQuadric(MoQuadric & q, const MoQuadric & other)
+{
+    q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02; q.a03 += other.a03;
+    q.a11 += other.a11; q.a12 += other.a12; q.a13 += other.a13;
+    q.a22 += other.a22; q.a23 += other.a23;
+    q.a33 += other.a33;
+    q.weight += other.weight;
+}
+
+// mean squared distance of v to the quadric's planes
+static float evaluateQuadric(const MoQuadric & q, const float3 & v)
+{
+    const float e = q.a00 * v.x * v.x + 2.f * q.a01 * v.x * v.y + 2.f * q.a02 * v.x * v.z + 2.f * q.a03 * v.x
+                  + q.a11 * v.y * v.y + 2.f * q.a12 * v.y * v.z + 2.f * q.a13 * v.y
+                  + q.a22 * v.z * v.z + 2.f * q.a23 * v.z
+                  + q.a33;
+    return q.weight > 0.f ? std::max(e, 0.f) / q.weight : 0.f;
+}
+
+// quadric error edge collapse onto existing vertices, so that every level shares the full mesh's vertex buffer
+// levels are appended to indices after the full mesh, returns how many levels there are
+static uint32_t generateLods(const float3 *pVertices, uint32_t vertexCount, const uint32_t *pIndices, uint32_t indexCount, uint32_t lodCount, std::vector<uint32_t> & indices, MoMeshLod *pLods)
+{
+    indices.assign(pIndices, pIndices + indexCount);
+    pLods[0] = {0, indexCount, 0.f};
+
+    std::vector<MoQuadric> quadrics(vertexCount, MoQuadric{});
+    for (uint32_t i = 0; i + 2 < indexCount; i += 3)
+    {
+        const float3 & p0 = pVertices[pIndices[i]];
+        float3 normal = cross(pVertices[pIndices[i + 1]] - p0, pVertices[pIndices[i + 2]] - p0);
+        const float area = length(normal);
+        if (area == 0.f)
+            continue;
+        normal /= area;
+        const float4 plane(normal, -dot(normal, p0));
+        for (uint32_t k = 0; k < 3; ++k)
+            addPlane(quadrics[pIndices[i + k]], plane, area * 0.5f);
+    }
+
+    // open edges never move so that no cracks appear, this includes texture and normal seams since their vertices are split
+    std::vector<uint8_t> locked(vertexCount, 0);
+    {
+        std::unordered_map<uint64_t, uint32_t> edges;
+        for (uint32_t i = 0; i + 2 < indexCount; i += 3)
+        {
+            for (uint32_t k = 0; k < 3; ++k)
+            {
+                const uint32_t a = pIndices[i + k], b = pIndices[i + (k + 1) % 3];
+                ++edges[(uint64_t)std::min(a, b) << 32 | std::max(a, b)];
+            }
+        }
+        for (const auto & edge : edges)
+        {
+            if (edge.second == 1)
+                locked[edge.first >> 32] = locked[edge.first & 0xFFFFFFFF] = 1;
+        }
+    }
+
+    struct Collapse
+    {
+        uint32_t from;
+        uint32_t to;
+        float    cost;
+    };
+    std::vector<uint32_t> triangles(indices);
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> adjacencyOffsets(vertexCount + 1);
+    std::vector<uint32_t> adjacency;
+    std::vector<uint8_t> touched(vertexCount);
+    float error = 0.f;
+    uint32_t lod = 1;
+    for (; lod < lodCount; ++lod)
+    {
+        const size_t target = triangles.size() / 6 * 3;
+        while (triangles.size() > target)
+        {
+            // each pass collapses the cheapest edges first, touching every vertex at most once so that costs stay valid
+            collapses.clear();
+            for (size_t i = 0; i < triangles.size(); i += 3)
+            {
+                for (uint32_t k = 0; k < 3; ++k)
+                {
+                    const uint32_t a = triangles[i + k], b = triangles[i + (k + 1) % 3];
+                    if (a > b || (locked[a] && locked[b]))
+                        continue;
+                    MoQuadric q = quadrics[a];
+                    addQuadric(q, quadrics[b]);
+                    const float toB = locked[a] ? std::numeric_limits<float>::max() : evaluateQuadric(q, pVertices[b]);
+                    const float toA = locked[b] ? std::numeric_limits<float>::max() : evaluateQuadric(q, pVertices[a]);
+                    collapses.push_back(toB <= toA ? Collapse{a, b, toB} : Collapse{b, a, toA});
+                }
+            }
+            if (collapses.empty())
+                break;
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse & l, const Collapse & r) { return l.cost < r.cost; });
+
+            std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+            for (uint32_t index : triangles)
+                ++adjacencyOffsets[index + 1];
+            std::partial_sum(adjacencyOffsets.begin(), adjacencyOffsets.end(), adjacencyOffsets.begin());
+            adjacency.resize(triangles.size());
+            {
+                std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+                for (size_t i = 0; i < triangles.size(); ++i)
+                    adjacency[fill[triangles[i]]++] = (uint32_t)(i / 3);
+            }
+
+            std::fill(touched.begin(), touched.end(), 0);
+            size_t remaining = triangles.size();
+            size_t applied = 0;
+            for (const Collapse & collapse : collapses)
+            {
+                if (remaining <= target)
+                    break;
+                if (touched[collapse.from] || touched[collapse.to])
+                    continue;
+
+                // reject collapses that fold a triangle over
+                bool flips = false;
+                size_t degenerate = 0;
+                for (uint32_t k = adjacencyOffsets[collapse.from]; k < adjacencyOffsets[collapse.from + 1] && !flips; ++k)
+                {
+                    const uint32_t *pTriangle = &triangles[adjacency[k] * 3];
+                    if (pTriangle[0] == collapse.to || pTriangle[1] == collapse.to || pTriangle[2] == collapse.to)
+                    {
+                        ++degenerate;
+                        continue;
+                    }
+                    float3 before[3], after[3];
+                    for (uint32_t v = 0; v < 3; ++v)
+                    {
+                        before[v] = pVertices[pTriangle[v]];
+                        after[v] = pTriangle[v] == collapse.from ? pVertices[collapse.to] : before[v];
+                    }
+                    flips = dot(cross(before[1] - before[0], before[2] - before[0]), cross(after[1] - after[0], after[2] - after[0])) <= 0.f;
+                }
+                if (flips)
+                    continue;
+
+                for (uint32_t k = adjacencyOffsets[collapse.from]; k < adjacencyOffsets[collapse.from + 1]; ++k)
+                {
+                    uint32_t *pTriangle = &triangles[adjacency[k] * 3];
+                    for (uint32_t v = 0; v < 3; ++v)
+                    {
+                        touched[pTriangle[v]] = 1;
+                        if (pTriangle[v] == collapse.from)
+                            pTriangle[v] = collapse.to;
+                    }
+                }
+                addQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+                error = std::max(error, collapse.cost);
+                remaining -= degenerate * 3;
+                ++applied;
+            }
+            if (applied == 0)
+                break;
+
+            size_t write = 0;
+            for (size_t i = 0; i < triangles.size(); i += 3)
+            {
+                if (triangles[i] == triangles[i + 1] || triangles[i + 1] == triangles[i + 2] || triangles[i + 2] == triangles[i])
+                    continue;
+                triangles[write++] = triangles[i];
+                triangles[write++] = triangles[i + 1];
+                triangles[write++] = triangles[i + 2];
+            }
+            triangles.resize(write);
+        }
+
+        // a level that removes little is not worth its indices
+        if (triangles.size() * 4 > pLods[lod - 1].indexCount * 3)
+            break;
+        pLods[lod] = {(uint32_t)indices.size(), (uint32_t)triangles.size(), std::sqrt(error)};
+        indices.insert(indices.end(), triangles.begin(), triangles.end());
+    }
+    return lod;
+}
+
+static void deleteDepthPyramid(MoDevice device, MoDepthPyramid & pyramid)
+{
+    for (uint32_t level = 0; level < pyramid.levelCount; ++level)
+    {
+        vkDestroyImageView(device->device, pyramid.levelViews[level], g_Allocator);
+        pyramid.levelViews[level] = VK_NULL_HANDLE;
+    }
+    if (pyramid.levelSets[0] != VK_NULL_HANDLE)
+    {
+        vkFreeDescriptorSets(device->device, device->descriptorPool, MO_DEPTH_PYRAMID_LEVELS, pyramid.levelSets);
+        memset(pyramid.levelSets, 0, sizeof(pyramid.levelSets));
+    }
+    vkDestroyImageView(device->device, pyramid.view, g_Allocator);
+    vkDestroyImage(device->device, pyramid.image, g_Allocator);
+    vkFreeMemory(device->device, pyramid.memory, g_Allocator);
+    releaseMemory(pyramid.heapIndex, pyramid.allocationSize, MO_MEMORY_CATEGORY_ATTACHMENT);
+    pyramid.allocationSize = 0;
+    pyramid.view = VK_NULL_HANDLE;
+    pyramid.image = VK_NULL_HANDLE;
+    pyramid.memory = VK_NULL_HANDLE;
+    pyramid.levelCount = 0;
+    pyramid.depthImage = VK_NULL_HANDLE;
+    pyramid.valid = VK_FALSE;
+}
+
 static void generateTexture(MoImageBuffer *pImageBuffer, const MoTextureInfo &textureInfo, const float4 &fallbackColor, VkCommandPool commandPool, VkCommandBuffer commandBuffer)
 {
     VkFormat format = textureInfo.format == VK_FORMAT_UNDEFINED ? VK_FORMAT_R8G8B8A8_UNORM : textureInfo.format;
@@ -249,12 +904,13 @@ static void generateTexture(MoImageBuffer *pImageBuffer, const MoTextureInfo &te
     }
 
     // create buffer
-    createBuffer(g_Device, pImageBuffer, {width, height, 1}, format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+    createBuffer(g_Device, pImageBuffer, {width, height, 1}, format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_IMAGE_ASPECT_COLOR_BIT, MO_MEMORY_CATEGORY_TEXTURE);
 
     // upload
     MoDeviceBuffer upload = {};
-    createBuffer(g_Device, &upload, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    createBuffer(g_Device, &upload, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, MO_MEMORY_CATEGORY_STAGING);
     uploadBuffer(g_Device, upload, size, dataPtr);
+    g_FrameStats.stagingBytes += size;
     transferBuffer(commandBuffer, upload, *pImageBuffer, {width, height, 1});
 
     // end
@@ -276,15 +932,90 @@ static void generateTexture(MoImageBuffer *pImageBuffer, const MoTextureInfo &te
     deleteBuffer(g_Device, upload);
 }
 
+// opaque when every alpha is one, alpha-tested when nearly every alpha is zero or one, blended otherwise
+static MoMaterialClass classifyMaterial(const MoTextureInfo &textureInfo, const float4 &fallbackColor)
+{
+    // the same threshold as the texels below
+    if (textureInfo.pData == nullptr)
+        return fallbackColor.w >= 0xF8 / 255.f ? MO_MATERIAL_CLASS_OPAQUE : MO_MATERIAL_CLASS_BLENDED;
+
+    switch (textureInfo.format)
+    {
+    case VK_FORMAT_UNDEFINED:
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        break;
+    // no alpha
+    case VK_FORMAT_R8G8B8_UNORM:
+    case VK_FORMAT_R8G8B8_SRGB:
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+        return MO_MATERIAL_CLASS_OPAQUE;
+    // alpha that cannot be inspected here, cut-outs stay correct and the material keeps its depth pre-pass
+    default:
+        return MO_MATERIAL_CLASS_ALPHA_TEST;
+    }
+
+    // filtered cut-outs have a thin ring of partial alpha, which alpha testing tolerates
+    const uint32_t texelCount = textureInfo.extent.width * textureInfo.extent.height;
+    uint32_t transparent = 0, partial = 0;
+    for (uint32_t i = 0; i < texelCount; ++i)
+    {
+        const uint8_t alpha = textureInfo.pData[i * 4 + 3];
+        if (alpha < 0x08)
+            ++transparent;
+        else if (alpha < 0xF8)
+            ++partial;
+    }
+    if (transparent == 0 && partial == 0)
+        return MO_MATERIAL_CLASS_OPAQUE;
+    if (partial <= texelCount / 64)
+        return MO_MATERIAL_CLASS_ALPHA_TEST;
+    return MO_MATERIAL_CLASS_BLENDED;
+}
+
 void moCreateInstance(MoInstanceCreateInfo *pCreateInfo, VkInstance *pInstance)
 {
     VkResult err;
 
+    // the instance is Vulkan 1.0, device extensions that need instance extensions are only enabled along with them
+    std::vector<const char*> extensions(pCreateInfo->pExtensions, pCreateInfo->pExtensions + pCreateInfo->extensionsCount);
+    g_InstanceProperties2 = VK_FALSE;
+    g_InstanceExternalMemoryCapabilities = VK_FALSE;
+    if (pCreateInfo->externalMemoryHost || pCreateInfo->memoryBudget)
+    {
+        uint32_t count;
+        err = vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+        pCreateInfo->pCheckVkResultFn(err);
+        std::vector<VkExtensionProperties> properties(count);
+        err = vkEnumerateInstanceExtensionProperties(nullptr, &count, properties.data());
+        pCreateInfo->pCheckVkResultFn(err);
+        for (const VkExtensionProperties & extension : properties)
+        {
+            if (strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0)
+                g_InstanceProperties2 = VK_TRUE;
+            if (pCreateInfo->externalMemoryHost && strcmp(extension.extensionName, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME) == 0)
+                g_InstanceExternalMemoryCapabilities = VK_TRUE;
+        }
+        // external memory capabilities depends on properties2
+        g_InstanceExternalMemoryCapabilities = g_InstanceExternalMemoryCapabilities && g_InstanceProperties2;
+        if (g_InstanceProperties2)
+            extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+        if (g_InstanceExternalMemoryCapabilities)
+            extensions.push_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+    }
+
     {
         VkInstanceCreateInfo create_info = {};
         create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-        create_info.enabledExtensionCount = pCreateInfo->extensionsCount;
-        create_info.ppEnabledExtensionNames = pCreateInfo->pExtensions;
+        create_info.enabledExtensionCount = (uint32_t)extensions.size();
+        create_info.ppEnabledExtensionNames = extensions.data();
         if (pCreateInfo->debugReport)
         {
             // Enabling multiple validation layers grouped as LunarG standard validation
@@ -292,17 +1023,14 @@ void moCreateInstance(MoInstanceCreateInfo *pCreateInfo, VkInstance *pInstance)
             create_info.enabledLayerCount = 1;
             create_info.ppEnabledLayerNames = layers;
 
-            // Enable debug report extension (we need additional storage, so we duplicate the user array to add our new extension to it)
-            const char** extensions_ext = (const char**)malloc(sizeof(const char*) * (pCreateInfo->extensionsCount + 1));
-            memcpy(extensions_ext, pCreateInfo->pExtensions, pCreateInfo->extensionsCount * sizeof(const char*));
-            extensions_ext[pCreateInfo->extensionsCount] = "VK_EXT_debug_report";
-            create_info.enabledExtensionCount = pCreateInfo->extensionsCount + 1;
-            create_info.ppEnabledExtensionNames = extensions_ext;
+            // Enable debug report extension
+            extensions.push_back("VK_EXT_debug_report");
+            create_info.enabledExtensionCount = (uint32_t)extensions.size();
+            create_info.ppEnabledExtensionNames = extensions.data();
 
             // Create Vulkan Instance
             err = vkCreateInstance(&create_info, pCreateInfo->pAllocator, pInstance);
             pCreateInfo->pCheckVkResultFn(err);
-            free(extensions_ext);
 
             // Get the function pointer (required for any extensions)
             auto vkCreateDebugReportCallbackEXT = (PFN_vkCreateDebugReportCallbackEXT)vkGetInstanceProcAddr(*pInstance, "vkCreateDebugReportCallbackEXT");
@@ -337,6 +1065,28 @@ void moDestroyInstance(VkInstance instance)
     }
 }
 
+// the entry point and alignment importing host memory needs, once the device has externalMemoryHost
+static void loadExternalMemoryHost(MoDevice device, VkInstance instance)
+{
+    device->minImportedHostPointerAlignment = 0;
+    device->pGetMemoryHostPointerProperties = nullptr;
+    if (!device->externalMemoryHost)
+        return;
+    device->pGetMemoryHostPointerProperties = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr(device->device, "vkGetMemoryHostPointerPropertiesEXT");
+    // enabling the device extension required the instance extensions, the core entry point may not be enabled
+    PFN_vkGetPhysicalDeviceProperties2KHR getProperties2 = instance != VK_NULL_HANDLE ? (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR") : nullptr;
+    if (getProperties2 != nullptr)
+    {
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT host = {};
+        host.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+        VkPhysicalDeviceProperties2 properties = {};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties.pNext = &host;
+        getProperties2(device->physicalDevice, &properties);
+        device->minImportedHostPointerAlignment = host.minImportedHostPointerAlignment;
+    }
+}
+
 void moCreateDevice(MoDeviceCreateInfo *pCreateInfo, MoDevice *pDevice)
 {
     MoDevice device = *pDevice = new MoDevice_T();
@@ -352,6 +1102,7 @@ void moCreateDevice(MoDeviceCreateInfo *pCreateInfo, MoDevice *pDevice)
         err = vkEnumeratePhysicalDevices(pCreateInfo->instance, &count, gpus.data());
         pCreateInfo->pCheckVkResultFn(err);
         device->physicalDevice = gpus[0];
+        vkGetPhysicalDeviceMemoryProperties(device->physicalDevice, &device->memoryProperties);
     }
 
     {
@@ -370,26 +1121,66 @@ void moCreateDevice(MoDeviceCreateInfo *pCreateInfo, MoDevice *pDevice)
     }
 
     {
-        uint32_t device_extensions_count = 1;
-        const char* device_extensions[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+        std::vector<const char*> device_extensions;
+        if (pCreateInfo->surface != VK_NULL_HANDLE)
+            device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        {
+            uint32_t count;
+            err = vkEnumerateDeviceExtensionProperties(device->physicalDevice, nullptr, &count, nullptr);
+            pCreateInfo->pCheckVkResultFn(err);
+            std::vector<VkExtensionProperties> extensions(count);
+            err = vkEnumerateDeviceExtensionProperties(device->physicalDevice, nullptr, &count, extensions.data());
+            pCreateInfo->pCheckVkResultFn(err);
+            bool externalMemory = false, externalMemoryHost = false, memoryBudget = false;
+            for (const VkExtensionProperties & extension : extensions)
+            {
+                if (strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0)
+                {
+                    device_extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+                    device->drawIndirectCount = VK_TRUE;
+                }
+                externalMemory = externalMemory || strcmp(extension.extensionName, VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME) == 0;
+                externalMemoryHost = externalMemoryHost || strcmp(extension.extensionName, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0;
+                memoryBudget = memoryBudget || strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0;
+            }
+            if (pCreateInfo->externalMemoryHost && externalMemory && externalMemoryHost && g_InstanceExternalMemoryCapabilities)
+            {
+                device_extensions.push_back(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+                device_extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+                device->externalMemoryHost = VK_TRUE;
+            }
+            // the budget is read through vkGetPhysicalDeviceMemoryProperties2KHR
+            if (pCreateInfo->memoryBudget && memoryBudget && g_InstanceProperties2)
+            {
+                device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+                device->memoryBudget = VK_TRUE;
+            }
+        }
         const float queue_priority[] = { 1.0f };
         VkDeviceQueueCreateInfo queue_info[1] = {};
         queue_info[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
         queue_info[0].queueFamilyIndex = device->queueFamily;
         queue_info[0].queueCount = 1;
         queue_info[0].pQueuePriorities = queue_priority;
+        VkPhysicalDeviceFeatures supportedFeatures = {};
+        vkGetPhysicalDeviceFeatures(device->physicalDevice, &supportedFeatures);
         VkPhysicalDeviceFeatures deviceFeatures = {};
-        deviceFeatures.textureCompressionBC = VK_TRUE;
+        deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+        // optional, indirect drawing falls back to one draw per command without them
+        deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+        deviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+        device->enabledFeatures = deviceFeatures;
         VkDeviceCreateInfo create_info = {};
         create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         create_info.queueCreateInfoCount = (uint32_t)countof(queue_info);
         create_info.pQueueCreateInfos = queue_info;
-        create_info.enabledExtensionCount = device_extensions_count;
-        create_info.ppEnabledExtensionNames = device_extensions;
+        create_info.enabledExtensionCount = (uint32_t)device_extensions.size();
+        create_info.ppEnabledExtensionNames = device_extensions.data();
         create_info.pEnabledFeatures = &deviceFeatures;
         err = vkCreateDevice(device->physicalDevice, &create_info, g_Allocator, &device->device);
         pCreateInfo->pCheckVkResultFn(err);
         vkGetDeviceQueue(device->device, device->queueFamily, 0, &device->queue);
+        loadExternalMemoryHost(device, pCreateInfo->instance);
     }
 
     {
@@ -417,6 +1208,15 @@ void moCreateDevice(MoDeviceCreateInfo *pCreateInfo, MoDevice *pDevice)
         pCreateInfo->pCheckVkResultFn(err);
     }
 
+    if (pCreateInfo->surface == VK_NULL_HANDLE)
+    {
+        // headless, offscreen targets use the first requested format
+        pCreateInfo->pSurfaceFormat->format = pCreateInfo->requestFormatsCount != 0 ? pCreateInfo->pRequestFormats[0] : VK_FORMAT_R8G8B8A8_UNORM;
+        pCreateInfo->pSurfaceFormat->colorSpace = pCreateInfo->requestColorSpace;
+        device->pCheckVkResultFn = pCreateInfo->pCheckVkResultFn;
+        return;
+    }
+
     // Check for WSI support
     VkBool32 res;
     vkGetPhysicalDeviceSurfaceSupportKHR(device->physicalDevice, device->queueFamily, pCreateInfo->surface, &res);
@@ -472,158 +1272,348 @@ void moDestroyDevice(MoDevice device)
     delete device;
 }
 
-void moCreateSwapChain(MoSwapChainCreateInfo *pCreateInfo, MoSwapChain *pSwapChain)
+// first supported mode of the preferred ones, FIFO is always supported
+static VkPresentModeKHR choosePresentMode(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, const VkPresentModeKHR *pPresentModes, uint32_t presentModeCount, VkBool32 vsync)
 {
-    MoSwapChain swapChain = *pSwapChain = new MoSwapChain_T();
-    *swapChain = {};
+    static const VkPresentModeKHR vsyncModes[] = { VK_PRESENT_MODE_FIFO_KHR };
+    static const VkPresentModeKHR lowLatencyModes[] = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+    if (presentModeCount == 0)
+    {
+        pPresentModes = vsync ? vsyncModes : lowLatencyModes;
+        presentModeCount = vsync ? (uint32_t)countof(vsyncModes) : (uint32_t)countof(lowLatencyModes);
+    }
 
-    VkResult err;
-    // Create command buffers
-    for (uint32_t i = 0; i < countof(swapChain->frames); ++i)
+    uint32_t supportedCount = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &supportedCount, nullptr);
+    std::vector<VkPresentModeKHR> supported(supportedCount);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &supportedCount, supported.data());
+    for (uint32_t i = 0; i < presentModeCount; ++i)
     {
+        if (std::find(supported.begin(), supported.end(), pPresentModes[i]) != supported.end())
+            return pPresentModes[i];
+    }
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+static uint64_t nanoseconds()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// queryCount timestamps, or null when the device's queue reports no valid bits; timestamps are core Vulkan
+// pPeriod is in nanoseconds per tick and pMask keeps the valid bits of the difference of two timestamps
+static VkQueryPool createTimestampPool(MoDevice device, uint32_t queryCount, float *pPeriod, uint64_t *pMask)
+{
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice, &count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice, &count, families.data());
+    if (device->queueFamily >= count || families[device->queueFamily].timestampValidBits == 0)
+        return VK_NULL_HANDLE;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+    *pPeriod = properties.limits.timestampPeriod;
+    const uint32_t validBits = families[device->queueFamily].timestampValidBits;
+    *pMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+    VkQueryPool pool;
+    VkQueryPoolCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    info.queryCount = queryCount;
+    VkResult err = vkCreateQueryPool(device->device, &info, g_Allocator, &pool);
+    device->pCheckVkResultFn(err);
+    return pool;
+}
+
+// steer the render scale towards the target GPU time from the last retired frame's
+static void updateRenderScale(MoSwapChain swapChain)
+{
+    // GPU time is about proportional to the pixels rendered, the square of the scale
+    const float ideal = swapChain->renderScale * std::sqrt(swapChain->targetGpuTime / std::max(swapChain->gpuTime, 1e-6f));
+    // damped, timings are noisy and the resolution should not flicker
+    swapChain->renderScale += (ideal - swapChain->renderScale) * 0.25f;
+    swapChain->renderScale = std::min(1.f, std::max(swapChain->minRenderScale, swapChain->renderScale));
+}
+
+// record the submit to fence observed latency of submitted frames whose fence has signalled since
+static void retireFrames(MoSwapChain swapChain)
+{
+    for (uint32_t i = 0; i < swapChain->frameCount; ++i)
+    {
+        if (swapChain->submitSerials[i] == 0 || vkGetFenceStatus(g_Device->device, swapChain->frames[i].fence) != VK_SUCCESS)
+            continue;
+
+        swapChain->latency = (nanoseconds() - swapChain->submitTimes[i]) * 1e-9f;
+        swapChain->averageLatency = swapChain->averageLatency == 0.f ? swapChain->latency : swapChain->averageLatency * 0.9f + swapChain->latency * 0.1f;
+        swapChain->submitTimes[i] = 0;
+        if (swapChain->timedFrames & (1u << i))
         {
-            VkCommandPoolCreateInfo info = {};
-            info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-            info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-            info.queueFamilyIndex = pCreateInfo->device->queueFamily;
-            err = vkCreateCommandPool(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->frames[i].pool);
-            pCreateInfo->pCheckVkResultFn(err);
-        }
-        {
-            VkCommandBufferAllocateInfo info = {};
-            info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-            info.commandPool = swapChain->frames[i].pool;
-            info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-            info.commandBufferCount = 1;
-            err = vkAllocateCommandBuffers(pCreateInfo->device->device, &info, &swapChain->frames[i].buffer);
-            pCreateInfo->pCheckVkResultFn(err);
-        }
-        {
-            VkFenceCreateInfo info = {};
-            info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-            info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-            err = vkCreateFence(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->frames[i].fence);
-            pCreateInfo->pCheckVkResultFn(err);
-        }
-        {
-            VkSemaphoreCreateInfo info = {};
-            info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-            err = vkCreateSemaphore(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->frames[i].acquired);
-            pCreateInfo->pCheckVkResultFn(err);
-            err = vkCreateSemaphore(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->frames[i].complete);
-            pCreateInfo->pCheckVkResultFn(err);
+            uint64_t timestamps[2] = {};
+            VkResult err = vkGetQueryPoolResults(g_Device->device, swapChain->gpuTimeQueries, i * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+            if (err == VK_SUCCESS)
+            {
+                swapChain->gpuTime = ((timestamps[1] - timestamps[0]) & swapChain->timestampMask) * swapChain->timestampPeriod * 1e-9f;
+                if (swapChain->scaledImage != VK_NULL_HANDLE)
+                    updateRenderScale(swapChain);
+            }
+            swapChain->timedFrames &= ~(1u << i);
         }
+        // submissions share a queue, so they retire in order
+        g_RetiredSerial = std::max(g_RetiredSerial, swapChain->submitSerials[i]);
+        swapChain->submitSerials[i] = 0;
     }
+}
 
-    // Create image buffers
+// read back the scopes of a frame whose fence was waited on
+static void resolveProfile(uint32_t frameIndex)
+{
+    MoProfileFrame & frame = g_ProfileFrames[frameIndex];
+    if (!frame.recorded)
+        return;
+    frame.recorded = false;
+
+    std::vector<uint64_t> timestamps(frame.queryCount);
+    VkResult err = vkGetQueryPoolResults(g_Device->device, g_ProfileQueries, frameIndex * MO_PROFILE_QUERY_COUNT, frame.queryCount, timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (err != VK_SUCCESS)
+        return;
+
+    g_Profile.resize(frame.scopes.size());
+    for (size_t i = 0; i < frame.scopes.size(); ++i)
     {
-        VkSwapchainCreateInfoKHR info = {};
-        info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-        info.surface = pCreateInfo->surface;
-        info.minImageCount = MO_FRAME_COUNT;
-        info.imageFormat = pCreateInfo->surfaceFormat.format;
-        info.imageColorSpace = pCreateInfo->surfaceFormat.colorSpace;
-        info.imageArrayLayers = 1;
-        info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-        info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;           // Assume that graphics family == present family
-        info.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
-        info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-        info.presentMode = pCreateInfo->vsync ? VK_PRESENT_MODE_FIFO_KHR : VK_PRESENT_MODE_IMMEDIATE_KHR;
-        info.clipped = VK_TRUE;
-        info.oldSwapchain = VK_NULL_HANDLE;
-        VkSurfaceCapabilitiesKHR cap;
-        err = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(pCreateInfo->device->physicalDevice, pCreateInfo->surface, &cap);
-        pCreateInfo->pCheckVkResultFn(err);
-        if (info.minImageCount < cap.minImageCount)
-            info.minImageCount = cap.minImageCount;
-        else if (cap.maxImageCount != 0 && info.minImageCount > cap.maxImageCount)
-            info.minImageCount = cap.maxImageCount;
+        const MoProfileRecord & record = frame.scopes[i];
+        const uint64_t ticks = (timestamps[record.query + 1] - timestamps[record.query]) & g_TimestampMask;
+        g_Profile[i] = {record.pName, record.pipeline, record.parent, record.depth, ticks * g_TimestampPeriod * 1e-9f};
+    }
+}
 
-        if (cap.currentExtent.width == 0xffffffff)
+static void profileBegin(VkCommandBuffer commandBuffer, const char *pName, VkPipeline pipeline, bool leaf)
+{
+    MoProfileFrame & frame = g_ProfileFrames[g_ProfileFrame];
+    if (frame.queryCount + 2 > MO_PROFILE_QUERY_COUNT)
+    {
+        // dropped, a null entry keeps moProfileEnd balanced
+        frame.open.push_back(~0u);
+        return;
+    }
+
+    MoProfileRecord record = {pName, pipeline, ~0u, 0, frame.queryCount, leaf};
+    for (auto it = frame.open.rbegin(); it != frame.open.rend(); ++it)
+    {
+        if (*it != ~0u)
         {
-            info.imageExtent = swapChain->extent = pCreateInfo->extent;
+            record.parent = *it;
+            record.depth = frame.scopes[*it].depth + 1;
+            break;
         }
+    }
+    frame.queryCount += 2;
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, g_ProfileQueries, g_ProfileFrame * MO_PROFILE_QUERY_COUNT + record.query);
+    frame.open.push_back(uint32_t(frame.scopes.size()));
+    frame.scopes.push_back(record);
+}
+
+static void profileEnd(VkCommandBuffer commandBuffer)
+{
+    MoProfileFrame & frame = g_ProfileFrames[g_ProfileFrame];
+    const uint32_t scope = frame.open.back();
+    frame.open.pop_back();
+    if (scope != ~0u)
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, g_ProfileQueries, g_ProfileFrame * MO_PROFILE_QUERY_COUNT + frame.scopes[scope].query + 1);
+}
+
+static void profileEndLeaf(VkCommandBuffer commandBuffer)
+{
+    MoProfileFrame & frame = g_ProfileFrames[g_ProfileFrame];
+    if (!frame.open.empty() && frame.open.back() != ~0u && frame.scopes[frame.open.back()].leaf)
+        profileEnd(commandBuffer);
+}
+
+// moBegin and pipeline switches, only timed in the primary command buffer outside of secondary-only render passes
+static void profileLeaf(const char *pName, VkPipeline pipeline)
+{
+    if (g_ProfileFrame == ~0u || g_SubpassContents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS)
+        return;
+
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[g_ProfileFrame].buffer;
+    profileEndLeaf(commandBuffer);
+    profileBegin(commandBuffer, pName, pipeline, true);
+}
+
+// the frame being recorded may still reference what is destroyed, so wait for it as well
+static void deferDeletion(std::function<void()> destroy)
+{
+    g_Deletions.push_back({g_SubmitSerial + 1, std::move(destroy)});
+}
+
+static void collectDeletions(bool all)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < g_Deletions.size(); ++i)
+    {
+        if (all || g_Deletions[i].serial <= g_RetiredSerial)
+            g_Deletions[i].destroy();
         else
+            g_Deletions[kept++] = std::move(g_Deletions[i]);
+    }
+    g_Deletions.resize(kept);
+}
+
+// command buffers and sync objects of each frame in flight
+static void createFrames(MoDevice device, MoSwapChain swapChain, const VkAllocationCallbacks *pAllocator)
+{
+    VkResult err;
+    for (uint32_t i = 0; i < swapChain->frameCount; ++i)
+    {
         {
-            info.imageExtent = swapChain->extent = cap.currentExtent;
+            VkCommandPoolCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+            info.queueFamilyIndex = device->queueFamily;
+            err = vkCreateCommandPool(device->device, &info, pAllocator, &swapChain->frames[i].pool);
+            device->pCheckVkResultFn(err);
         }
-        err = vkCreateSwapchainKHR(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->swapChainKHR);
-        pCreateInfo->pCheckVkResultFn(err);
-        uint32_t backBufferCount = 0;
-        err = vkGetSwapchainImagesKHR(pCreateInfo->device->device, swapChain->swapChainKHR, &backBufferCount, NULL);
-        pCreateInfo->pCheckVkResultFn(err);
-        VkImage backBuffer[MO_FRAME_COUNT] = {};
-        err = vkGetSwapchainImagesKHR(pCreateInfo->device->device, swapChain->swapChainKHR, &backBufferCount, backBuffer);
-        pCreateInfo->pCheckVkResultFn(err);
-
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
         {
-            swapChain->images[i].back = backBuffer[i];
+            VkCommandBufferAllocateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            info.commandPool = swapChain->frames[i].pool;
+            info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            info.commandBufferCount = 1;
+            err = vkAllocateCommandBuffers(device->device, &info, &swapChain->frames[i].buffer);
+            device->pCheckVkResultFn(err);
+        }
+        {
+            VkFenceCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+            err = vkCreateFence(device->device, &info, pAllocator, &swapChain->frames[i].fence);
+            device->pCheckVkResultFn(err);
+        }
+        {
+            VkSemaphoreCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            err = vkCreateSemaphore(device->device, &info, pAllocator, &swapChain->frames[i].acquired);
+            device->pCheckVkResultFn(err);
+            err = vkCreateSemaphore(device->device, &info, pAllocator, &swapChain->frames[i].complete);
+            device->pCheckVkResultFn(err);
         }
     }
+}
+
+// a resume render pass loads what the frame's render pass drew before it was suspended, see moResumeRenderPass
+static void createRenderPass(MoDevice device, VkFormat colorFormat, VkImageLayout finalLayout, bool resume, const VkAllocationCallbacks *pAllocator, VkRenderPass *pRenderPass)
+{
+    VkAttachmentDescription attachment[2] = {};
+    attachment[0].format = colorFormat;
+    attachment[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment[0].loadOp = resume ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachment[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment[0].initialLayout = resume ? finalLayout : VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment[0].finalLayout = finalLayout;
+    attachment[1].format = VK_FORMAT_D16_UNORM;
+    attachment[1].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment[1].loadOp = resume ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    // kept for the depth pyramid built from it while the render pass is suspended
+    attachment[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachment[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment[1].initialLayout = resume ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference color_attachment = {};
+    color_attachment.attachment = 0;
+    color_attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference depth_attachment = {};
+    depth_attachment.attachment = 1;
+    depth_attachment.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &color_attachment;
+    subpass.pDepthStencilAttachment = &depth_attachment;
+
+    // attachments are only touched once the depth pyramid pass is done reading the depth, and loaded once the suspended render pass wrote them
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    VkRenderPassCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    info.attachmentCount = 2;
+    info.pAttachments = attachment;
+    info.subpassCount = 1;
+    info.pSubpasses = &subpass;
+    info.dependencyCount = 1;
+    info.pDependencies = &dependency;
+    VkResult err = vkCreateRenderPass(device->device, &info, pAllocator, pRenderPass);
+    device->pCheckVkResultFn(err);
+}
+
+// the color image and framebuffer dynamic resolution renders into, sharing the swap chain's depth buffer
+static void createScaledTarget(MoDevice device, MoSwapChain swapChain, const VkAllocationCallbacks *pAllocator)
+{
+    createBuffer(device, &swapChain->scaledImage, {swapChain->extent.width, swapChain->extent.height, 1}, swapChain->surfaceFormat.format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT, MO_MEMORY_CATEGORY_ATTACHMENT);
+
+    VkImageView attachment[2] = {swapChain->scaledImage->view, swapChain->depthBuffer->view};
+    VkFramebufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    info.renderPass = swapChain->scaledRenderPass;
+    info.attachmentCount = 2;
+    info.pAttachments = attachment;
+    info.width = swapChain->extent.width;
+    info.height = swapChain->extent.height;
+    info.layers = 1;
+    VkResult err = vkCreateFramebuffer(device->device, &info, pAllocator, &swapChain->scaledFramebuffer);
+    device->pCheckVkResultFn(err);
+}
 
+static void deferScaledTarget(MoSwapChain swapChain)
+{
+    MoImageBuffer scaledImage = swapChain->scaledImage;
+    VkFramebuffer scaledFramebuffer = swapChain->scaledFramebuffer;
+    deferDeletion([scaledImage, scaledFramebuffer]()
     {
-        VkAttachmentDescription attachment[2] = {};
-        attachment[0].format = pCreateInfo->surfaceFormat.format;
-        attachment[0].samples = VK_SAMPLE_COUNT_1_BIT;
-        attachment[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        attachment[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        attachment[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        attachment[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-        attachment[1].format = VK_FORMAT_D16_UNORM;
-        attachment[1].samples = VK_SAMPLE_COUNT_1_BIT;
-        attachment[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        attachment[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        attachment[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-        VkAttachmentReference color_attachment = {};
-        color_attachment.attachment = 0;
-        color_attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-        VkAttachmentReference depth_attachment = {};
-        depth_attachment.attachment = 1;
-        depth_attachment.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-        VkSubpassDescription subpass = {};
-        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass.colorAttachmentCount = 1;
-        subpass.pColorAttachments = &color_attachment;
-        subpass.pDepthStencilAttachment = &depth_attachment;
-
-        VkRenderPassCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        info.attachmentCount = 2;
-        info.pAttachments = attachment;
-        info.subpassCount = 1;
-        info.pSubpasses = &subpass;
-        err = vkCreateRenderPass(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->renderPass);
-        pCreateInfo->pCheckVkResultFn(err);
-    }
+        deleteBuffer(g_Device, scaledImage);
+        vkDestroyFramebuffer(g_Device->device, scaledFramebuffer, g_Allocator);
+    });
+    swapChain->scaledImage = VK_NULL_HANDLE;
+    swapChain->scaledFramebuffer = VK_NULL_HANDLE;
+}
+
+// views, depth buffer and framebuffers of the swap chain's current images, offscreen images come with their view
+static void createFramebuffers(MoDevice device, MoSwapChain swapChain, VkFormat colorFormat, const VkAllocationCallbacks *pAllocator)
+{
+    VkResult err;
+    if (swapChain->swapChainKHR != VK_NULL_HANDLE)
     {
         VkImageViewCreateInfo info = {};
         info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        info.format = pCreateInfo->surfaceFormat.format;
+        info.format = colorFormat;
         info.components.r = VK_COMPONENT_SWIZZLE_R;
         info.components.g = VK_COMPONENT_SWIZZLE_G;
         info.components.b = VK_COMPONENT_SWIZZLE_B;
         info.components.a = VK_COMPONENT_SWIZZLE_A;
         VkImageSubresourceRange image_range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
         info.subresourceRange = image_range;
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
+        for (uint32_t i = 0; i < swapChain->imageCount; ++i)
         {
             info.image = swapChain->images[i].back;
-            err = vkCreateImageView(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->images[i].view);
-            pCreateInfo->pCheckVkResultFn(err);
+            err = vkCreateImageView(device->device, &info, pAllocator, &swapChain->images[i].view);
+            device->pCheckVkResultFn(err);
         }
     }
 
     // depth buffer
-    createBuffer(pCreateInfo->device, &swapChain->depthBuffer, {swapChain->extent.width, swapChain->extent.height, 1}, VK_FORMAT_D16_UNORM, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+    createBuffer(device, &swapChain->depthBuffer, {swapChain->extent.width, swapChain->extent.height, 1}, VK_FORMAT_D16_UNORM, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_DEPTH_BIT, MO_MEMORY_CATEGORY_ATTACHMENT);
 
     {
         VkImageView attachment[2] = {0, swapChain->depthBuffer->view};
@@ -635,40 +1625,137 @@ void moCreateSwapChain(MoSwapChainCreateInfo *pCreateInfo, MoSwapChain *pSwapCha
         info.width = swapChain->extent.width;
         info.height = swapChain->extent.height;
         info.layers = 1;
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
+        for (uint32_t i = 0; i < swapChain->imageCount; ++i)
         {
             attachment[0] = swapChain->images[i].view;
-            err = vkCreateFramebuffer(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->images[i].front);
-            pCreateInfo->pCheckVkResultFn(err);
+            err = vkCreateFramebuffer(device->device, &info, pAllocator, &swapChain->images[i].front);
+            device->pCheckVkResultFn(err);
+        }
+    }
+}
+
+void moCreateSwapChain(MoSwapChainCreateInfo *pCreateInfo, MoSwapChain *pSwapChain)
+{
+    MoSwapChain swapChain = *pSwapChain = new MoSwapChain_T();
+    *swapChain = {};
+
+    VkResult err;
+    swapChain->frameCount = std::max<uint32_t>(2, std::min<uint32_t>(pCreateInfo->frameCount, MO_FRAME_COUNT));
+
+    createFrames(pCreateInfo->device, swapChain, pCreateInfo->pAllocator);
+
+    // Create image buffers
+    {
+        VkSwapchainCreateInfoKHR info = {};
+        info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+        info.surface = pCreateInfo->surface;
+        info.minImageCount = swapChain->frameCount;
+        info.imageFormat = pCreateInfo->surfaceFormat.format;
+        info.imageColorSpace = pCreateInfo->surfaceFormat.colorSpace;
+        info.imageArrayLayers = 1;
+        info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;           // Assume that graphics family == present family
+        info.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+        info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+        info.presentMode = swapChain->presentMode = choosePresentMode(pCreateInfo->device->physicalDevice, pCreateInfo->surface, pCreateInfo->pPresentModes, pCreateInfo->presentModeCount, pCreateInfo->vsync);
+        info.clipped = VK_TRUE;
+        info.oldSwapchain = VK_NULL_HANDLE;
+        VkSurfaceCapabilitiesKHR cap;
+        err = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(pCreateInfo->device->physicalDevice, pCreateInfo->surface, &cap);
+        pCreateInfo->pCheckVkResultFn(err);
+        // lets moRecordReadback copy from the swap chain images, and dynamic resolution blit into them
+        info.imageUsage |= cap.supportedUsageFlags & (VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+        swapChain->imageUsage = info.imageUsage;
+        if (info.minImageCount < cap.minImageCount)
+            info.minImageCount = cap.minImageCount;
+        else if (cap.maxImageCount != 0 && info.minImageCount > cap.maxImageCount)
+            info.minImageCount = cap.maxImageCount;
+
+        if (cap.currentExtent.width == 0xffffffff)
+        {
+            info.imageExtent = swapChain->extent = pCreateInfo->extent;
+        }
+        else
+        {
+            info.imageExtent = swapChain->extent = cap.currentExtent;
+        }
+        err = vkCreateSwapchainKHR(pCreateInfo->device->device, &info, pCreateInfo->pAllocator, &swapChain->swapChainKHR);
+        pCreateInfo->pCheckVkResultFn(err);
+        uint32_t backBufferCount = 0;
+        err = vkGetSwapchainImagesKHR(pCreateInfo->device->device, swapChain->swapChainKHR, &backBufferCount, NULL);
+        pCreateInfo->pCheckVkResultFn(err);
+        assert(backBufferCount <= MO_IMAGE_COUNT);
+        VkImage backBuffer[MO_IMAGE_COUNT] = {};
+        err = vkGetSwapchainImagesKHR(pCreateInfo->device->device, swapChain->swapChainKHR, &backBufferCount, backBuffer);
+        pCreateInfo->pCheckVkResultFn(err);
+
+        swapChain->imageCount = backBufferCount;
+        for (uint32_t i = 0; i < swapChain->imageCount; ++i)
+        {
+            swapChain->images[i].back = backBuffer[i];
         }
     }
 
+    swapChain->surfaceFormat = pCreateInfo->surfaceFormat;
+    createRenderPass(pCreateInfo->device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false, pCreateInfo->pAllocator, &swapChain->renderPass);
+    createRenderPass(pCreateInfo->device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, true, pCreateInfo->pAllocator, &swapChain->resumeRenderPass);
+    createFramebuffers(pCreateInfo->device, swapChain, pCreateInfo->surfaceFormat.format, pCreateInfo->pAllocator);
+
     swapChain->clearColor = pCreateInfo->clearColor;
 }
 
 void moRecreateSwapChain(MoSwapChainRecreateInfo *pCreateInfo, MoSwapChain swapChain)
 {
+    assert(swapChain->offscreenImages[0] == VK_NULL_HANDLE);
     VkResult err;
     VkSwapchainKHR old_swapchain = swapChain->swapChainKHR;
-    err = vkDeviceWaitIdle(g_Device->device);
-    g_Device->pCheckVkResultFn(err);
 
-    deleteBuffer(g_Device, swapChain->depthBuffer);
-    for (uint32_t i = 0; i < countof(swapChain->images); ++i)
+    // frames in flight still render into the old images, they go once those frames retire
     {
-        vkDestroyImageView(g_Device->device, swapChain->images[i].view, g_Allocator);
-        vkDestroyFramebuffer(g_Device->device, swapChain->images[i].front, g_Allocator);
+        std::vector<MoSwapBuffer> images(swapChain->images, swapChain->images + swapChain->imageCount);
+        MoImageBuffer depthBuffer = swapChain->depthBuffer;
+        deferDeletion([images, depthBuffer, old_swapchain]()
+        {
+            deleteBuffer(g_Device, depthBuffer);
+            for (const MoSwapBuffer & image : images)
+            {
+                vkDestroyImageView(g_Device->device, image.view, g_Allocator);
+                vkDestroyFramebuffer(g_Device->device, image.front, g_Allocator);
+            }
+            if (old_swapchain)
+            {
+                vkDestroySwapchainKHR(g_Device->device, old_swapchain, g_Allocator);
+            }
+        });
     }
-    if (swapChain->renderPass)
+
+    // the render pass only depends on the formats, pipelines built against it stay valid on resize
+    if (swapChain->renderPass == VK_NULL_HANDLE || swapChain->surfaceFormat.format != pCreateInfo->surfaceFormat.format)
     {
-        vkDestroyRenderPass(g_Device->device, swapChain->renderPass, g_Allocator);
+        err = vkDeviceWaitIdle(g_Device->device);
+        g_Device->pCheckVkResultFn(err);
+        if (swapChain->renderPass)
+        {
+            vkDestroyRenderPass(g_Device->device, swapChain->renderPass, g_Allocator);
+            vkDestroyRenderPass(g_Device->device, swapChain->resumeRenderPass, g_Allocator);
+        }
+        createRenderPass(g_Device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false, g_Allocator, &swapChain->renderPass);
+        createRenderPass(g_Device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, true, g_Allocator, &swapChain->resumeRenderPass);
+        if (swapChain->scaledRenderPass)
+        {
+            vkDestroyRenderPass(g_Device->device, swapChain->scaledRenderPass, g_Allocator);
+            vkDestroyRenderPass(g_Device->device, swapChain->scaledResumeRenderPass, g_Allocator);
+            createRenderPass(g_Device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false, g_Allocator, &swapChain->scaledRenderPass);
+            createRenderPass(g_Device, pCreateInfo->surfaceFormat.format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, true, g_Allocator, &swapChain->scaledResumeRenderPass);
+        }
     }
+    swapChain->surfaceFormat = pCreateInfo->surfaceFormat;
 
     {
         VkSwapchainCreateInfoKHR info = {};
         info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
         info.surface = pCreateInfo->surface;
-        info.minImageCount = MO_FRAME_COUNT;
+        info.minImageCount = swapChain->frameCount;
         info.imageFormat = pCreateInfo->surfaceFormat.format;
         info.imageColorSpace = pCreateInfo->surfaceFormat.colorSpace;
         info.imageArrayLayers = 1;
@@ -676,12 +1763,14 @@ void moRecreateSwapChain(MoSwapChainRecreateInfo *pCreateInfo, MoSwapChain swapC
         info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;           // Assume that graphics family == present family
         info.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
         info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-        info.presentMode = pCreateInfo->vsync ? VK_PRESENT_MODE_FIFO_KHR : VK_PRESENT_MODE_IMMEDIATE_KHR;
+        info.presentMode = swapChain->presentMode = choosePresentMode(g_Device->physicalDevice, pCreateInfo->surface, pCreateInfo->pPresentModes, pCreateInfo->presentModeCount, pCreateInfo->vsync);
         info.clipped = VK_TRUE;
         info.oldSwapchain = old_swapchain;
         VkSurfaceCapabilitiesKHR cap;
         err = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g_Device->physicalDevice, pCreateInfo->surface, &cap);
         g_Device->pCheckVkResultFn(err);
+        info.imageUsage |= cap.supportedUsageFlags & (VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+        swapChain->imageUsage = info.imageUsage;
         if (info.minImageCount < cap.minImageCount)
             info.minImageCount = cap.minImageCount;
         else if (cap.maxImageCount != 0 && info.minImageCount > cap.maxImageCount)
@@ -700,175 +1789,430 @@ void moRecreateSwapChain(MoSwapChainRecreateInfo *pCreateInfo, MoSwapChain swapC
         uint32_t backBufferCount = 0;
         err = vkGetSwapchainImagesKHR(g_Device->device, swapChain->swapChainKHR, &backBufferCount, NULL);
         g_Device->pCheckVkResultFn(err);
-        VkImage backBuffer[MO_FRAME_COUNT] = {};
+        assert(backBufferCount <= MO_IMAGE_COUNT);
+        VkImage backBuffer[MO_IMAGE_COUNT] = {};
         err = vkGetSwapchainImagesKHR(g_Device->device, swapChain->swapChainKHR, &backBufferCount, backBuffer);
         g_Device->pCheckVkResultFn(err);
 
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
+        swapChain->imageCount = backBufferCount;
+        for (uint32_t i = 0; i < swapChain->imageCount; ++i)
         {
             swapChain->images[i].back = backBuffer[i];
+            swapChain->imageFences[i] = VK_NULL_HANDLE;
         }
     }
-    if (old_swapchain)
-    {
-        vkDestroySwapchainKHR(g_Device->device, old_swapchain, g_Allocator);
-    }
-
-    {
-        VkAttachmentDescription attachment[2] = {};
-        attachment[0].format = pCreateInfo->surfaceFormat.format;
-        attachment[0].samples = VK_SAMPLE_COUNT_1_BIT;
-        attachment[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        attachment[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        attachment[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        attachment[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-        attachment[1].format = VK_FORMAT_D16_UNORM;
-        attachment[1].samples = VK_SAMPLE_COUNT_1_BIT;
-        attachment[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        attachment[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        attachment[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachment[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-        VkAttachmentReference color_attachment = {};
-        color_attachment.attachment = 0;
-        color_attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-        VkAttachmentReference depth_attachment = {};
-        depth_attachment.attachment = 1;
-        depth_attachment.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-        VkSubpassDescription subpass = {};
-        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass.colorAttachmentCount = 1;
-        subpass.pColorAttachments = &color_attachment;
-        subpass.pDepthStencilAttachment = &depth_attachment;
-
-        VkRenderPassCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        info.attachmentCount = 2;
-        info.pAttachments = attachment;
-        info.subpassCount = 1;
-        info.pSubpasses = &subpass;
-        err = vkCreateRenderPass(g_Device->device, &info, g_Allocator, &swapChain->renderPass);
-        g_Device->pCheckVkResultFn(err);
+    createFramebuffers(g_Device, swapChain, pCreateInfo->surfaceFormat.format, g_Allocator);
+    if (swapChain->scaledImage != VK_NULL_HANDLE)
+    {
+        deferScaledTarget(swapChain);
+        createScaledTarget(g_Device, swapChain, g_Allocator);
     }
+
+    if (g_SwapChain != VK_NULL_HANDLE && g_SwapChain->swapChainKHR == old_swapchain)
     {
-        VkImageViewCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        info.format = pCreateInfo->surfaceFormat.format;
-        info.components.r = VK_COMPONENT_SWIZZLE_R;
-        info.components.g = VK_COMPONENT_SWIZZLE_G;
-        info.components.b = VK_COMPONENT_SWIZZLE_B;
-        info.components.a = VK_COMPONENT_SWIZZLE_A;
-        VkImageSubresourceRange image_range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-        info.subresourceRange = image_range;
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
-        {
-            info.image = swapChain->images[i].back;
-            err = vkCreateImageView(g_Device->device, &info, g_Allocator, &swapChain->images[i].view);
-            g_Device->pCheckVkResultFn(err);
-        }
+        // moInit keeps a copy of the swap chain's handles
+        memcpy(g_SwapChain->images, swapChain->images, sizeof(swapChain->images));
+        memcpy(g_SwapChain->imageFences, swapChain->imageFences, sizeof(swapChain->imageFences));
+        g_SwapChain->imageCount = swapChain->imageCount;
+        g_SwapChain->depthBuffer = swapChain->depthBuffer;
+        g_SwapChain->swapChainKHR = swapChain->swapChainKHR;
+        g_SwapChain->renderPass = swapChain->renderPass;
+        g_SwapChain->extent = swapChain->extent;
+        g_SwapChain->renderExtent = swapChain->extent;
+        // rebuilt against the new depth buffer by the next moBuildDepthPyramid
+        g_DepthPyramid.depthImage = VK_NULL_HANDLE;
     }
+}
 
-    // depth buffer
-    createBuffer(g_Device, &swapChain->depthBuffer, { swapChain->extent.width, swapChain->extent.height, 1}, VK_FORMAT_D16_UNORM, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+void moCreateOffscreenTarget(MoOffscreenTargetCreateInfo *pCreateInfo, MoSwapChain *pSwapChain)
+{
+    MoSwapChain swapChain = *pSwapChain = new MoSwapChain_T();
+    *swapChain = {};
+
+    swapChain->frameCount = std::max<uint32_t>(2, std::min<uint32_t>(pCreateInfo->frameCount, MO_FRAME_COUNT));
+    swapChain->imageCount = pCreateInfo->imageCount == 0 ? 2 : std::min<uint32_t>(pCreateInfo->imageCount, MO_IMAGE_COUNT);
+    swapChain->extent = pCreateInfo->extent;
+    swapChain->surfaceFormat = {pCreateInfo->format, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+    swapChain->imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    createFrames(pCreateInfo->device, swapChain, pCreateInfo->pAllocator);
 
+    for (uint32_t i = 0; i < swapChain->imageCount; ++i)
     {
-        VkImageView attachment[2] = {0, swapChain->depthBuffer->view};
-        VkFramebufferCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        info.renderPass = swapChain->renderPass;
-        info.attachmentCount = 2;
-        info.pAttachments = attachment;
-        info.width = swapChain->extent.width;
-        info.height = swapChain->extent.height;
-        info.layers = 1;
-        for (uint32_t i = 0; i < countof(swapChain->images); ++i)
-        {
-            attachment[0] = swapChain->images[i].view;
-            err = vkCreateFramebuffer(g_Device->device, &info, g_Allocator, &swapChain->images[i].front);
-            g_Device->pCheckVkResultFn(err);
-        }
+        createBuffer(pCreateInfo->device, &swapChain->offscreenImages[i], {swapChain->extent.width, swapChain->extent.height, 1}, pCreateInfo->format, swapChain->imageUsage, VK_IMAGE_ASPECT_COLOR_BIT, MO_MEMORY_CATEGORY_ATTACHMENT);
+        swapChain->images[i].back = swapChain->offscreenImages[i]->image;
+        swapChain->images[i].view = swapChain->offscreenImages[i]->view;
     }
+
+    // rendered images are left ready for moFramebufferReadback
+    createRenderPass(pCreateInfo->device, pCreateInfo->format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false, pCreateInfo->pAllocator, &swapChain->renderPass);
+    createRenderPass(pCreateInfo->device, pCreateInfo->format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, true, pCreateInfo->pAllocator, &swapChain->resumeRenderPass);
+    createFramebuffers(pCreateInfo->device, swapChain, pCreateInfo->format, pCreateInfo->pAllocator);
+
+    swapChain->clearColor = pCreateInfo->clearColor;
 }
 
-void moBeginSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore)
+void moBeginSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore, VkSubpassContents contents)
+{
+    moAcquireSwapChain(swapChain, pFrameIndex, pImageAcquiredSemaphore);
+    moBeginRenderPass(swapChain, *pFrameIndex, contents);
+}
+
+void moAcquireSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore)
 {
     VkResult err;
 
-    *pImageAcquiredSemaphore = swapChain->frames[*pFrameIndex].acquired;
+    if (swapChain->targetFrameTime > 0.f && swapChain->acquireTime != 0)
+    {
+        const uint64_t due = swapChain->acquireTime + (uint64_t)(swapChain->targetFrameTime * 1e9f);
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(due))));
+    }
+    const uint64_t now = nanoseconds();
+    if (swapChain->acquireTime != 0)
+        swapChain->frameTime = (now - swapChain->acquireTime) * 1e-9f;
+    swapChain->acquireTime = now;
+
+    // frames in flight are used round robin, whichever image the presentation engine returns
+    const uint32_t frameIndex = *pFrameIndex = swapChain->nextFrameIndex;
+    swapChain->nextFrameIndex = (frameIndex + 1) % swapChain->frameCount;
+    MoCommandBuffer & frame = swapChain->frames[frameIndex];
+
+    *pImageAcquiredSemaphore = frame.acquired;
+    // reported as waitTime, not beginTime
+    uint64_t waited = 0;
     {
-        err = vkAcquireNextImageKHR(g_Device->device, swapChain->swapChainKHR, UINT64_MAX, *pImageAcquiredSemaphore, VK_NULL_HANDLE, pFrameIndex);
+        // the frame's semaphores and command buffer are free once its previous submission is done
+        uint64_t wait = nanoseconds();
+        err = vkWaitForFences(g_Device->device, 1, &frame.fence, VK_TRUE, UINT64_MAX);    // wait indefinitely instead of periodically checking
         g_Device->pCheckVkResultFn(err);
+        waited += nanoseconds() - wait;
+        retireFrames(swapChain);
+        collectDeletions(false);
+        if (g_ProfileQueries != VK_NULL_HANDLE && frame.buffer == g_SwapChain->frames[frameIndex].buffer)
+            resolveProfile(frameIndex);
 
-        err = vkWaitForFences(g_Device->device, 1, &swapChain->frames[*pFrameIndex].fence, VK_TRUE, UINT64_MAX);    // wait indefinitely instead of periodically checking
-        g_Device->pCheckVkResultFn(err);
+        if (swapChain->swapChainKHR != VK_NULL_HANDLE)
+        {
+            wait = nanoseconds();
+            err = vkAcquireNextImageKHR(g_Device->device, swapChain->swapChainKHR, UINT64_MAX, *pImageAcquiredSemaphore, VK_NULL_HANDLE, &swapChain->imageIndex);
+            g_Device->pCheckVkResultFn(err);
+            waited += nanoseconds() - wait;
+        }
+        else
+        {
+            // offscreen images are used round robin, there is nothing to wait for
+            *pImageAcquiredSemaphore = VK_NULL_HANDLE;
+            swapChain->imageIndex = (swapChain->imageIndex + 1) % swapChain->imageCount;
+        }
 
-        err = vkResetFences(g_Device->device, 1, &swapChain->frames[*pFrameIndex].fence);
+        // with more frames in flight than images, another frame may still be rendering into this image
+        VkFence & imageFence = swapChain->imageFences[swapChain->imageIndex];
+        if (imageFence != VK_NULL_HANDLE && imageFence != frame.fence)
+        {
+            wait = nanoseconds();
+            err = vkWaitForFences(g_Device->device, 1, &imageFence, VK_TRUE, UINT64_MAX);
+            g_Device->pCheckVkResultFn(err);
+            waited += nanoseconds() - wait;
+        }
+        imageFence = frame.fence;
+
+        err = vkResetFences(g_Device->device, 1, &frame.fence);
         g_Device->pCheckVkResultFn(err);
     }
     {
-        err = vkResetCommandPool(g_Device->device, swapChain->frames[*pFrameIndex].pool, 0);
+        err = vkResetCommandPool(g_Device->device, frame.pool, 0);
         g_Device->pCheckVkResultFn(err);
         VkCommandBufferBeginInfo info = {};
         info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         info.flags |= VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        err = vkBeginCommandBuffer(swapChain->frames[*pFrameIndex].buffer, &info);
+        err = vkBeginCommandBuffer(frame.buffer, &info);
         g_Device->pCheckVkResultFn(err);
     }
+    g_ProfileFrame = ~0u;
+    if (g_ProfileQueries != VK_NULL_HANDLE && frame.buffer == g_SwapChain->frames[frameIndex].buffer)
+    {
+        MoProfileFrame & profile = g_ProfileFrames[frameIndex];
+        profile.scopes.clear();
+        profile.open.clear();
+        profile.queryCount = 0;
+        profile.recorded = false;
+        vkCmdResetQueryPool(frame.buffer, g_ProfileQueries, frameIndex * MO_PROFILE_QUERY_COUNT, MO_PROFILE_QUERY_COUNT);
+        g_ProfileFrame = frameIndex;
+        // the work recorded before the render pass does not wait for the acquired image, the root scope starts with it
+        profileBegin(frame.buffer, "frame", VK_NULL_HANDLE, false);
+    }
+    if (swapChain->scaledImage != VK_NULL_HANDLE)
+    {
+        swapChain->renderExtent.width = std::max(1u, uint32_t(swapChain->extent.width * swapChain->renderScale));
+        swapChain->renderExtent.height = std::max(1u, uint32_t(swapChain->extent.height * swapChain->renderScale));
+    }
+    g_FrameStats.waitTime += waited * 1e-9f;
+    g_FrameStats.beginTime += (nanoseconds() - now - waited) * 1e-9f;
+}
+
+void moBeginRenderPass(MoSwapChain swapChain, uint32_t frameIndex, VkSubpassContents contents)
+{
+    const uint64_t start = nanoseconds();
+    const bool scaled = swapChain->scaledImage != VK_NULL_HANDLE;
+    const VkExtent2D renderExtent = scaled ? swapChain->renderExtent : swapChain->extent;
+    if (scaled)
+    {
+        // the acquired image is waited on at this stage, the wait for the presentation engine is not GPU time
+        vkCmdResetQueryPool(swapChain->frames[frameIndex].buffer, swapChain->gpuTimeQueries, frameIndex * 2, 2);
+        vkCmdWriteTimestamp(swapChain->frames[frameIndex].buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, swapChain->gpuTimeQueries, frameIndex * 2);
+        swapChain->timedFrames |= 1u << frameIndex;
+    }
     {
+        // the scaled render pass only differs in its final layout, pipelines built against either are compatible
         VkRenderPassBeginInfo info = {};
         info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        info.renderPass = swapChain->renderPass;
-        info.framebuffer = swapChain->images[*pFrameIndex].front;
-        info.renderArea.extent = swapChain->extent;
+        info.renderPass = scaled ? swapChain->scaledRenderPass : swapChain->renderPass;
+        info.framebuffer = scaled ? swapChain->scaledFramebuffer : swapChain->images[swapChain->imageIndex].front;
+        info.renderArea.extent = renderExtent;
         VkClearValue clearValue[2] = {};
         clearValue[0].color = {{swapChain->clearColor.x, swapChain->clearColor.y, swapChain->clearColor.z, swapChain->clearColor.w}};
         clearValue[1].depthStencil = {1.0f, 0};
         info.pClearValues = clearValue;
         info.clearValueCount = 2;
-        vkCmdBeginRenderPass(swapChain->frames[*pFrameIndex].buffer, &info, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBeginRenderPass(swapChain->frames[frameIndex].buffer, &info, contents);
     }
-
-    VkViewport viewport{ 0, 0, float(swapChain->extent.width), float(swapChain->extent.height), 0.f, 1.f };
-    vkCmdSetViewport(swapChain->frames[*pFrameIndex].buffer, 0, 1, &viewport);
-    VkRect2D scissor{ { 0, 0 },{ swapChain->extent.width, swapChain->extent.height } };
-    vkCmdSetScissor(swapChain->frames[*pFrameIndex].buffer, 0, 1, &scissor);
+    g_SubpassContents = contents;
+    if (g_SwapChain != VK_NULL_HANDLE)
+        g_SwapChain->renderExtent = renderExtent;
+    // until moBuildDepthPyramid builds it from this frame's depth
+    g_DepthPyramid.valid = VK_FALSE;
+    if (contents == VK_SUBPASS_CONTENTS_INLINE)
+    {
+        VkViewport viewport{ 0, 0, float(renderExtent.width), float(renderExtent.height), 0.f, 1.f };
+        vkCmdSetViewport(swapChain->frames[frameIndex].buffer, 0, 1, &viewport);
+        VkRect2D scissor{ { 0, 0 },{ renderExtent.width, renderExtent.height } };
+        vkCmdSetScissor(swapChain->frames[frameIndex].buffer, 0, 1, &scissor);
+    }
+    g_RecordStart = nanoseconds();
+    g_FrameStats.beginTime += (g_RecordStart - start) * 1e-9f;
 }
 
 VkResult moEndSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore)
 {
-    vkCmdEndRenderPass(swapChain->frames[*pFrameIndex].buffer);
+    moEndRenderPass(swapChain, *pFrameIndex);
+    return moSubmitSwapChain(swapChain, pFrameIndex, pImageAcquiredSemaphore);
+}
+
+// scale the rendered part of the scaled image up into the acquired image, left in the layout the render pass leaves it in
+static void blitScaledImage(MoSwapChain swapChain, uint32_t frameIndex)
+{
+    VkCommandBuffer commandBuffer = swapChain->frames[frameIndex].buffer;
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = swapChain->images[swapChain->imageIndex].back;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    // the render pass leaves the scaled image in the transfer layout, its color writes still have to be made visible
+    VkImageMemoryBarrier source = barrier;
+    source.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    source.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    source.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    source.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    source.image = swapChain->scaledImage->image;
+    const VkImageMemoryBarrier barriers[] = { barrier, source };
+    // the acquire semaphore is waited on at the color attachment output stage
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, (uint32_t)countof(barriers), barriers);
+
+    VkImageBlit region = {};
+    region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.srcOffsets[1] = { int32_t(swapChain->renderExtent.width), int32_t(swapChain->renderExtent.height), 1 };
+    region.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.dstOffsets[1] = { int32_t(swapChain->extent.width), int32_t(swapChain->extent.height), 1 };
+    vkCmdBlitImage(commandBuffer, swapChain->scaledImage->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, barrier.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, VK_FILTER_LINEAR);
+
+    // also keeps the next frame from clearing the scaled image before the blit has read it
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = swapChain->swapChainKHR != VK_NULL_HANDLE ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void moEndRenderPass(MoSwapChain swapChain, uint32_t frameIndex)
+{
+    const uint64_t start = nanoseconds();
+    if (g_RecordStart != 0)
+        g_FrameStats.recordTime += (start - g_RecordStart) * 1e-9f;
+    g_RecordStart = 0;
+    if (g_ProfileFrame == frameIndex && g_SubpassContents == VK_SUBPASS_CONTENTS_INLINE)
+        profileEndLeaf(swapChain->frames[frameIndex].buffer);
+    vkCmdEndRenderPass(swapChain->frames[frameIndex].buffer);
+    g_SubpassContents = VK_SUBPASS_CONTENTS_INLINE;
+    if (swapChain->scaledImage != VK_NULL_HANDLE)
+        blitScaledImage(swapChain, frameIndex);
+    g_FrameStats.endTime += (nanoseconds() - start) * 1e-9f;
+}
+
+void moSuspendRenderPass(MoSwapChain swapChain, uint32_t frameIndex)
+{
+    if (g_ProfileFrame == frameIndex && g_SubpassContents == VK_SUBPASS_CONTENTS_INLINE)
+        profileEndLeaf(swapChain->frames[frameIndex].buffer);
+    vkCmdEndRenderPass(swapChain->frames[frameIndex].buffer);
+    g_SubpassContents = VK_SUBPASS_CONTENTS_INLINE;
+    // compute work may bind its own pipelines, the next draw binds its own again
+    g_BoundPipeline = VK_NULL_HANDLE;
+}
+
+void moResumeRenderPass(MoSwapChain swapChain, uint32_t frameIndex, VkSubpassContents contents)
+{
+    const bool scaled = swapChain->scaledImage != VK_NULL_HANDLE;
+    const VkExtent2D renderExtent = scaled ? swapChain->renderExtent : swapChain->extent;
+    {
+        // loads the attachments, nothing to clear
+        VkRenderPassBeginInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        info.renderPass = scaled ? swapChain->scaledResumeRenderPass : swapChain->resumeRenderPass;
+        info.framebuffer = scaled ? swapChain->scaledFramebuffer : swapChain->images[swapChain->imageIndex].front;
+        info.renderArea.extent = renderExtent;
+        vkCmdBeginRenderPass(swapChain->frames[frameIndex].buffer, &info, contents);
+    }
+    g_SubpassContents = contents;
+    if (contents == VK_SUBPASS_CONTENTS_INLINE)
+    {
+        VkViewport viewport{ 0, 0, float(renderExtent.width), float(renderExtent.height), 0.f, 1.f };
+        vkCmdSetViewport(swapChain->frames[frameIndex].buffer, 0, 1, &viewport);
+        VkRect2D scissor{ { 0, 0 },{ renderExtent.width, renderExtent.height } };
+        vkCmdSetScissor(swapChain->frames[frameIndex].buffer, 0, 1, &scissor);
+    }
+}
+
+VkResult moSubmitSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore)
+{
+    const uint64_t start = nanoseconds();
     {
         VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
         VkSubmitInfo info = {};
         info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        info.waitSemaphoreCount = 1;
+        info.waitSemaphoreCount = *pImageAcquiredSemaphore != VK_NULL_HANDLE ? 1 : 0;
         info.pWaitSemaphores = pImageAcquiredSemaphore;
         info.pWaitDstStageMask = &wait_stage;
         info.commandBufferCount = 1;
         info.pCommandBuffers = &swapChain->frames[*pFrameIndex].buffer;
-        info.signalSemaphoreCount = 1;
+        info.signalSemaphoreCount = swapChain->swapChainKHR != VK_NULL_HANDLE ? 1 : 0;
         info.pSignalSemaphores = &swapChain->frames[*pFrameIndex].complete;
 
-        VkResult err = vkEndCommandBuffer(swapChain->frames[*pFrameIndex].buffer);
+        if (swapChain->timedFrames & (1u << *pFrameIndex))
+            vkCmdWriteTimestamp(swapChain->frames[*pFrameIndex].buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, swapChain->gpuTimeQueries, *pFrameIndex * 2 + 1);
+        if (g_ProfileFrame == *pFrameIndex)
+        {
+            // scopes left open end with the frame
+            while (!g_ProfileFrames[g_ProfileFrame].open.empty())
+                profileEnd(swapChain->frames[*pFrameIndex].buffer);
+            g_ProfileFrames[g_ProfileFrame].recorded = true;
+            g_ProfileFrame = ~0u;
+        }
+        VkResult err = vkEndCommandBuffer(swapChain->frames[*pFrameIndex].buffer);
         g_Device->pCheckVkResultFn(err);
         err = vkQueueSubmit(g_Device->queue, 1, &info, swapChain->frames[*pFrameIndex].fence);
         g_Device->pCheckVkResultFn(err);
+        swapChain->submitTimes[*pFrameIndex] = nanoseconds();
+        swapChain->submitSerials[*pFrameIndex] = ++g_SubmitSerial;
+    }
+    retireFrames(swapChain);
+
+    VkResult result = VK_SUCCESS;
+    if (swapChain->swapChainKHR != VK_NULL_HANDLE)
+    {
+        VkPresentInfoKHR info = {};
+        info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        info.waitSemaphoreCount = 1;
+        info.pWaitSemaphores = &swapChain->frames[*pFrameIndex].complete;
+        info.swapchainCount = 1;
+        info.pSwapchains = &swapChain->swapChainKHR;
+        info.pImageIndices = &swapChain->imageIndex;
+        result = vkQueuePresentKHR(g_Device->queue, &info);
+    }
+
+    // the counters restart with every submission
+    g_FrameStats.endTime += (nanoseconds() - start) * 1e-9f;
+    g_LastFrameStats = g_FrameStats;
+    g_FrameStats = {};
+    return result;
+}
+
+void moFlushDeletions()
+{
+    if (g_Deletions.empty())
+        return;
+
+    VkResult err = vkDeviceWaitIdle(g_Device->device);
+    g_Device->pCheckVkResultFn(err);
+    collectDeletions(true);
+}
+
+void moSetTargetFrameTime(MoSwapChain swapChain, float frameTime)
+{
+    swapChain->targetFrameTime = frameTime;
+}
+
+void moGetFrameLatency(MoSwapChain swapChain, MoFrameLatency *pLatency)
+{
+    pLatency->frameTime = swapChain->frameTime;
+    pLatency->latency = swapChain->latency;
+    pLatency->averageLatency = swapChain->averageLatency;
+}
+
+VkResult moSetDynamicResolution(MoSwapChain swapChain, const MoDynamicResolutionInfo *pInfo)
+{
+    if (pInfo->targetGpuTime <= 0.f)
+    {
+        if (swapChain->scaledImage != VK_NULL_HANDLE)
+        {
+            deferScaledTarget(swapChain);
+            VkRenderPass scaledRenderPass = swapChain->scaledRenderPass;
+            VkRenderPass scaledResumeRenderPass = swapChain->scaledResumeRenderPass;
+            VkQueryPool gpuTimeQueries = swapChain->gpuTimeQueries;
+            deferDeletion([scaledRenderPass, scaledResumeRenderPass, gpuTimeQueries]()
+            {
+                vkDestroyRenderPass(g_Device->device, scaledRenderPass, g_Allocator);
+                vkDestroyRenderPass(g_Device->device, scaledResumeRenderPass, g_Allocator);
+                if (gpuTimeQueries)
+                {
+                    vkDestroyQueryPool(g_Device->device, gpuTimeQueries, g_Allocator);
+                }
+            });
+            swapChain->scaledRenderPass = VK_NULL_HANDLE;
+            swapChain->scaledResumeRenderPass = VK_NULL_HANDLE;
+            swapChain->gpuTimeQueries = VK_NULL_HANDLE;
+            swapChain->timedFrames = 0;
+        }
+        swapChain->targetGpuTime = 0.f;
+        return VK_SUCCESS;
     }
 
-    VkPresentInfoKHR info = {};
-    info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    info.waitSemaphoreCount = 1;
-    info.pWaitSemaphores = &swapChain->frames[*pFrameIndex].complete;
-    info.swapchainCount = 1;
-    info.pSwapchains = &swapChain->swapChainKHR;
-    info.pImageIndices = pFrameIndex;
-    return vkQueuePresentKHR(g_Device->queue, &info);
+    swapChain->targetGpuTime = pInfo->targetGpuTime;
+    swapChain->minRenderScale = pInfo->minScale == 0.f ? 0.5f : std::min(1.f, pInfo->minScale);
+    if (swapChain->scaledImage != VK_NULL_HANDLE)
+        return VK_SUCCESS;
+
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(g_Device->physicalDevice, swapChain->surfaceFormat.format, &properties);
+    const VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ((properties.optimalTilingFeatures & blit) != blit || (swapChain->imageUsage & VK_IMAGE_USAGE_TRANSFER_DST_BIT) == 0)
+        return VK_ERROR_FEATURE_NOT_PRESENT;
+
+    // the fence latency observed by the CPU includes presentation and polling, it cannot stand in for GPU time
+    swapChain->gpuTimeQueries = createTimestampPool(g_Device, MO_FRAME_COUNT * 2, &swapChain->timestampPeriod, &swapChain->timestampMask);
+    if (swapChain->gpuTimeQueries == VK_NULL_HANDLE)
+        return VK_ERROR_FEATURE_NOT_PRESENT;
+
+    swapChain->renderScale = 1.f;
+    swapChain->renderExtent = swapChain->extent;
+    swapChain->gpuTime = 0.f;
+    swapChain->timedFrames = 0;
+    createRenderPass(g_Device, swapChain->surfaceFormat.format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false, g_Allocator, &swapChain->scaledRenderPass);
+    createRenderPass(g_Device, swapChain->surfaceFormat.format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, true, g_Allocator, &swapChain->scaledResumeRenderPass);
+    createScaledTarget(g_Device, swapChain, g_Allocator);
+    return VK_SUCCESS;
 }
 
 void moDestroySwapChain(MoDevice device, MoSwapChain pSwapChain)
@@ -877,7 +2221,8 @@ void moDestroySwapChain(MoDevice device, MoSwapChain pSwapChain)
     err = vkDeviceWaitIdle(device->device);
     device->pCheckVkResultFn(err);
     vkQueueWaitIdle(device->queue);
-    for (uint32_t i = 0; i < countof(pSwapChain->frames); ++i)
+    collectDeletions(true);
+    for (uint32_t i = 0; i < pSwapChain->frameCount; ++i)
     {
         vkDestroyFence(device->device, pSwapChain->frames[i].fence, g_Allocator);
         vkFreeCommandBuffers(device->device, pSwapChain->frames[i].pool, 1, &pSwapChain->frames[i].buffer);
@@ -887,12 +2232,24 @@ void moDestroySwapChain(MoDevice device, MoSwapChain pSwapChain)
     }
 
     deleteBuffer(device, pSwapChain->depthBuffer);
-    for (uint32_t i = 0; i < countof(pSwapChain->images); ++i)
+    if (pSwapChain->scaledImage != VK_NULL_HANDLE)
+    {
+        deleteBuffer(device, pSwapChain->scaledImage);
+        vkDestroyFramebuffer(device->device, pSwapChain->scaledFramebuffer, g_Allocator);
+        vkDestroyRenderPass(device->device, pSwapChain->scaledRenderPass, g_Allocator);
+        vkDestroyRenderPass(device->device, pSwapChain->scaledResumeRenderPass, g_Allocator);
+        vkDestroyQueryPool(device->device, pSwapChain->gpuTimeQueries, g_Allocator);
+    }
+    for (uint32_t i = 0; i < pSwapChain->imageCount; ++i)
     {
-        vkDestroyImageView(device->device, pSwapChain->images[i].view, g_Allocator);
+        if (pSwapChain->offscreenImages[i] != VK_NULL_HANDLE)
+            deleteBuffer(device, pSwapChain->offscreenImages[i]);
+        else
+            vkDestroyImageView(device->device, pSwapChain->images[i].view, g_Allocator);
         vkDestroyFramebuffer(device->device, pSwapChain->images[i].front, g_Allocator);
     }
     vkDestroyRenderPass(device->device, pSwapChain->renderPass, g_Allocator);
+    vkDestroyRenderPass(device->device, pSwapChain->resumeRenderPass, g_Allocator);
     vkDestroySwapchainKHR(device->device, pSwapChain->swapChainKHR, g_Allocator);
 }
 
@@ -908,10 +2265,17 @@ void moInit(MoInitInfo *pInfo)
     *g_Device = {};
     g_Device->memoryAlignment = 256;
     g_Device->physicalDevice = pInfo->physicalDevice;
+    vkGetPhysicalDeviceMemoryProperties(g_Device->physicalDevice, &g_Device->memoryProperties);
     g_Device->device = pInfo->device;
     g_Device->queueFamily = pInfo->queueFamily;
     g_Device->queue = pInfo->queue;
     g_Device->pCheckVkResultFn = pInfo->pCheckVkResultFn;
+    if (pInfo->pEnabledFeatures)
+        g_Device->enabledFeatures = *pInfo->pEnabledFeatures;
+    g_Device->drawIndirectCount = pInfo->drawIndirectCount;
+    g_Device->externalMemoryHost = pInfo->externalMemoryHost;
+    loadExternalMemoryHost(g_Device, g_Instance);
+    g_Device->memoryBudget = pInfo->memoryBudget;
     g_PipelineCache = pInfo->pipelineCache;
     g_Device->descriptorPool = pInfo->descriptorPool;
     g_SwapChain = new MoSwapChain_T;
@@ -920,6 +2284,10 @@ void moInit(MoInitInfo *pInfo)
     g_SwapChain->swapChainKHR = pInfo->swapChainKHR;
     g_SwapChain->renderPass = pInfo->renderPass;
     g_SwapChain->extent = pInfo->extent;
+    g_SwapChain->renderExtent = pInfo->extent;
+    assert(pInfo->swapChainCommandBufferCount <= MO_FRAME_COUNT && pInfo->swapChainSwapBufferCount <= MO_IMAGE_COUNT);
+    g_SwapChain->frameCount = pInfo->swapChainCommandBufferCount;
+    g_SwapChain->imageCount = pInfo->swapChainSwapBufferCount;
     for (uint32_t i = 0; i < pInfo->swapChainCommandBufferCount; ++i)
     {
         g_SwapChain->frames[i].pool = pInfo->pSwapChainCommandBuffers[i].pool;
@@ -948,18 +2316,229 @@ void moInit(MoInitInfo *pInfo)
         std::ifstream fileStream("phong.frag.spv", std::ifstream::binary);
         mo_phong_shader_frag_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
     }
+    std::vector<char> mo_phong_shader_inst_vert_spv;
+    {
+        std::ifstream fileStream("phong.inst.vert.spv", std::ifstream::binary);
+        mo_phong_shader_inst_vert_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+    }
+    std::vector<char> mo_phong_shader_depth_vert_spv;
+    {
+        std::ifstream fileStream("phong.depth.vert.spv", std::ifstream::binary);
+        mo_phong_shader_depth_vert_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+    }
+    std::vector<char> mo_phong_shader_depth_inst_vert_spv;
+    {
+        std::ifstream fileStream("phong.depth.inst.vert.spv", std::ifstream::binary);
+        mo_phong_shader_depth_inst_vert_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+    }
     pipelineCreateInfo.pVertexShader = (std::uint32_t*)mo_phong_shader_vert_spv.data();
     pipelineCreateInfo.vertexShaderSize = mo_phong_shader_vert_spv.size();
     pipelineCreateInfo.pFragmentShader = (std::uint32_t*)mo_phong_shader_frag_spv.data();
     pipelineCreateInfo.fragmentShaderSize = mo_phong_shader_frag_spv.size();
+    if (!mo_phong_shader_inst_vert_spv.empty())
+    {
+        pipelineCreateInfo.pInstancedVertexShader = (std::uint32_t*)mo_phong_shader_inst_vert_spv.data();
+        pipelineCreateInfo.instancedVertexShaderSize = mo_phong_shader_inst_vert_spv.size();
+    }
+    if (!mo_phong_shader_depth_vert_spv.empty())
+    {
+        pipelineCreateInfo.pDepthVertexShader = (std::uint32_t*)mo_phong_shader_depth_vert_spv.data();
+        pipelineCreateInfo.depthVertexShaderSize = mo_phong_shader_depth_vert_spv.size();
+    }
+    if (!mo_phong_shader_depth_inst_vert_spv.empty())
+    {
+        pipelineCreateInfo.pInstancedDepthVertexShader = (std::uint32_t*)mo_phong_shader_depth_inst_vert_spv.data();
+        pipelineCreateInfo.instancedDepthVertexShaderSize = mo_phong_shader_depth_inst_vert_spv.size();
+    }
 
     moCreatePipeline(&pipelineCreateInfo, &g_Pipeline);
+
+    if (g_Device->drawIndirectCount)
+    {
+        g_CmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(g_Device->device, "vkCmdDrawIndexedIndirectCountKHR");
+    }
+    if (g_Device->memoryBudget && g_Instance != VK_NULL_HANDLE)
+    {
+        // enabling the device extension required the instance extension, the core entry point may not be enabled
+        g_GetPhysicalDeviceMemoryProperties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(g_Instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+    }
+
+    std::vector<char> mo_drawlist_shader_comp_spv;
+    {
+        std::ifstream fileStream("drawlist.comp.spv", std::ifstream::binary);
+        mo_drawlist_shader_comp_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+    }
+    if (!mo_drawlist_shader_comp_spv.empty())
+    {
+        VkResult err;
+        {
+            // objects, commands, counts and instances, then the cull parameters, the depth pyramid and the visibility
+            VkDescriptorSetLayoutBinding binding[7];
+            for (uint32_t i = 0; i < 7; ++i)
+            {
+                binding[i].binding = i;
+                binding[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                binding[i].descriptorCount = 1;
+                binding[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+                binding[i].pImmutableSamplers = VK_NULL_HANDLE;
+            }
+            binding[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            binding[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            VkDescriptorSetLayoutCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+            info.bindingCount = (uint32_t)countof(binding);
+            info.pBindings = binding;
+            err = vkCreateDescriptorSetLayout(g_Device->device, &info, g_Allocator, &g_DrawListSetLayout);
+            g_Device->pCheckVkResultFn(err);
+        }
+        {
+            VkPushConstantRange push_constant = {VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MoDrawListConstant)};
+            VkPipelineLayoutCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+            info.setLayoutCount = 1;
+            info.pSetLayouts = &g_DrawListSetLayout;
+            info.pushConstantRangeCount = 1;
+            info.pPushConstantRanges = &push_constant;
+            err = vkCreatePipelineLayout(g_Device->device, &info, g_Allocator, &g_DrawListPipelineLayout);
+            g_Device->pCheckVkResultFn(err);
+        }
+        {
+            VkShaderModule comp_module;
+            VkShaderModuleCreateInfo comp_info = {};
+            comp_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            comp_info.codeSize = mo_drawlist_shader_comp_spv.size();
+            comp_info.pCode = (std::uint32_t*)mo_drawlist_shader_comp_spv.data();
+            err = vkCreateShaderModule(g_Device->device, &comp_info, g_Allocator, &comp_module);
+            g_Device->pCheckVkResultFn(err);
+
+            VkComputePipelineCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+            info.stage.module = comp_module;
+            info.stage.pName = "main";
+            info.layout = g_DrawListPipelineLayout;
+            err = vkCreateComputePipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, &g_DrawListPipeline);
+            g_Device->pCheckVkResultFn(err);
+
+            vkDestroyShaderModule(g_Device->device, comp_module, nullptr);
+        }
+    }
+
+    std::vector<char> mo_hiz_shader_comp_spv;
+    {
+        std::ifstream fileStream("hiz.comp.spv", std::ifstream::binary);
+        mo_hiz_shader_comp_spv = std::vector<char>((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+    }
+    if (g_DrawListPipeline != VK_NULL_HANDLE && !mo_hiz_shader_comp_spv.empty())
+    {
+        VkResult err;
+        {
+            // the level above and the level written
+            VkDescriptorSetLayoutBinding binding[2] = {};
+            binding[0].binding = 0;
+            binding[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            binding[0].descriptorCount = 1;
+            binding[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            binding[1].binding = 1;
+            binding[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            binding[1].descriptorCount = 1;
+            binding[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            VkDescriptorSetLayoutCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+            info.bindingCount = (uint32_t)countof(binding);
+            info.pBindings = binding;
+            err = vkCreateDescriptorSetLayout(g_Device->device, &info, g_Allocator, &g_DepthPyramidSetLayout);
+            g_Device->pCheckVkResultFn(err);
+        }
+        {
+            VkPushConstantRange push_constant = {VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MoDepthPyramidConstant)};
+            VkPipelineLayoutCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+            info.setLayoutCount = 1;
+            info.pSetLayouts = &g_DepthPyramidSetLayout;
+            info.pushConstantRangeCount = 1;
+            info.pPushConstantRanges = &push_constant;
+            err = vkCreatePipelineLayout(g_Device->device, &info, g_Allocator, &g_DepthPyramidPipelineLayout);
+            g_Device->pCheckVkResultFn(err);
+        }
+        {
+            VkShaderModule comp_module;
+            VkShaderModuleCreateInfo comp_info = {};
+            comp_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            comp_info.codeSize = mo_hiz_shader_comp_spv.size();
+            comp_info.pCode = (std::uint32_t*)mo_hiz_shader_comp_spv.data();
+            err = vkCreateShaderModule(g_Device->device, &comp_info, g_Allocator, &comp_module);
+            g_Device->pCheckVkResultFn(err);
+
+            VkComputePipelineCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+            info.stage.module = comp_module;
+            info.stage.pName = "main";
+            info.layout = g_DepthPyramidPipelineLayout;
+            err = vkCreateComputePipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, &g_DepthPyramidPipeline);
+            g_Device->pCheckVkResultFn(err);
+
+            vkDestroyShaderModule(g_Device->device, comp_module, nullptr);
+        }
+    }
+    if (g_DrawListPipeline != VK_NULL_HANDLE)
+    {
+        // draw lists always sample a pyramid, even one never built
+        VkSamplerCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        info.magFilter = VK_FILTER_NEAREST;
+        info.minFilter = VK_FILTER_NEAREST;
+        info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.minLod = 0;
+        info.maxLod = 1000;
+        info.maxAnisotropy = 1.0f;
+        VkResult err = vkCreateSampler(g_Device->device, &info, g_Allocator, &g_DepthPyramid.sampler);
+        g_Device->pCheckVkResultFn(err);
+
+        createDepthPyramid(g_Device, g_DepthPyramid, g_SwapChain->depthBuffer, g_SwapChain->extent);
+    }
+    // queues reporting no valid timestamp bits are left unprofiled
+    g_ProfileQueries = createTimestampPool(g_Device, MO_FRAME_COUNT * MO_PROFILE_QUERY_COUNT, &g_TimestampPeriod, &g_TimestampMask);
 }
 
 void moShutdown()
 {
     moDestroyPipeline(g_Pipeline);
     g_Pipeline = VK_NULL_HANDLE;
+    moFlushDeletions();
+    for (size_t i = 0; i < MO_FRAME_COUNT; ++i) { deleteInstanceRing(g_Device, g_InstanceRing[i]); }
+    g_BoundPipeline = VK_NULL_HANDLE;
+    g_Views.clear();
+    g_RestoreView = false;
+    g_FrameStats = g_LastFrameStats = {};
+    vkDestroyQueryPool(g_Device->device, g_ProfileQueries, g_Allocator);
+    g_ProfileQueries = VK_NULL_HANDLE;
+    g_ProfileFrame = ~0u;
+    for (size_t i = 0; i < MO_FRAME_COUNT; ++i) { g_ProfileFrames[i] = {}; }
+    g_Profile.clear();
+    vkDestroyPipeline(g_Device->device, g_DrawListPipeline, g_Allocator);
+    vkDestroyPipelineLayout(g_Device->device, g_DrawListPipelineLayout, g_Allocator);
+    vkDestroyDescriptorSetLayout(g_Device->device, g_DrawListSetLayout, g_Allocator);
+    g_DrawListPipeline = VK_NULL_HANDLE;
+    g_DrawListPipelineLayout = VK_NULL_HANDLE;
+    g_DrawListSetLayout = VK_NULL_HANDLE;
+    if (g_DepthPyramid.image != VK_NULL_HANDLE) { deleteDepthPyramid(g_Device, g_DepthPyramid); }
+    vkDestroySampler(g_Device->device, g_DepthPyramid.sampler, g_Allocator);
+    g_DepthPyramid = {};
+    vkDestroyPipeline(g_Device->device, g_DepthPyramidPipeline, g_Allocator);
+    vkDestroyPipelineLayout(g_Device->device, g_DepthPyramidPipelineLayout, g_Allocator);
+    vkDestroyDescriptorSetLayout(g_Device->device, g_DepthPyramidSetLayout, g_Allocator);
+    g_DepthPyramidPipeline = VK_NULL_HANDLE;
+    g_DepthPyramidPipelineLayout = VK_NULL_HANDLE;
+    g_DepthPyramidSetLayout = VK_NULL_HANDLE;
+    g_CmdDrawIndexedIndirectCount = nullptr;
+    g_GetPhysicalDeviceMemoryProperties2 = nullptr;
     g_Instance = VK_NULL_HANDLE;
     g_Device->physicalDevice = VK_NULL_HANDLE;
     g_Device->device = VK_NULL_HANDLE;
@@ -1043,20 +2622,20 @@ void moCreatePipeline(const MoPipelineCreateInfo *pCreateInfo, MoPipeline *pPipe
 
     {
         VkDescriptorSetLayout descriptorSetLayout[MO_FRAME_COUNT] = {};
-        for (size_t i = 0; i < MO_FRAME_COUNT; ++i)
+        for (size_t i = 0; i < g_SwapChain->frameCount; ++i)
             descriptorSetLayout[i] = pipeline->descriptorSetLayout[MO_PROGRAM_DESC_LAYOUT];
         VkDescriptorSetAllocateInfo alloc_info = {};
         alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         alloc_info.descriptorPool = g_Device->descriptorPool;
-        alloc_info.descriptorSetCount = MO_FRAME_COUNT;
+        alloc_info.descriptorSetCount = g_SwapChain->frameCount;
         alloc_info.pSetLayouts = descriptorSetLayout;
         err = vkAllocateDescriptorSets(g_Device->device, &alloc_info, pipeline->descriptorSet);
         g_Device->pCheckVkResultFn(err);
     }
 
-    for (size_t i = 0; i < MO_FRAME_COUNT; ++i)
+    for (size_t i = 0; i < g_SwapChain->frameCount; ++i)
     {
-        createBuffer(g_Device, &pipeline->uniformBuffer[i], sizeof(MoUniform), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+        createBuffer(g_Device, &pipeline->uniformBuffer[i], sizeof(MoUniform), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, MO_MEMORY_CATEGORY_UNIFORM);
 
         VkDescriptorBufferInfo bufferInfo[1] = {};
         bufferInfo[0].buffer = pipeline->uniformBuffer[i]->buffer;
@@ -1150,8 +2729,9 @@ void moCreatePipeline(const MoPipelineCreateInfo *pCreateInfo, MoPipeline *pPipe
     ms_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
     ms_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
+    // blending is only enabled for the blended variants
     VkPipelineColorBlendAttachmentState color_attachment[1] = {};
-    color_attachment[0].blendEnable = VK_TRUE;
+    color_attachment[0].blendEnable = VK_FALSE;
     color_attachment[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
     color_attachment[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
     color_attachment[0].colorBlendOp = VK_BLEND_OP_ADD;
@@ -1194,226 +2774,1854 @@ void moCreatePipeline(const MoPipelineCreateInfo *pCreateInfo, MoPipeline *pPipe
     info.pDynamicState = &dynamic_state;
     info.layout = pipeline->pipelineLayout;
     info.renderPass = g_SwapChain->renderPass;
-    err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, &pipeline->pipeline);
-    g_Device->pCheckVkResultFn(err);
+
+    // a pre-pass needs a depth buffer to test against and to write into
+    const bool prePass = pCreateInfo->pDepthVertexShader != nullptr && (pCreateInfo->flags & MO_PIPELINE_FEATURE_DEPTH_TEST) && (pCreateInfo->flags & MO_PIPELINE_FEATURE_DEPTH_WRITE);
+
+    // the fragment shader's alphaTest specialization constant
+    const VkBool32 alphaTest = VK_TRUE;
+    VkSpecializationMapEntry alphaTestEntry = {0, 0, sizeof(VkBool32)};
+    VkSpecializationInfo alphaTestInfo = {1, &alphaTestEntry, sizeof(VkBool32), &alphaTest};
+
+    // one variant per material class, and the opaque variant following a pre-pass
+    auto createVariants = [&](VkPipeline *pOpaque, VkPipeline *pAlphaTest, VkPipeline *pBlended, VkPipeline *pEqual)
+    {
+        err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, pOpaque);
+        g_Device->pCheckVkResultFn(err);
+
+        stage[1].pSpecializationInfo = &alphaTestInfo;
+        err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, pAlphaTest);
+        g_Device->pCheckVkResultFn(err);
+        stage[1].pSpecializationInfo = nullptr;
+
+        color_attachment[0].blendEnable = VK_TRUE;
+        depth_info.depthWriteEnable = VK_FALSE;
+        err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, pBlended);
+        g_Device->pCheckVkResultFn(err);
+        color_attachment[0].blendEnable = VK_FALSE;
+
+        if (prePass)
+        {
+            depth_info.depthCompareOp = VK_COMPARE_OP_EQUAL;
+            err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, pEqual);
+            g_Device->pCheckVkResultFn(err);
+            depth_info.depthCompareOp = VK_COMPARE_OP_LESS;
+        }
+        depth_info.depthWriteEnable = pCreateInfo->flags & MO_PIPELINE_FEATURE_DEPTH_WRITE ? VK_TRUE : VK_FALSE;
+    };
+    createVariants(&pipeline->pipeline, &pipeline->alphaTestPipeline, &pipeline->blendedPipeline, &pipeline->equalPipeline);
+
+    if (pCreateInfo->pInstancedVertexShader)
+    {
+        VkShaderModule inst_module;
+        VkShaderModuleCreateInfo inst_info = {};
+        inst_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        inst_info.codeSize = pCreateInfo->instancedVertexShaderSize;
+        inst_info.pCode = pCreateInfo->pInstancedVertexShader;
+        err = vkCreateShaderModule(g_Device->device, &inst_info, g_Allocator, &inst_module);
+        g_Device->pCheckVkResultFn(err);
+        stage[0].module = inst_module;
+
+        // the model matrix, one column per location
+        VkVertexInputBindingDescription inst_binding_desc[6] = {};
+        std::copy(binding_desc, binding_desc + countof(binding_desc), inst_binding_desc);
+        inst_binding_desc[5].binding = 5;
+        inst_binding_desc[5].stride = sizeof(float4x4);
+        inst_binding_desc[5].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+        for (uint32_t i = 0; i < 4; ++i)
+            attribute_desc.emplace_back(VkVertexInputAttributeDescription{5 + i, inst_binding_desc[5].binding, VK_FORMAT_R32G32B32A32_SFLOAT, i * (uint32_t)sizeof(float4) });
+
+        vertex_info.vertexBindingDescriptionCount = (uint32_t)countof(inst_binding_desc);
+        vertex_info.pVertexBindingDescriptions = inst_binding_desc;
+        vertex_info.vertexAttributeDescriptionCount = (uint32_t)attribute_desc.size();
+        vertex_info.pVertexAttributeDescriptions = attribute_desc.data();
+        createVariants(&pipeline->instancedPipeline, &pipeline->instancedAlphaTestPipeline, &pipeline->instancedBlendedPipeline, &pipeline->instancedEqualPipeline);
+
+        vkDestroyShaderModule(g_Device->device, inst_module, nullptr);
+    }
+
+    if (prePass)
+    {
+        // no fragment stage and no color writes, only the position stream
+        VkShaderModule depth_module;
+        VkShaderModuleCreateInfo depth_module_info = {};
+        depth_module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        depth_module_info.codeSize = pCreateInfo->depthVertexShaderSize;
+        depth_module_info.pCode = pCreateInfo->pDepthVertexShader;
+        err = vkCreateShaderModule(g_Device->device, &depth_module_info, g_Allocator, &depth_module);
+        g_Device->pCheckVkResultFn(err);
+        stage[0].module = depth_module;
+        info.stageCount = 1;
+
+        color_attachment[0].colorWriteMask = 0;
+
+        vertex_info.vertexBindingDescriptionCount = 1;
+        vertex_info.pVertexBindingDescriptions = binding_desc;
+        vertex_info.vertexAttributeDescriptionCount = 1;
+        vertex_info.pVertexAttributeDescriptions = attribute_desc.data();
+        err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, &pipeline->depthPipeline);
+        g_Device->pCheckVkResultFn(err);
+
+        vkDestroyShaderModule(g_Device->device, depth_module, nullptr);
+
+        if (pCreateInfo->pInstancedDepthVertexShader && pipeline->instancedPipeline != VK_NULL_HANDLE)
+        {
+            VkShaderModule inst_depth_module;
+            VkShaderModuleCreateInfo inst_depth_info = {};
+            inst_depth_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            inst_depth_info.codeSize = pCreateInfo->instancedDepthVertexShaderSize;
+            inst_depth_info.pCode = pCreateInfo->pInstancedDepthVertexShader;
+            err = vkCreateShaderModule(g_Device->device, &inst_depth_info, g_Allocator, &inst_depth_module);
+            g_Device->pCheckVkResultFn(err);
+            stage[0].module = inst_depth_module;
+
+            // the position and the model matrix, at the same bindings and locations as the shaded variant
+            VkVertexInputBindingDescription inst_depth_binding_desc[2] = {};
+            inst_depth_binding_desc[0] = binding_desc[0];
+            inst_depth_binding_desc[1].binding = 5;
+            inst_depth_binding_desc[1].stride = sizeof(float4x4);
+            inst_depth_binding_desc[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+            std::vector<VkVertexInputAttributeDescription> inst_depth_attribute_desc;
+            inst_depth_attribute_desc.emplace_back(VkVertexInputAttributeDescription{0, inst_depth_binding_desc[0].binding, VK_FORMAT_R32G32B32_SFLOAT, 0 });
+            for (uint32_t i = 0; i < 4; ++i)
+                inst_depth_attribute_desc.emplace_back(VkVertexInputAttributeDescription{5 + i, inst_depth_binding_desc[1].binding, VK_FORMAT_R32G32B32A32_SFLOAT, i * (uint32_t)sizeof(float4) });
+
+            vertex_info.vertexBindingDescriptionCount = (uint32_t)countof(inst_depth_binding_desc);
+            vertex_info.pVertexBindingDescriptions = inst_depth_binding_desc;
+            vertex_info.vertexAttributeDescriptionCount = (uint32_t)inst_depth_attribute_desc.size();
+            vertex_info.pVertexAttributeDescriptions = inst_depth_attribute_desc.data();
+            err = vkCreateGraphicsPipelines(g_Device->device, g_PipelineCache, 1, &info, g_Allocator, &pipeline->instancedDepthPipeline);
+            g_Device->pCheckVkResultFn(err);
+
+            vkDestroyShaderModule(g_Device->device, inst_depth_module, nullptr);
+        }
+    }
 
     vkDestroyShaderModule(g_Device->device, frag_module, nullptr);
     vkDestroyShaderModule(g_Device->device, vert_module, nullptr);
 }
 
-void moDestroyPipeline(MoPipeline pipeline)
+void moDestroyPipeline(MoPipeline pipeline)
+{
+    const uint32_t frameCount = g_SwapChain->frameCount;
+    deferDeletion([pipeline, frameCount]()
+    {
+        for (size_t i = 0; i < frameCount; ++i) { deleteBuffer(g_Device, pipeline->uniformBuffer[i]); }
+        vkDestroyDescriptorSetLayout(g_Device->device, pipeline->descriptorSetLayout[MO_PROGRAM_DESC_LAYOUT], g_Allocator);
+        vkDestroyDescriptorSetLayout(g_Device->device, pipeline->descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT], g_Allocator);
+        vkDestroyPipelineLayout(g_Device->device, pipeline->pipelineLayout, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->pipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->instancedPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->alphaTestPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->instancedAlphaTestPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->blendedPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->instancedBlendedPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->depthPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->instancedDepthPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->equalPipeline, g_Allocator);
+        vkDestroyPipeline(g_Device->device, pipeline->instancedEqualPipeline, g_Allocator);
+        delete pipeline;
+    });
+}
+
+void moCreateMesh(const MoMeshCreateInfo *pCreateInfo, MoMesh *pMesh)
+{
+    MoMesh mesh = *pMesh = new MoMesh_T();
+    *mesh = {};
+
+    mesh->indexBufferSize = pCreateInfo->indexCount;
+    mesh->vertexCount = pCreateInfo->vertexCount;
+    computeBounds(pCreateInfo->pVertices, pCreateInfo->vertexCount, &mesh->aabb, &mesh->boundingSphere);
+    std::vector<uint32_t> indices;
+    const uint32_t *pIndices = pCreateInfo->pIndices;
+    mesh->lods[0] = {0, pCreateInfo->indexCount, 0.f};
+    mesh->lodCount = 1;
+    if (pCreateInfo->lodCount > 1)
+    {
+        mesh->lodCount = generateLods(pCreateInfo->pVertices, pCreateInfo->vertexCount, pCreateInfo->pIndices, pCreateInfo->indexCount,
+                                      std::min<uint32_t>(pCreateInfo->lodCount, MO_MESH_LOD_COUNT), indices, mesh->lods);
+        pIndices = indices.data();
+    }
+    const VkDeviceSize index_size = (mesh->lods[mesh->lodCount - 1].firstIndex + mesh->lods[mesh->lodCount - 1].indexCount) * sizeof(uint32_t);
+    createBuffer(g_Device, &mesh->verticesBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &mesh->textureCoordsBuffer, pCreateInfo->vertexCount * sizeof(float2), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &mesh->normalsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &mesh->tangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &mesh->bitangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &mesh->indexBuffer, index_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    uploadBuffer(g_Device, mesh->verticesBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pVertices);
+    uploadBuffer(g_Device, mesh->textureCoordsBuffer, pCreateInfo->vertexCount * sizeof(float2), pCreateInfo->pTextureCoords);
+    uploadBuffer(g_Device, mesh->normalsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pNormals);
+    uploadBuffer(g_Device, mesh->tangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pTangents);
+    uploadBuffer(g_Device, mesh->bitangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pBitangents);
+    uploadBuffer(g_Device, mesh->indexBuffer, index_size, pIndices);
+    g_FrameStats.stagingBytes += pCreateInfo->vertexCount * (4 * sizeof(float3) + sizeof(float2)) + index_size;
+}
+
+void moDestroyMesh(MoMesh mesh)
+{
+    deferDeletion([mesh]()
+    {
+        deleteBuffer(g_Device, mesh->verticesBuffer);
+        deleteBuffer(g_Device, mesh->textureCoordsBuffer);
+        deleteBuffer(g_Device, mesh->normalsBuffer);
+        deleteBuffer(g_Device, mesh->tangentsBuffer);
+        deleteBuffer(g_Device, mesh->bitangentsBuffer);
+        deleteBuffer(g_Device, mesh->indexBuffer);
+        delete mesh;
+    });
+}
+
+void moCreateMaterial(const MoMaterialCreateInfo *pCreateInfo, MoMaterial *pMaterial)
+{
+    MoMaterial material = *pMaterial = new MoMaterial_T();
+    *material = {};
+
+    VkResult err = vkDeviceWaitIdle(g_Device->device);
+    g_Device->pCheckVkResultFn(err);
+
+    auto & frame = g_SwapChain->frames[g_FrameIndex];
+    generateTexture(&material->ambientImage,  pCreateInfo->textureAmbient,  pCreateInfo->colorAmbient,  frame.pool, frame.buffer);
+    generateTexture(&material->diffuseImage,  pCreateInfo->textureDiffuse,  pCreateInfo->colorDiffuse,  frame.pool, frame.buffer);
+    generateTexture(&material->normalImage,   pCreateInfo->textureNormal,   {0.f, 0.f, 0.f, 0.f},       frame.pool, frame.buffer);
+    generateTexture(&material->emissiveImage, pCreateInfo->textureEmissive, pCreateInfo->colorEmissive, frame.pool, frame.buffer);
+    generateTexture(&material->specularImage, pCreateInfo->textureSpecular, pCreateInfo->colorSpecular, frame.pool, frame.buffer);
+    material->materialClass = classifyMaterial(pCreateInfo->textureDiffuse, pCreateInfo->colorDiffuse);
+
+    {
+        VkSamplerCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        info.minLod = -1000;
+        info.maxLod = 1000;
+        info.maxAnisotropy = 1.0f;
+        info.minFilter = info.magFilter = pCreateInfo->textureAmbient.filter;
+        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->ambientSampler);
+        g_Device->pCheckVkResultFn(err);
+        info.minFilter = info.magFilter = pCreateInfo->textureDiffuse.filter;
+        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->diffuseSampler);
+        g_Device->pCheckVkResultFn(err);
+        info.minFilter = info.magFilter = pCreateInfo->textureNormal.filter;
+        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->normalSampler);
+        g_Device->pCheckVkResultFn(err);
+        info.minFilter = info.magFilter = pCreateInfo->textureSpecular.filter;
+        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->specularSampler);
+        g_Device->pCheckVkResultFn(err);
+        info.minFilter = info.magFilter = pCreateInfo->textureEmissive.filter;
+        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->emissiveSampler);
+        g_Device->pCheckVkResultFn(err);
+    }
+
+    {
+        VkDescriptorSetAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = g_Device->descriptorPool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &g_Pipeline->descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT];
+        err = vkAllocateDescriptorSets(g_Device->device, &alloc_info, &material->descriptorSet);
+        g_Device->pCheckVkResultFn(err);
+    }
+
+    {
+        VkDescriptorImageInfo desc_image[5] = {};
+        desc_image[0].sampler = material->ambientSampler;
+        desc_image[0].imageView = material->ambientImage->view;
+        desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        desc_image[1].sampler = material->diffuseSampler;
+        desc_image[1].imageView = material->diffuseImage->view;
+        desc_image[1].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        desc_image[2].sampler = material->normalSampler;
+        desc_image[2].imageView = material->normalImage->view;
+        desc_image[2].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        desc_image[3].sampler = material->specularSampler;
+        desc_image[3].imageView = material->specularImage->view;
+        desc_image[3].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        desc_image[4].sampler = material->emissiveSampler;
+        desc_image[4].imageView = material->emissiveImage->view;
+        desc_image[4].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        VkWriteDescriptorSet write_desc[5] = {};
+        for (uint32_t i = 0; i < 5; ++i)
+        {
+            write_desc[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            write_desc[i].dstSet = material->descriptorSet;
+            write_desc[i].dstBinding = i;
+            write_desc[i].descriptorCount = 1;
+            write_desc[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            write_desc[i].pImageInfo = &desc_image[i];
+        }
+        vkUpdateDescriptorSets(g_Device->device, 5, write_desc, 0, nullptr);
+    }
+}
+
+void moDestroyMaterial(MoMaterial material)
+{
+    deferDeletion([material]()
+    {
+        deleteBuffer(g_Device, material->ambientImage);
+        deleteBuffer(g_Device, material->diffuseImage);
+        deleteBuffer(g_Device, material->normalImage);
+        deleteBuffer(g_Device, material->specularImage);
+        deleteBuffer(g_Device, material->emissiveImage);
+
+        vkDestroySampler(g_Device->device, material->ambientSampler, g_Allocator);
+        vkDestroySampler(g_Device->device, material->diffuseSampler, g_Allocator);
+        vkDestroySampler(g_Device->device, material->normalSampler, g_Allocator);
+        vkDestroySampler(g_Device->device, material->specularSampler, g_Allocator);
+        vkDestroySampler(g_Device->device, material->emissiveSampler, g_Allocator);
+        delete material;
+    });
+}
+
+static void addFrameStats(MoFrameStats & stats, const MoFrameStats & other)
+{
+    stats.drawCalls += other.drawCalls;
+    stats.triangles += other.triangles;
+    stats.instances += other.instances;
+    stats.pipelineBinds += other.pipelineBinds;
+    stats.descriptorSetBinds += other.descriptorSetBinds;
+    stats.vertexBufferBinds += other.vertexBufferBinds;
+    stats.indexBufferBinds += other.indexBufferBinds;
+    stats.pushConstantBytes += other.pushConstantBytes;
+    stats.uniformBytes += other.uniformBytes;
+    stats.stagingBytes += other.stagingBytes;
+}
+
+static void bindPipeline(VkCommandBuffer commandBuffer, MoFrameStats *pStats, VkPipeline *pBoundPipeline, VkPipeline pipeline)
+{
+    if (*pBoundPipeline != pipeline)
+    {
+        ++pStats->pipelineBinds;
+        // switches recorded into record contexts are not profiled
+        if (pBoundPipeline == &g_BoundPipeline)
+            profileLeaf("pipeline", pipeline);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        *pBoundPipeline = pipeline;
+    }
+}
+
+// the variant of a pipeline drawing a pass and material class, null when the pass draws nothing with this pipeline
+static VkPipeline passPipeline(MoPipeline pipeline, MoDrawPass pass, MoMaterialClass materialClass, bool instanced)
+{
+    VkPipeline shaded = instanced ? pipeline->instancedPipeline : pipeline->pipeline;
+    if (materialClass == MO_MATERIAL_CLASS_ALPHA_TEST)
+        shaded = instanced ? pipeline->instancedAlphaTestPipeline : pipeline->alphaTestPipeline;
+    else if (materialClass == MO_MATERIAL_CLASS_BLENDED)
+        shaded = instanced ? pipeline->instancedBlendedPipeline : pipeline->blendedPipeline;
+
+    switch (pass)
+    {
+    case MO_DRAW_PASS_DEPTH_ONLY:
+        // objects without a depth variant or with alpha are left out of the pre-pass, and shade normally afterwards
+        if (materialClass != MO_MATERIAL_CLASS_OPAQUE)
+            return VK_NULL_HANDLE;
+        return instanced ? pipeline->instancedDepthPipeline : pipeline->depthPipeline;
+    case MO_DRAW_PASS_SHADED_EQUAL:
+    {
+        VkPipeline equal = instanced ? pipeline->instancedEqualPipeline : pipeline->equalPipeline;
+        return equal != VK_NULL_HANDLE && materialClass == MO_MATERIAL_CLASS_OPAQUE ? equal : shaded;
+    }
+    default:
+        return shaded;
+    }
+}
+
+static void bindMesh(VkCommandBuffer commandBuffer, MoFrameStats *pStats, MoMesh mesh, MoDrawPass pass)
+{
+    ++pStats->vertexBufferBinds;
+    ++pStats->indexBufferBinds;
+    VkBuffer vertexBuffers[] = {mesh->verticesBuffer->buffer,
+                                mesh->textureCoordsBuffer->buffer,
+                                mesh->normalsBuffer->buffer,
+                                mesh->tangentsBuffer->buffer,
+                                mesh->bitangentsBuffer->buffer};
+    VkDeviceSize offsets[] = {0,
+                              0,
+                              0,
+                              0,
+                              0};
+    // the depth variants read the position stream only
+    vkCmdBindVertexBuffers(commandBuffer, 0, pass == MO_DRAW_PASS_DEPTH_ONLY ? 1 : 5, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, mesh->indexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+// point the following draws at view, leaving the pushed model matrix as is
+static void setView(VkCommandBuffer commandBuffer, MoFrameStats *pStats, MoPipeline pipeline, const MoView & view)
+{
+    // view, projection and eye, the tail of the push constant
+    const uint32_t size = sizeof(MoPushConstant) - offsetof(MoPushConstant, view);
+    pStats->pushConstantBytes += size;
+    VkViewport viewport{ float(view.viewport.offset.x), float(view.viewport.offset.y), float(view.viewport.extent.width), float(view.viewport.extent.height), 0.f, 1.f };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &view.viewport);
+    vkCmdPushConstants(commandBuffer, pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, offsetof(MoPushConstant, view), size, &view.view);
+}
+
+static void drawMesh(VkCommandBuffer commandBuffer, MoFrameStats *pStats, MoPipeline pipeline, MoDrawPass pass, MoMaterialClass materialClass, VkPipeline *pBoundPipeline, MoMesh mesh, uint32_t lod = 0, const MoView* pViews = nullptr, uint32_t viewCount = 0)
+{
+    VkPipeline variant = passPipeline(pipeline, pass, materialClass, false);
+    if (variant == VK_NULL_HANDLE)
+        return;
+
+    bindPipeline(commandBuffer, pStats, pBoundPipeline, variant);
+    bindMesh(commandBuffer, pStats, mesh, pass);
+
+    for (uint32_t v = 0; v < std::max(viewCount, 1u); ++v)
+    {
+        if (viewCount != 0)
+            setView(commandBuffer, pStats, pipeline, pViews[v]);
+        vkCmdDrawIndexed(commandBuffer, mesh->lods[lod].indexCount, 1, mesh->lods[lod].firstIndex, 0, 0);
+        ++pStats->drawCalls;
+        ++pStats->instances;
+        pStats->triangles += mesh->lods[lod].indexCount / 3;
+    }
+}
+
+static void drawMeshInstanced(VkCommandBuffer commandBuffer, MoFrameStats *pStats, MoPipeline pipeline, MoDrawPass pass, MoMaterialClass materialClass, VkPipeline *pBoundPipeline, MoInstanceRing & ring, MoMesh mesh, const float4x4* pModels, uint32_t count, const MoView* pViews = nullptr, uint32_t viewCount = 0)
+{
+    if (count == 0)
+        return;
+
+    VkPipeline variant = passPipeline(pipeline, pass, materialClass, true);
+    if (variant == VK_NULL_HANDLE)
+    {
+        variant = passPipeline(pipeline, pass, materialClass, false);
+        if (variant == VK_NULL_HANDLE)
+            return;
+
+        bindPipeline(commandBuffer, pStats, pBoundPipeline, variant);
+        bindMesh(commandBuffer, pStats, mesh, pass);
+        for (uint32_t v = 0; v < std::max(viewCount, 1u); ++v)
+        {
+            if (viewCount != 0)
+                setView(commandBuffer, pStats, pipeline, pViews[v]);
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                vkCmdPushConstants(commandBuffer, pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, offsetof(MoPushConstant, model), sizeof(float4x4), &pModels[i]);
+                vkCmdDrawIndexed(commandBuffer, mesh->indexBufferSize, 1, 0, 0, 0);
+            }
+            pStats->pushConstantBytes += count * sizeof(float4x4);
+            pStats->drawCalls += count;
+            pStats->instances += count;
+            pStats->triangles += uint64_t(count) * (mesh->indexBufferSize / 3);
+        }
+        return;
+    }
+
+    MoDeviceBuffer instanceBuffer;
+    VkDeviceSize instanceOffset;
+    allocateInstances(g_Device, ring, count * sizeof(float4x4), &instanceBuffer, &instanceOffset);
+    uploadBuffer(g_Device, instanceBuffer, count * sizeof(float4x4), pModels, instanceOffset);
+    pStats->uniformBytes += count * sizeof(float4x4);
+
+    bindPipeline(commandBuffer, pStats, pBoundPipeline, variant);
+    bindMesh(commandBuffer, pStats, mesh, pass);
+    vkCmdBindVertexBuffers(commandBuffer, 5, 1, &instanceBuffer->buffer, &instanceOffset);
+    ++pStats->vertexBufferBinds;
+
+    for (uint32_t v = 0; v < std::max(viewCount, 1u); ++v)
+    {
+        if (viewCount != 0)
+            setView(commandBuffer, pStats, pipeline, pViews[v]);
+        vkCmdDrawIndexed(commandBuffer, mesh->indexBufferSize, count, 0, 0, 0);
+        ++pStats->drawCalls;
+        pStats->instances += count;
+        pStats->triangles += uint64_t(count) * (mesh->indexBufferSize / 3);
+    }
+}
+
+void moBegin(uint32_t frameIndex)
+{
+    if (frameIndex != g_FrameIndex)
+    {
+        // first pipeline of a new frame, whose fence has been waited on
+        resetInstanceRing(g_Device, g_InstanceRing[frameIndex]);
+    }
+    g_FrameIndex = frameIndex;
+    g_BoundPipeline = VK_NULL_HANDLE;
+    g_DrawPass = MO_DRAW_PASS_SHADED;
+    g_MaterialClass = MO_MATERIAL_CLASS_OPAQUE;
+    if (g_SubpassContents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS)
+        return;
+
+    profileLeaf("moBegin", g_Pipeline->pipeline);
+    auto & frame = g_SwapChain->frames[g_FrameIndex];
+    // bound outside of g_BoundPipeline so the bind does not start a second scope
+    VkPipeline boundPipeline = VK_NULL_HANDLE;
+    bindPipeline(frame.buffer, &g_FrameStats, &boundPipeline, g_Pipeline->pipeline);
+    g_BoundPipeline = boundPipeline;
+    vkCmdBindDescriptorSets(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipelineLayout, 0, 1, &g_Pipeline->descriptorSet[g_FrameIndex], 0, nullptr);
+    ++g_FrameStats.descriptorSetBinds;
+}
+
+void moPipelineOverride(MoPipeline pipeline)
+{
+    if (pipeline == VK_NULL_HANDLE)
+    {
+        if (g_StashedPipeline != VK_NULL_HANDLE)
+            g_Pipeline = g_StashedPipeline;
+        g_StashedPipeline = VK_NULL_HANDLE;
+    }
+    else
+    {
+        if (g_StashedPipeline == VK_NULL_HANDLE)
+            g_StashedPipeline = g_Pipeline;
+        g_Pipeline = pipeline;
+    }
+}
+
+void moProfileBegin(const char *pName)
+{
+    if (g_ProfileFrame == ~0u || g_SubpassContents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS)
+        return;
+
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[g_ProfileFrame].buffer;
+    profileEndLeaf(commandBuffer);
+    profileBegin(commandBuffer, pName, VK_NULL_HANDLE, false);
+}
+
+void moProfileEnd()
+{
+    if (g_ProfileFrame == ~0u || g_SubpassContents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS)
+        return;
+
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[g_ProfileFrame].buffer;
+    profileEndLeaf(commandBuffer);
+    // the frame scope is only ended by moSubmitSwapChain
+    if (g_ProfileFrames[g_ProfileFrame].open.size() > 1)
+        profileEnd(commandBuffer);
+}
+
+void moGetProfile(uint32_t *pCount, MoProfileScope *pScopes)
+{
+    if (pScopes == nullptr)
+    {
+        *pCount = uint32_t(g_Profile.size());
+        return;
+    }
+    *pCount = std::min(*pCount, uint32_t(g_Profile.size()));
+    std::copy(g_Profile.begin(), g_Profile.begin() + *pCount, pScopes);
+}
+
+void moGetFrameStats(MoFrameStats *pStats)
+{
+    *pStats = g_LastFrameStats;
+}
+
+void moGetMemoryStats(MoMemoryStats *pStats)
+{
+    *pStats = {};
+    VkDeviceSize allocated[VK_MAX_MEMORY_HEAPS];
+    {
+        std::lock_guard<std::mutex> lock(g_MemoryMutex);
+        std::copy(g_MemoryCategories, g_MemoryCategories + MO_MEMORY_CATEGORY_COUNT, pStats->categories);
+        std::copy(g_MemoryHeaps, g_MemoryHeaps + VK_MAX_MEMORY_HEAPS, allocated);
+        pStats->allocationCount = g_AllocationCount;
+    }
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+    budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 prop = {};
+    prop.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    if (g_GetPhysicalDeviceMemoryProperties2 != nullptr)
+    {
+        prop.pNext = &budget;
+        g_GetPhysicalDeviceMemoryProperties2(g_Device->physicalDevice, &prop);
+        pStats->memoryBudget = VK_TRUE;
+    }
+    else
+    {
+        prop.memoryProperties = g_Device->memoryProperties;
+    }
+
+    pStats->heapCount = prop.memoryProperties.memoryHeapCount;
+    for (uint32_t i = 0; i < pStats->heapCount; ++i)
+    {
+        MoMemoryHeapStats & heap = pStats->heaps[i];
+        heap.size = prop.memoryProperties.memoryHeaps[i].size;
+        heap.flags = prop.memoryProperties.memoryHeaps[i].flags;
+        heap.allocated = allocated[i];
+        heap.usage = pStats->memoryBudget ? budget.heapUsage[i] : heap.allocated;
+        heap.budget = pStats->memoryBudget ? budget.heapBudget[i] : heap.size;
+    }
+}
+
+void moSetDrawPass(MoDrawPass pass)
+{
+    g_DrawPass = pass;
+}
+
+void moSetPMV(const MoPushConstant* pProjectionModelView)
+{
+    g_PushConstant = *pProjectionModelView;
+    vkCmdPushConstants(g_SwapChain->frames[g_FrameIndex].buffer, g_Pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MoPushConstant), pProjectionModelView);
+    g_FrameStats.pushConstantBytes += sizeof(MoPushConstant);
+}
+
+void moSetLight(const MoUniform* pLightAndCamera)
+{
+    uploadBuffer(g_Device, g_Pipeline->uniformBuffer[g_FrameIndex], sizeof(MoUniform), pLightAndCamera);
+    g_FrameStats.uniformBytes += sizeof(MoUniform);
+}
+
+// the last view drawn replaced the caller's viewport, view, projection and eye; recorded with the first draw after
+// moSetViews cleared the views, which may have been called outside of a frame
+static void restoreView()
+{
+    if (!g_RestoreView)
+        return;
+
+    g_RestoreView = false;
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[g_FrameIndex].buffer;
+    VkViewport viewport{ 0, 0, float(g_SwapChain->renderExtent.width), float(g_SwapChain->renderExtent.height), 0.f, 1.f };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    VkRect2D scissor{ { 0, 0 },{ g_SwapChain->renderExtent.width, g_SwapChain->renderExtent.height } };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    const uint32_t size = sizeof(MoPushConstant) - offsetof(MoPushConstant, view);
+    vkCmdPushConstants(commandBuffer, g_Pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, offsetof(MoPushConstant, view), size, &g_PushConstant.view);
+    g_FrameStats.pushConstantBytes += size;
+}
+
+void moDrawMesh(MoMesh mesh)
+{
+    restoreView();
+    drawMesh(g_SwapChain->frames[g_FrameIndex].buffer, &g_FrameStats, g_Pipeline, g_DrawPass, g_MaterialClass, &g_BoundPipeline, mesh, 0, g_Views.data(), uint32_t(g_Views.size()));
+}
+
+void moSetViews(const MoView *pViews, uint32_t count)
+{
+    g_RestoreView = count == 0 && (g_RestoreView || !g_Views.empty());
+    g_Views.assign(pViews, pViews + count);
+}
+
+uint32_t moSelectMeshLod(MoMesh mesh, const MoPushConstant *pProjectionModelView, float viewportHeight, float pixelError)
+{
+    const float4x4 & model = pProjectionModelView->model;
+    const float3 center = mul(pProjectionModelView->view, mul(model, float4(mesh->boundingSphere.xyz(), 1.f))).xyz();
+    const float scale = std::max(std::max(length(model.x.xyz()), length(model.y.xyz())), length(model.z.xyz()));
+    const float distance = length(center) - mesh->boundingSphere.w * scale;
+    if (distance <= 0.f)
+        return 0;
+
+    // pixels covered by one object space unit at the sphere's nearest point
+    const float pixelsPerUnit = std::abs(pProjectionModelView->projection.y.y) * 0.5f * viewportHeight * scale / distance;
+    uint32_t lod = 0;
+    while (lod + 1 < mesh->lodCount && mesh->lods[lod + 1].error * pixelsPerUnit <= pixelError)
+        ++lod;
+    return lod;
+}
+
+void moDrawMeshLod(MoMesh mesh, uint32_t lod)
+{
+    restoreView();
+    drawMesh(g_SwapChain->frames[g_FrameIndex].buffer, &g_FrameStats, g_Pipeline, g_DrawPass, g_MaterialClass, &g_BoundPipeline, mesh, lod, g_Views.data(), uint32_t(g_Views.size()));
+}
+
+void moDrawMeshInstanced(MoMesh mesh, const float4x4* pModels, uint32_t count)
+{
+    restoreView();
+    drawMeshInstanced(g_SwapChain->frames[g_FrameIndex].buffer, &g_FrameStats, g_Pipeline, g_DrawPass, g_MaterialClass, &g_BoundPipeline, g_InstanceRing[g_FrameIndex], mesh, pModels, count, g_Views.data(), uint32_t(g_Views.size()));
+}
+
+void moBindMaterial(MoMaterial material)
+{
+    auto & frame = g_SwapChain->frames[g_FrameIndex];
+    vkCmdBindDescriptorSets(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipelineLayout, 1, 1, &material->descriptorSet, 0, nullptr);
+    ++g_FrameStats.descriptorSetBinds;
+    g_MaterialClass = material->materialClass;
+}
+
+void moCreateRecordContext(MoRecordContext *pContext)
+{
+    MoRecordContext context = *pContext = new MoRecordContext_T();
+    *context = {};
+
+    VkResult err;
+    for (size_t i = 0; i < g_SwapChain->frameCount; ++i)
+    {
+        {
+            VkCommandPoolCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            info.queueFamilyIndex = g_Device->queueFamily;
+            err = vkCreateCommandPool(g_Device->device, &info, g_Allocator, &context->pool[i]);
+            g_Device->pCheckVkResultFn(err);
+        }
+        {
+            VkCommandBufferAllocateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            info.commandPool = context->pool[i];
+            info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            info.commandBufferCount = 1;
+            err = vkAllocateCommandBuffers(g_Device->device, &info, &context->buffer[i]);
+            g_Device->pCheckVkResultFn(err);
+        }
+    }
+}
+
+void moDestroyRecordContext(MoRecordContext context)
+{
+    // its command buffers may still be executed by frames in flight
+    const uint32_t frameCount = g_SwapChain->frameCount;
+    deferDeletion([context, frameCount]()
+    {
+        for (size_t i = 0; i < frameCount; ++i)
+        {
+            deleteInstanceRing(g_Device, context->instanceRing[i]);
+            vkFreeCommandBuffers(g_Device->device, context->pool[i], 1, &context->buffer[i]);
+            vkDestroyCommandPool(g_Device->device, context->pool[i], g_Allocator);
+        }
+        delete context;
+    });
+}
+
+void moRecordBegin(MoRecordContext context, uint32_t frameIndex)
+{
+    VkResult err;
+
+    context->frameIndex = frameIndex;
+    context->pipeline = g_Pipeline;
+    context->drawPass = g_DrawPass;
+    context->materialClass = MO_MATERIAL_CLASS_OPAQUE;
+    context->boundPipeline = VK_NULL_HANDLE;
+    context->stats = {};
+    resetInstanceRing(g_Device, context->instanceRing[frameIndex]);
+
+    VkCommandBuffer commandBuffer = context->buffer[frameIndex];
+    err = vkResetCommandPool(g_Device->device, context->pool[frameIndex], 0);
+    g_Device->pCheckVkResultFn(err);
+    {
+        VkCommandBufferInheritanceInfo inheritance = {};
+        inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritance.renderPass = g_SwapChain->renderPass;
+        inheritance.subpass = 0;
+        inheritance.framebuffer = VK_NULL_HANDLE;
+        VkCommandBufferBeginInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        info.pInheritanceInfo = &inheritance;
+        err = vkBeginCommandBuffer(commandBuffer, &info);
+        g_Device->pCheckVkResultFn(err);
+    }
+
+    // dynamic state is not inherited from the primary command buffer
+    VkViewport viewport{ 0, 0, float(g_SwapChain->renderExtent.width), float(g_SwapChain->renderExtent.height), 0.f, 1.f };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    VkRect2D scissor{ { 0, 0 },{ g_SwapChain->renderExtent.width, g_SwapChain->renderExtent.height } };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    bindPipeline(commandBuffer, &context->stats, &context->boundPipeline, context->pipeline->pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipeline->pipelineLayout, 0, 1, &context->pipeline->descriptorSet[frameIndex], 0, nullptr);
+    ++context->stats.descriptorSetBinds;
+}
+
+void moRecordSetPMV(MoRecordContext context, const MoPushConstant* pProjectionModelView)
+{
+    vkCmdPushConstants(context->buffer[context->frameIndex], context->pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MoPushConstant), pProjectionModelView);
+    context->stats.pushConstantBytes += sizeof(MoPushConstant);
+}
+
+void moRecordBindMaterial(MoRecordContext context, MoMaterial material)
+{
+    vkCmdBindDescriptorSets(context->buffer[context->frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipeline->pipelineLayout, 1, 1, &material->descriptorSet, 0, nullptr);
+    ++context->stats.descriptorSetBinds;
+    context->materialClass = material->materialClass;
+}
+
+void moRecordDrawMesh(MoRecordContext context, MoMesh mesh)
+{
+    drawMesh(context->buffer[context->frameIndex], &context->stats, context->pipeline, context->drawPass, context->materialClass, &context->boundPipeline, mesh);
+}
+
+void moRecordDrawMeshLod(MoRecordContext context, MoMesh mesh, uint32_t lod)
+{
+    drawMesh(context->buffer[context->frameIndex], &context->stats, context->pipeline, context->drawPass, context->materialClass, &context->boundPipeline, mesh, lod);
+}
+
+void moRecordDrawMeshInstanced(MoRecordContext context, MoMesh mesh, const float4x4* pModels, uint32_t count)
+{
+    drawMeshInstanced(context->buffer[context->frameIndex], &context->stats, context->pipeline, context->drawPass, context->materialClass, &context->boundPipeline, context->instanceRing[context->frameIndex], mesh, pModels, count);
+}
+
+void moRecordEnd(MoRecordContext context)
+{
+    VkResult err = vkEndCommandBuffer(context->buffer[context->frameIndex]);
+    g_Device->pCheckVkResultFn(err);
+}
+
+void moExecuteRecords(const MoRecordContext* pContexts, uint32_t count)
+{
+    std::vector<VkCommandBuffer> commandBuffers(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        commandBuffers[i] = pContexts[i]->buffer[pContexts[i]->frameIndex];
+        addFrameStats(g_FrameStats, pContexts[i]->stats);
+    }
+    if (count > 0)
+        vkCmdExecuteCommands(g_SwapChain->frames[g_FrameIndex].buffer, count, commandBuffers.data());
+}
+
+void moCreateMeshPool(const MoMeshPoolCreateInfo *pCreateInfo, MoMeshPool *pPool)
+{
+    MoMeshPool pool = *pPool = new MoMeshPool_T();
+    *pool = {};
+
+    pool->vertexCapacity = pCreateInfo->vertexCapacity;
+    pool->indexCapacity = pCreateInfo->indexCapacity;
+    createBuffer(g_Device, &pool->verticesBuffer, pCreateInfo->vertexCapacity * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &pool->textureCoordsBuffer, pCreateInfo->vertexCapacity * sizeof(float2), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &pool->normalsBuffer, pCreateInfo->vertexCapacity * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &pool->tangentsBuffer, pCreateInfo->vertexCapacity * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &pool->bitangentsBuffer, pCreateInfo->vertexCapacity * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+    createBuffer(g_Device, &pool->indexBuffer, pCreateInfo->indexCapacity * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, MO_MEMORY_CATEGORY_MESH);
+}
+
+void moDestroyMeshPool(MoMeshPool pool)
+{
+    deferDeletion([pool]()
+    {
+        deleteBuffer(g_Device, pool->verticesBuffer);
+        deleteBuffer(g_Device, pool->textureCoordsBuffer);
+        deleteBuffer(g_Device, pool->normalsBuffer);
+        deleteBuffer(g_Device, pool->tangentsBuffer);
+        deleteBuffer(g_Device, pool->bitangentsBuffer);
+        deleteBuffer(g_Device, pool->indexBuffer);
+        delete pool;
+    });
+}
+
+VkResult moCreateMeshRange(MoMeshPool pool, const MoMeshCreateInfo *pCreateInfo, MoMeshRange *pRange)
+{
+    if (pool->vertexCount + pCreateInfo->vertexCount > pool->vertexCapacity
+     || pool->indexCount + pCreateInfo->indexCount > pool->indexCapacity)
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+
+    const VkDeviceSize first = pool->vertexCount;
+    uploadBuffer(g_Device, pool->verticesBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pVertices, first * sizeof(float3));
+    uploadBuffer(g_Device, pool->textureCoordsBuffer, pCreateInfo->vertexCount * sizeof(float2), pCreateInfo->pTextureCoords, first * sizeof(float2));
+    uploadBuffer(g_Device, pool->normalsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pNormals, first * sizeof(float3));
+    uploadBuffer(g_Device, pool->tangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pTangents, first * sizeof(float3));
+    uploadBuffer(g_Device, pool->bitangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pBitangents, first * sizeof(float3));
+    uploadBuffer(g_Device, pool->indexBuffer, pCreateInfo->indexCount * sizeof(uint32_t), pCreateInfo->pIndices, pool->indexCount * sizeof(uint32_t));
+    g_FrameStats.stagingBytes += pCreateInfo->vertexCount * (4 * sizeof(float3) + sizeof(float2)) + pCreateInfo->indexCount * sizeof(uint32_t);
+
+    pRange->firstIndex = pool->indexCount;
+    pRange->indexCount = pCreateInfo->indexCount;
+    pRange->vertexOffset = (int32_t)pool->vertexCount;
+    MoBox box;
+    computeBounds(pCreateInfo->pVertices, pCreateInfo->vertexCount, &box, &pRange->boundingSphere);
+    pool->vertexCount += pCreateInfo->vertexCount;
+    pool->indexCount += pCreateInfo->indexCount;
+    return VK_SUCCESS;
+}
+
+void moCreateDrawList(const MoDrawListCreateInfo *pCreateInfo, MoDrawList *pDrawList)
+{
+    assert(g_DrawListPipeline != VK_NULL_HANDLE);
+
+    MoDrawList drawList = *pDrawList = new MoDrawList_T();
+    *drawList = {};
+    drawList->pool = pCreateInfo->pool;
+    drawList->maxObjects = pCreateInfo->maxObjects;
+    drawList->resetVisibility = VK_TRUE;
+
+    VkResult err;
+    {
+        VkDescriptorSetLayout descriptorSetLayout[MO_FRAME_COUNT] = {};
+        for (size_t i = 0; i < g_SwapChain->frameCount; ++i)
+            descriptorSetLayout[i] = g_DrawListSetLayout;
+        VkDescriptorSetAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = g_Device->descriptorPool;
+        alloc_info.descriptorSetCount = g_SwapChain->frameCount;
+        alloc_info.pSetLayouts = descriptorSetLayout;
+        err = vkAllocateDescriptorSets(g_Device->device, &alloc_info, drawList->descriptorSet);
+        g_Device->pCheckVkResultFn(err);
+    }
+    createBuffer(g_Device, &drawList->visibilityBuffer, pCreateInfo->maxObjects * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, MO_MEMORY_CATEGORY_COMPUTE);
+
+    for (size_t i = 0; i < g_SwapChain->frameCount; ++i)
+    {
+        createBuffer(g_Device, &drawList->objectBuffer[i], pCreateInfo->maxObjects * sizeof(MoDrawObjectGPU), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, MO_MEMORY_CATEGORY_UNIFORM);
+        // commands, counts and instances of the early phase, then of the late one
+        createBuffer(g_Device, &drawList->commandBuffer[i], 2 * pCreateInfo->maxObjects * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, MO_MEMORY_CATEGORY_COMPUTE);
+        // at most one bucket per object
+        createBuffer(g_Device, &drawList->countBuffer[i], 2 * pCreateInfo->maxObjects * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, MO_MEMORY_CATEGORY_COMPUTE);
+        createBuffer(g_Device, &drawList->instanceBuffer[i], 2 * pCreateInfo->maxObjects * sizeof(float4x4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MO_MEMORY_CATEGORY_COMPUTE);
+        createBuffer(g_Device, &drawList->cullBuffer[i], sizeof(MoDrawListCull), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, MO_MEMORY_CATEGORY_UNIFORM);
+
+        MoDeviceBuffer buffers[] = {drawList->objectBuffer[i],
+                                    drawList->commandBuffer[i],
+                                    drawList->countBuffer[i],
+                                    drawList->instanceBuffer[i]};
+        VkDescriptorBufferInfo bufferInfo[6] = {};
+        VkWriteDescriptorSet descriptorWrite[7] = {};
+        for (uint32_t binding = 0; binding < 4; ++binding)
+        {
+            bufferInfo[binding].buffer = buffers[binding]->buffer;
+            bufferInfo[binding].offset = 0;
+            bufferInfo[binding].range = VK_WHOLE_SIZE;
+
+            descriptorWrite[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[binding].dstSet = drawList->descriptorSet[i];
+            descriptorWrite[binding].dstBinding = binding;
+            descriptorWrite[binding].dstArrayElement = 0;
+            descriptorWrite[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[binding].descriptorCount = 1;
+            descriptorWrite[binding].pBufferInfo = &bufferInfo[binding];
+        }
+        bufferInfo[4].buffer = drawList->cullBuffer[i]->buffer;
+        bufferInfo[4].offset = 0;
+        bufferInfo[4].range = VK_WHOLE_SIZE;
+        descriptorWrite[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite[4].dstSet = drawList->descriptorSet[i];
+        descriptorWrite[4].dstBinding = 4;
+        descriptorWrite[4].dstArrayElement = 0;
+        descriptorWrite[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptorWrite[4].descriptorCount = 1;
+        descriptorWrite[4].pBufferInfo = &bufferInfo[4];
+        VkDescriptorImageInfo imageInfo = {};
+        imageInfo.sampler = g_DepthPyramid.sampler;
+        imageInfo.imageView = g_DepthPyramid.view;
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        descriptorWrite[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite[5].dstSet = drawList->descriptorSet[i];
+        descriptorWrite[5].dstBinding = 5;
+        descriptorWrite[5].dstArrayElement = 0;
+        descriptorWrite[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite[5].descriptorCount = 1;
+        descriptorWrite[5].pImageInfo = &imageInfo;
+        bufferInfo[5].buffer = drawList->visibilityBuffer->buffer;
+        bufferInfo[5].offset = 0;
+        bufferInfo[5].range = VK_WHOLE_SIZE;
+        descriptorWrite[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite[6].dstSet = drawList->descriptorSet[i];
+        descriptorWrite[6].dstBinding = 6;
+        descriptorWrite[6].dstArrayElement = 0;
+        descriptorWrite[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrite[6].descriptorCount = 1;
+        descriptorWrite[6].pBufferInfo = &bufferInfo[5];
+        vkUpdateDescriptorSets(g_Device->device, (uint32_t)countof(descriptorWrite), descriptorWrite, 0, nullptr);
+        drawList->pyramidGeneration[i] = g_DepthPyramid.generation;
+    }
+}
+
+void moDestroyDrawList(MoDrawList drawList)
+{
+    const uint32_t frameCount = g_SwapChain->frameCount;
+    deferDeletion([drawList, frameCount]()
+    {
+        for (size_t i = 0; i < frameCount; ++i)
+        {
+            deleteBuffer(g_Device, drawList->objectBuffer[i]);
+            deleteBuffer(g_Device, drawList->commandBuffer[i]);
+            deleteBuffer(g_Device, drawList->countBuffer[i]);
+            deleteBuffer(g_Device, drawList->instanceBuffer[i]);
+            deleteBuffer(g_Device, drawList->cullBuffer[i]);
+        }
+        deleteBuffer(g_Device, drawList->visibilityBuffer);
+        vkFreeDescriptorSets(g_Device->device, g_Device->descriptorPool, frameCount, drawList->descriptorSet);
+        delete drawList;
+    });
+}
+
+void moSetDrawListObjects(MoDrawList drawList, const MoDrawObject *pObjects, uint32_t count)
+{
+    assert(count <= drawList->maxObjects);
+
+    drawList->buckets.clear();
+    drawList->objects.resize(count);
+    std::unordered_map<MoMaterial, uint32_t> bucketIndices;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        auto inserted = bucketIndices.emplace(pObjects[i].material, (uint32_t)drawList->buckets.size());
+        if (inserted.second)
+            drawList->buckets.push_back({pObjects[i].material, 0, 0});
+        ++drawList->buckets[inserted.first->second].commandCount;
+
+        MoDrawObjectGPU & object = drawList->objects[i];
+        object = {};
+        object.model = pObjects[i].model;
+        object.boundingSphere = pObjects[i].range.boundingSphere;
+        object.firstIndex = pObjects[i].range.firstIndex;
+        object.indexCount = pObjects[i].range.indexCount;
+        object.vertexOffset = pObjects[i].range.vertexOffset;
+        object.bucket = inserted.first->second;
+    }
+
+    uint32_t firstCommand = 0;
+    for (MoDrawListBucket & bucket : drawList->buckets)
+    {
+        bucket.firstCommand = firstCommand;
+        firstCommand += bucket.commandCount;
+    }
+    for (MoDrawObjectGPU & object : drawList->objects)
+        object.bucketBase = drawList->buckets[object.bucket].firstCommand;
+
+    ++drawList->version;
+    drawList->resetVisibility = VK_TRUE;
+}
+
+void moSetDrawListModel(MoDrawList drawList, uint32_t objectIndex, const float4x4 & model)
+{
+    assert(objectIndex < drawList->objects.size());
+
+    drawList->objects[objectIndex].model = model;
+    ++drawList->version;
+}
+
+// a recreated swap chain has a new depth buffer, done before the draw lists bind the pyramid for the frame
+static void updateDepthPyramid()
+{
+    if (g_DepthPyramid.depthImage == g_SwapChain->depthBuffer->image)
+        return;
+
+    if (g_DepthPyramid.image != VK_NULL_HANDLE)
+    {
+        MoDepthPyramid retired = g_DepthPyramid;
+        deferDeletion([retired]() mutable { deleteDepthPyramid(g_Device, retired); });
+        memset(g_DepthPyramid.levelSets, 0, sizeof(g_DepthPyramid.levelSets));
+    }
+    createDepthPyramid(g_Device, g_DepthPyramid, g_SwapChain->depthBuffer, g_SwapChain->extent);
+}
+
+void moBuildDepthPyramid(uint32_t frameIndex)
+{
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[frameIndex].buffer;
+
+    updateDepthPyramid();
+    // a scaled depth buffer only covers renderExtent, the pyramid would cull against what is left around it
+    g_DepthPyramid.valid = g_DepthPyramidPipeline != VK_NULL_HANDLE
+                        && g_SwapChain->renderExtent.width == g_DepthPyramid.depthExtent.width
+                        && g_SwapChain->renderExtent.height == g_DepthPyramid.depthExtent.height;
+    if (!g_DepthPyramid.valid)
+        return;
+
+    {
+        VkImageMemoryBarrier barrier[2] = {};
+        barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        barrier[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier[0].image = g_DepthPyramid.depthImage;
+        barrier[0].subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+        // the previous frame's late cull pass is done with it, every level is rewritten
+        barrier[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier[1].srcAccessMask = 0;
+        barrier[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier[1].image = g_DepthPyramid.image;
+        barrier[1].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, g_DepthPyramid.levelCount, 0, 1};
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 2, barrier);
+    }
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DepthPyramidPipeline);
+    MoDepthPyramidConstant constant = {};
+    constant.sourceSize[0] = (int32_t)g_DepthPyramid.depthExtent.width;
+    constant.sourceSize[1] = (int32_t)g_DepthPyramid.depthExtent.height;
+    for (uint32_t level = 0; level < g_DepthPyramid.levelCount; ++level)
+    {
+        constant.destinationSize[0] = std::max(1, constant.sourceSize[0] / 2);
+        constant.destinationSize[1] = std::max(1, constant.sourceSize[1] / 2);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DepthPyramidPipelineLayout, 0, 1, &g_DepthPyramid.levelSets[level], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, g_DepthPyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MoDepthPyramidConstant), &constant);
+        vkCmdDispatch(commandBuffer, (constant.destinationSize[0] + 7) / 8, (constant.destinationSize[1] + 7) / 8, 1);
+
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        constant.sourceSize[0] = constant.destinationSize[0];
+        constant.sourceSize[1] = constant.destinationSize[1];
+    }
+
+    {
+        // back to the layout moResumeRenderPass loads it in
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = g_DepthPyramid.depthImage;
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+}
+
+void moFrustumPlanes(const float4x4 & viewProjection, float4 planes[6])
+{
+    const float4 row[4] = {{viewProjection.x.x, viewProjection.y.x, viewProjection.z.x, viewProjection.w.x},
+                           {viewProjection.x.y, viewProjection.y.y, viewProjection.z.y, viewProjection.w.y},
+                           {viewProjection.x.z, viewProjection.y.z, viewProjection.z.z, viewProjection.w.z},
+                           {viewProjection.x.w, viewProjection.y.w, viewProjection.z.w, viewProjection.w.w}};
+    planes[0] = row[3] + row[0];
+    planes[1] = row[3] - row[0];
+    planes[2] = row[3] + row[1];
+    planes[3] = row[3] - row[1];
+    planes[4] = row[2];
+    planes[5] = row[3] - row[2];
+    for (size_t i = 0; i < 6; ++i)
+        planes[i] /= linalg::length(planes[i].xyz());
+}
+
+void moTransformBox(const MoBox *pBox, const float4x4 & model, MoBox *pTransformed)
+{
+    const float3 center = mul(model, float4((pBox->min + pBox->max) * 0.5f, 1.f)).xyz();
+    const float3 extent = (pBox->max - pBox->min) * 0.5f;
+    const float3 transformedExtent = abs(model.x.xyz()) * extent.x + abs(model.y.xyz()) * extent.y + abs(model.z.xyz()) * extent.z;
+    pTransformed->min = center - transformedExtent;
+    pTransformed->max = center + transformedExtent;
+}
+
+void moTileProjection(const float4x4 & projection, VkExtent2D extent, VkRect2D tile, float4x4 *pTileProjection)
+{
+    // scale and offset clip space so the tile's part of [-1, 1] covers all of it, which works for any projection
+    const float2 scale(extent.width / float(tile.extent.width), extent.height / float(tile.extent.height));
+    const float2 center((2.f * tile.offset.x + tile.extent.width) / extent.width - 1.f,
+                        (2.f * tile.offset.y + tile.extent.height) / extent.height - 1.f);
+    float4x4 crop = identity;
+    crop.x.x = scale.x;
+    crop.y.y = scale.y;
+    crop.w.x = -scale.x * center.x;
+    crop.w.y = -scale.y * center.y;
+    *pTileProjection = mul(crop, projection);
+}
+
+void moCullFrustum(const float4x4 & viewProjection, const MoBox *pBoxes, uint32_t count, uint32_t *pVisible)
+{
+    // a box is outside when its corner furthest along a plane's normal is behind that plane
+    float4 planes[6];
+    moFrustumPlanes(viewProjection, planes);
+    memset(pVisible, 0, ((count + 31) / 32) * sizeof(uint32_t));
+
+    uint32_t i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= count; i += 8)
+    {
+        alignas(32) float soa[6][8];
+        for (uint32_t j = 0; j < 8; ++j)
+        {
+            soa[0][j] = pBoxes[i + j].min.x; soa[1][j] = pBoxes[i + j].min.y; soa[2][j] = pBoxes[i + j].min.z;
+            soa[3][j] = pBoxes[i + j].max.x; soa[4][j] = pBoxes[i + j].max.y; soa[5][j] = pBoxes[i + j].max.z;
+        }
+        const __m256 lower[3] = {_mm256_load_ps(soa[0]), _mm256_load_ps(soa[1]), _mm256_load_ps(soa[2])};
+        const __m256 upper[3] = {_mm256_load_ps(soa[3]), _mm256_load_ps(soa[4]), _mm256_load_ps(soa[5])};
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (const float4 & plane : planes)
+        {
+            __m256 distance = _mm256_set1_ps(plane.w);
+            for (int axis = 0; axis < 3; ++axis)
+                distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(plane[axis]), plane[axis] >= 0.f ? upper[axis] : lower[axis]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+        pVisible[i / 32] |= (uint32_t)_mm256_movemask_ps(inside) << (i % 32);
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= count; i += 4)
+    {
+        alignas(16) float soa[6][4];
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            soa[0][j] = pBoxes[i + j].min.x; soa[1][j] = pBoxes[i + j].min.y; soa[2][j] = pBoxes[i + j].min.z;
+            soa[3][j] = pBoxes[i + j].max.x; soa[4][j] = pBoxes[i + j].max.y; soa[5][j] = pBoxes[i + j].max.z;
+        }
+        const __m128 lower[3] = {_mm_load_ps(soa[0]), _mm_load_ps(soa[1]), _mm_load_ps(soa[2])};
+        const __m128 upper[3] = {_mm_load_ps(soa[3]), _mm_load_ps(soa[4]), _mm_load_ps(soa[5])};
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const float4 & plane : planes)
+        {
+            __m128 distance = _mm_set1_ps(plane.w);
+            for (int axis = 0; axis < 3; ++axis)
+                distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(plane[axis]), plane[axis] >= 0.f ? upper[axis] : lower[axis]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+        }
+        pVisible[i / 32] |= (uint32_t)_mm_movemask_ps(inside) << (i % 32);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        bool inside = true;
+        for (const float4 & plane : planes)
+        {
+            const float3 corner(plane.x >= 0.f ? pBoxes[i].max.x : pBoxes[i].min.x,
+                                plane.y >= 0.f ? pBoxes[i].max.y : pBoxes[i].min.y,
+                                plane.z >= 0.f ? pBoxes[i].max.z : pBoxes[i].min.z);
+            inside = inside && dot(plane.xyz(), corner) + plane.w >= 0.f;
+        }
+        if (inside)
+            pVisible[i / 32] |= 1u << (i % 32);
+    }
+}
+
+// fill the commands of one phase, from the objects uploaded by moDispatchDrawList
+static void dispatchDrawList(MoDrawList drawList, uint32_t frameIndex, const MoDrawListConstant & constant)
 {
-    vkQueueWaitIdle(g_Device->queue);
-    for (size_t i = 0; i < MO_FRAME_COUNT; ++i) { deleteBuffer(g_Device, pipeline->uniformBuffer[i]); }
-    vkDestroyDescriptorSetLayout(g_Device->device, pipeline->descriptorSetLayout[MO_PROGRAM_DESC_LAYOUT], g_Allocator);
-    vkDestroyDescriptorSetLayout(g_Device->device, pipeline->descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT], g_Allocator);
-    vkDestroyPipelineLayout(g_Device->device, pipeline->pipelineLayout, g_Allocator);
-    vkDestroyPipeline(g_Device->device, pipeline->pipeline, g_Allocator);
-    pipeline->descriptorSetLayout[MO_PROGRAM_DESC_LAYOUT] = VK_NULL_HANDLE;
-    pipeline->descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT] = VK_NULL_HANDLE;
-    pipeline->pipelineLayout = VK_NULL_HANDLE;
-    pipeline->pipeline = VK_NULL_HANDLE;
-    memset(&pipeline->uniformBuffer, 0, sizeof(pipeline->uniformBuffer));
-    memset(&pipeline->descriptorSet, 0, sizeof(pipeline->descriptorSet));
-    delete pipeline;
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[frameIndex].buffer;
+
+    // commands left untouched by the compute pass stay zeroed and draw nothing
+    vkCmdFillBuffer(commandBuffer, drawList->commandBuffer[frameIndex]->buffer, constant.base * sizeof(VkDrawIndexedIndirectCommand), constant.objectCount * sizeof(VkDrawIndexedIndirectCommand), 0);
+    vkCmdFillBuffer(commandBuffer, drawList->countBuffer[frameIndex]->buffer, constant.base * sizeof(uint32_t), drawList->frameBuckets[frameIndex].size() * sizeof(uint32_t), 0);
+    {
+        // also orders the visibility read by the early phase before the late phase writes it
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DrawListPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DrawListPipelineLayout, 0, 1, &drawList->descriptorSet[frameIndex], 0, nullptr);
+    vkCmdPushConstants(commandBuffer, g_DrawListPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MoDrawListConstant), &constant);
+    vkCmdDispatch(commandBuffer, (constant.objectCount + 63) / 64, 1, 1);
+
+    {
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
 }
 
-void moCreateMesh(const MoMeshCreateInfo *pCreateInfo, MoMesh *pMesh)
+void moDispatchDrawList(MoDrawList drawList, uint32_t frameIndex, const MoDrawListCullInfo *pCullInfo)
 {
-    MoMesh mesh = *pMesh = new MoMesh_T();
-    *mesh = {};
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[frameIndex].buffer;
+    const uint32_t objectCount = (uint32_t)drawList->objects.size();
+
+    drawList->frameBuckets[frameIndex] = drawList->buckets;
+    drawList->cullFrustum = pCullInfo ? pCullInfo->frustum : VK_FALSE;
+    drawList->cullOcclusion = pCullInfo ? pCullInfo->occlusion : VK_FALSE;
+    drawList->late[frameIndex] = VK_FALSE;
+    if (objectCount == 0)
+        return;
+
+    updateDepthPyramid();
+    if (drawList->pyramidGeneration[frameIndex] != g_DepthPyramid.generation)
+    {
+        // the frame's fence has been waited on, its descriptor set is free to change
+        VkDescriptorImageInfo imageInfo = {};
+        imageInfo.sampler = g_DepthPyramid.sampler;
+        imageInfo.imageView = g_DepthPyramid.view;
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        VkWriteDescriptorSet descriptorWrite = {};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = drawList->descriptorSet[frameIndex];
+        descriptorWrite.dstBinding = 5;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(g_Device->device, 1, &descriptorWrite, 0, nullptr);
+        drawList->pyramidGeneration[frameIndex] = g_DepthPyramid.generation;
+    }
 
-    mesh->indexBufferSize = pCreateInfo->indexCount;
-    mesh->vertexCount = pCreateInfo->vertexCount;
-    const VkDeviceSize index_size = pCreateInfo->indexCount * sizeof(uint32_t);
-    createBuffer(g_Device, &mesh->verticesBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    createBuffer(g_Device, &mesh->textureCoordsBuffer, pCreateInfo->vertexCount * sizeof(float2), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    createBuffer(g_Device, &mesh->normalsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    createBuffer(g_Device, &mesh->tangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    createBuffer(g_Device, &mesh->bitangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    createBuffer(g_Device, &mesh->indexBuffer, index_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
-    uploadBuffer(g_Device, mesh->verticesBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pVertices);
-    uploadBuffer(g_Device, mesh->textureCoordsBuffer, pCreateInfo->vertexCount * sizeof(float2), pCreateInfo->pTextureCoords);
-    uploadBuffer(g_Device, mesh->normalsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pNormals);
-    uploadBuffer(g_Device, mesh->tangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pTangents);
-    uploadBuffer(g_Device, mesh->bitangentsBuffer, pCreateInfo->vertexCount * sizeof(float3), pCreateInfo->pBitangents);
-    uploadBuffer(g_Device, mesh->indexBuffer, index_size, pCreateInfo->pIndices);
+    MoDrawListConstant constant = {};
+    constant.objectCount = objectCount;
+    constant.firstInstance = g_Device->enabledFeatures.drawIndirectFirstInstance;
+    if (pCullInfo)
+    {
+        // both phases test this frame's camera, the late one against the pyramid of this frame's depth
+        MoDrawListCull cull = {};
+        cull.viewProjection = pCullInfo->viewProjection;
+        moFrustumPlanes(pCullInfo->viewProjection, cull.planes);
+        cull.depthSize = float2((float)g_DepthPyramid.depthExtent.width, (float)g_DepthPyramid.depthExtent.height);
+        cull.pyramidLevels = g_DepthPyramid.levelCount;
+        uploadBuffer(g_Device, drawList->cullBuffer[frameIndex], sizeof(MoDrawListCull), &cull);
+        g_FrameStats.uniformBytes += sizeof(MoDrawListCull);
+
+        constant.frustum = pCullInfo->frustum;
+        constant.occlusion = pCullInfo->occlusion;
+    }
+
+    if (drawList->objectVersion[frameIndex] != drawList->version)
+    {
+        uploadBuffer(g_Device, drawList->objectBuffer[frameIndex], objectCount * sizeof(MoDrawObjectGPU), drawList->objects.data());
+        g_FrameStats.uniformBytes += objectCount * sizeof(MoDrawObjectGPU);
+        drawList->objectVersion[frameIndex] = drawList->version;
+    }
+
+    if (drawList->resetVisibility)
+    {
+        // new objects, all of them are left to the late phase; the previous frame's late phase may still use the buffer
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        vkCmdFillBuffer(commandBuffer, drawList->visibilityBuffer->buffer, 0, drawList->maxObjects * sizeof(uint32_t), 0);
+        drawList->resetVisibility = VK_FALSE;
+    }
+
+    dispatchDrawList(drawList, frameIndex, constant);
 }
 
-void moDestroyMesh(MoMesh mesh)
+void moDispatchDrawListLate(MoDrawList drawList, uint32_t frameIndex)
 {
-    vkQueueWaitIdle(g_Device->queue);
-    deleteBuffer(g_Device, mesh->verticesBuffer);
-    deleteBuffer(g_Device, mesh->textureCoordsBuffer);
-    deleteBuffer(g_Device, mesh->normalsBuffer);
-    deleteBuffer(g_Device, mesh->tangentsBuffer);
-    deleteBuffer(g_Device, mesh->bitangentsBuffer);
-    deleteBuffer(g_Device, mesh->indexBuffer);
-    delete mesh;
+    const uint32_t objectCount = (uint32_t)drawList->objects.size();
+    if (objectCount == 0 || !drawList->cullOcclusion)
+        return;
+
+    MoDrawListConstant constant = {};
+    constant.objectCount = objectCount;
+    constant.firstInstance = g_Device->enabledFeatures.drawIndirectFirstInstance;
+    constant.frustum = drawList->cullFrustum;
+    // without a pyramid of this frame's depth, everything in the frustum the early phase skipped is drawn late
+    constant.occlusion = g_DepthPyramid.valid;
+    constant.phase = MO_DRAW_LIST_PHASE_LATE;
+    constant.base = drawList->maxObjects;
+    dispatchDrawList(drawList, frameIndex, constant);
+    drawList->late[frameIndex] = VK_TRUE;
 }
 
-void moCreateMaterial(const MoMaterialCreateInfo *pCreateInfo, MoMaterial *pMaterial)
+void moDrawIndirect(MoDrawList drawList, MoDrawListPhase phase)
 {
-    MoMaterial material = *pMaterial = new MoMaterial_T();
-    *material = {};
+    assert(g_Pipeline->instancedPipeline != VK_NULL_HANDLE);
 
-    VkResult err = vkDeviceWaitIdle(g_Device->device);
-    g_Device->pCheckVkResultFn(err);
+    // nothing was left to the late phase this frame
+    if (phase == MO_DRAW_LIST_PHASE_LATE && !drawList->late[g_FrameIndex])
+        return;
+    restoreView();
 
+    const uint32_t base = phase == MO_DRAW_LIST_PHASE_LATE ? drawList->maxObjects : 0;
     auto & frame = g_SwapChain->frames[g_FrameIndex];
-    generateTexture(&material->ambientImage,  pCreateInfo->textureAmbient,  pCreateInfo->colorAmbient,  frame.pool, frame.buffer);
-    generateTexture(&material->diffuseImage,  pCreateInfo->textureDiffuse,  pCreateInfo->colorDiffuse,  frame.pool, frame.buffer);
-    generateTexture(&material->normalImage,   pCreateInfo->textureNormal,   {0.f, 0.f, 0.f, 0.f},       frame.pool, frame.buffer);
-    generateTexture(&material->emissiveImage, pCreateInfo->textureEmissive, pCreateInfo->colorEmissive, frame.pool, frame.buffer);
-    generateTexture(&material->specularImage, pCreateInfo->textureSpecular, pCreateInfo->colorSpecular, frame.pool, frame.buffer);
+    MoMeshPool pool = drawList->pool;
+    MoDeviceBuffer commandBuffer = drawList->commandBuffer[g_FrameIndex];
+    MoDeviceBuffer instanceBuffer = drawList->instanceBuffer[g_FrameIndex];
+
+    VkBuffer vertexBuffers[] = {pool->verticesBuffer->buffer,
+                                pool->textureCoordsBuffer->buffer,
+                                pool->normalsBuffer->buffer,
+                                pool->tangentsBuffer->buffer,
+                                pool->bitangentsBuffer->buffer,
+                                instanceBuffer->buffer};
+    VkDeviceSize offsets[] = {0,
+                              0,
+                              0,
+                              0,
+                              0,
+                              0};
+    vkCmdBindVertexBuffers(frame.buffer, 0, 6, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(frame.buffer, pool->indexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+    ++g_FrameStats.vertexBufferBinds;
+    ++g_FrameStats.indexBufferBinds;
+
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    const auto & buckets = drawList->frameBuckets[g_FrameIndex];
+    for (uint32_t i = 0; i < buckets.size(); ++i)
+    {
+        const MoDrawListBucket & bucket = buckets[i];
+        const VkDeviceSize offset = (base + bucket.firstCommand) * stride;
+        VkPipeline variant = passPipeline(g_Pipeline, g_DrawPass, bucket.material->materialClass, true);
+        if (variant == VK_NULL_HANDLE)
+            continue;
+        bindPipeline(frame.buffer, &g_FrameStats, &g_BoundPipeline, variant);
+        vkCmdBindDescriptorSets(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipelineLayout, 1, 1, &bucket.material->descriptorSet, 0, nullptr);
+        ++g_FrameStats.descriptorSetBinds;
+        if (g_CmdDrawIndexedIndirectCount && g_Device->enabledFeatures.drawIndirectFirstInstance)
+        {
+            g_CmdDrawIndexedIndirectCount(frame.buffer, commandBuffer->buffer, offset, drawList->countBuffer[g_FrameIndex]->buffer, (base + i) * sizeof(uint32_t), bucket.commandCount, stride);
+            ++g_FrameStats.drawCalls;
+        }
+        else if (g_Device->enabledFeatures.multiDrawIndirect && g_Device->enabledFeatures.drawIndirectFirstInstance)
+        {
+            vkCmdDrawIndexedIndirect(frame.buffer, commandBuffer->buffer, offset, bucket.commandCount, stride);
+            ++g_FrameStats.drawCalls;
+        }
+        else
+        {
+            for (uint32_t command = 0; command < bucket.commandCount; ++command)
+            {
+                if (!g_Device->enabledFeatures.drawIndirectFirstInstance)
+                {
+                    // firstInstance must be 0, offset the instance stream instead
+                    VkDeviceSize instanceOffset = (base + bucket.firstCommand + command) * sizeof(float4x4);
+                    vkCmdBindVertexBuffers(frame.buffer, 5, 1, &instanceBuffer->buffer, &instanceOffset);
+                    ++g_FrameStats.vertexBufferBinds;
+                }
+                vkCmdDrawIndexedIndirect(frame.buffer, commandBuffer->buffer, offset + command * stride, 1, stride);
+                ++g_FrameStats.drawCalls;
+            }
+        }
+    }
+}
 
+#if defined(MO_AVX2_TARGET)
+// returns the pixels converted, the rest are left to the SSE2 and scalar loops
+MO_AVX2_TARGET static uint32_t convertRowAvx2(const std::uint8_t *pSource, std::uint8_t *pDestination, uint32_t width, bool swizzle, bool forceAlpha, bool packRGB)
+{
+    uint32_t i = 0;
+    // byte shuffles stay within each 128 bit lane, which holds 4 whole pixels
+    const __m256i order = swizzle ? _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15)
+                                  : _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256i packed = swizzle ? _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+                                   : _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i alpha = _mm256_set1_epi32(forceAlpha ? (int)0xFF000000 : 0);
+    if (packRGB)
     {
-        VkSamplerCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-        info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-        info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        info.minLod = -1000;
-        info.maxLod = 1000;
-        info.maxAnisotropy = 1.0f;
-        info.minFilter = info.magFilter = pCreateInfo->textureAmbient.filter;
-        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->ambientSampler);
-        g_Device->pCheckVkResultFn(err);
-        info.minFilter = info.magFilter = pCreateInfo->textureDiffuse.filter;
-        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->diffuseSampler);
-        g_Device->pCheckVkResultFn(err);
-        info.minFilter = info.magFilter = pCreateInfo->textureNormal.filter;
-        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->normalSampler);
-        g_Device->pCheckVkResultFn(err);
-        info.minFilter = info.magFilter = pCreateInfo->textureSpecular.filter;
-        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->specularSampler);
-        g_Device->pCheckVkResultFn(err);
-        info.minFilter = info.magFilter = pCreateInfo->textureEmissive.filter;
-        err = vkCreateSampler(g_Device->device, &info, g_Allocator, &material->emissiveSampler);
-        g_Device->pCheckVkResultFn(err);
+        // each lane is stored 16 bytes wide for its 12, the next store or the scalar tail overwrites the rest
+        for (; i + 10 <= width; i += 8)
+        {
+            const __m256i pixels = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(pSource + i * 4)), packed);
+            _mm_storeu_si128((__m128i*)(pDestination + i * 3), _mm256_castsi256_si128(pixels));
+            _mm_storeu_si128((__m128i*)(pDestination + i * 3 + 12), _mm256_extracti128_si256(pixels, 1));
+        }
+    }
+    else
+    {
+        for (; i + 8 <= width; i += 8)
+        {
+            const __m256i pixels = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(pSource + i * 4)), order);
+            _mm256_storeu_si256((__m256i*)(pDestination + i * 4), _mm256_or_si256(pixels, alpha));
+        }
     }
+    return i;
+}
+#endif
 
+static void convertRow(const std::uint8_t *pSource, std::uint8_t *pDestination, uint32_t width, bool swizzle, bool forceAlpha, bool packRGB)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    i = convertRowAvx2(pSource, pDestination, width, swizzle, forceAlpha, packRGB);
+#elif defined(MO_AVX2_TARGET)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        i = convertRowAvx2(pSource, pDestination, width, swizzle, forceAlpha, packRGB);
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    if (!packRGB)
     {
-        VkDescriptorSetAllocateInfo alloc_info = {};
-        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-        alloc_info.descriptorPool = g_Device->descriptorPool;
-        alloc_info.descriptorSetCount = 1;
-        alloc_info.pSetLayouts = &g_Pipeline->descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT];
-        err = vkAllocateDescriptorSets(g_Device->device, &alloc_info, &material->descriptorSet);
-        g_Device->pCheckVkResultFn(err);
+        // no byte shuffle before SSSE3, the first and third channels are swapped with shifts
+        const __m128i middle = _mm_set1_epi32((int)0xFF00FF00);
+        const __m128i low = _mm_set1_epi32(0x000000FF);
+        const __m128i alpha = _mm_set1_epi32(forceAlpha ? (int)0xFF000000 : 0);
+        for (; i + 4 <= width; i += 4)
+        {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(pSource + i * 4));
+            if (swizzle)
+                pixels = _mm_or_si128(_mm_and_si128(pixels, middle),
+                                      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(pixels, 16), low), _mm_slli_epi32(_mm_and_si128(pixels, low), 16)));
+            _mm_storeu_si128((__m128i*)(pDestination + i * 4), _mm_or_si128(pixels, alpha));
+        }
+    }
+#endif
+    const uint32_t red = swizzle ? 2 : 0;
+    const uint32_t blue = swizzle ? 0 : 2;
+    for (; i < width; ++i)
+    {
+        const std::uint8_t *pixel = pSource + i * 4;
+        if (packRGB)
+        {
+            pDestination[i * 3 + 0] = pixel[red];
+            pDestination[i * 3 + 1] = pixel[1];
+            pDestination[i * 3 + 2] = pixel[blue];
+        }
+        else
+        {
+            pDestination[i * 4 + 0] = pixel[red];
+            pDestination[i * 4 + 1] = pixel[1];
+            pDestination[i * 4 + 2] = pixel[blue];
+            pDestination[i * 4 + 3] = forceAlpha ? 255 : pixel[3];
+        }
     }
+}
 
+// threads moConvertPixels splits rows across, started on first use and kept for the next conversions
+static struct MoConvertPool
+{
+    // held by the conversion using the pool
+    std::mutex                    use;
+    std::mutex                    mutex;
+    std::condition_variable       wake;
+    std::condition_variable       done;
+    std::vector<std::thread>      threads;
+    // converts the rows of one chunk of the current conversion
+    std::function<void(uint32_t)> chunk;
+    uint32_t                      chunkCount = 0;
+    uint32_t                      nextChunk = 0;
+    // chunks being converted
+    uint32_t                      busy = 0;
+    bool                          stop = false;
+
+    ~MoConvertPool()
     {
-        VkDescriptorImageInfo desc_image[5] = {};
-        desc_image[0].sampler = material->ambientSampler;
-        desc_image[0].imageView = material->ambientImage->view;
-        desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        desc_image[1].sampler = material->diffuseSampler;
-        desc_image[1].imageView = material->diffuseImage->view;
-        desc_image[1].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        desc_image[2].sampler = material->normalSampler;
-        desc_image[2].imageView = material->normalImage->view;
-        desc_image[2].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        desc_image[3].sampler = material->specularSampler;
-        desc_image[3].imageView = material->specularImage->view;
-        desc_image[3].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        desc_image[4].sampler = material->emissiveSampler;
-        desc_image[4].imageView = material->emissiveImage->view;
-        desc_image[4].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        VkWriteDescriptorSet write_desc[5] = {};
-        for (uint32_t i = 0; i < 5; ++i)
         {
-            write_desc[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            write_desc[i].dstSet = material->descriptorSet;
-            write_desc[i].dstBinding = i;
-            write_desc[i].descriptorCount = 1;
-            write_desc[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            write_desc[i].pImageInfo = &desc_image[i];
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
         }
-        vkUpdateDescriptorSets(g_Device->device, 5, write_desc, 0, nullptr);
+        wake.notify_all();
+        for (std::thread & thread : threads)
+            thread.join();
+    }
+} g_ConvertPool;
+
+// convert chunks of the current conversion until none are left to take, lock is held on entry and exit
+static void takeChunks(std::unique_lock<std::mutex> & lock)
+{
+    while (g_ConvertPool.nextChunk < g_ConvertPool.chunkCount)
+    {
+        const uint32_t chunk = g_ConvertPool.nextChunk++;
+        ++g_ConvertPool.busy;
+        lock.unlock();
+        g_ConvertPool.chunk(chunk);
+        lock.lock();
+        --g_ConvertPool.busy;
     }
+    if (g_ConvertPool.busy == 0)
+        g_ConvertPool.done.notify_all();
 }
 
-void moDestroyMaterial(MoMaterial material)
+static void convertWorker()
 {
-    vkQueueWaitIdle(g_Device->queue);
-    deleteBuffer(g_Device, material->ambientImage);
-    deleteBuffer(g_Device, material->diffuseImage);
-    deleteBuffer(g_Device, material->normalImage);
-    deleteBuffer(g_Device, material->specularImage);
-    deleteBuffer(g_Device, material->emissiveImage);
+    std::unique_lock<std::mutex> lock(g_ConvertPool.mutex);
+    for (;;)
+    {
+        g_ConvertPool.wake.wait(lock, []() { return g_ConvertPool.stop || g_ConvertPool.nextChunk < g_ConvertPool.chunkCount; });
+        if (g_ConvertPool.stop)
+            return;
+        takeChunks(lock);
+    }
+}
+
+void moConvertPixels(const MoPixelConversionInfo *pInfo)
+{
+    const uint32_t width = pInfo->extent.width;
+    const uint32_t height = pInfo->extent.height;
+    const uint32_t sourceRowPitch = pInfo->sourceRowPitch != 0 ? pInfo->sourceRowPitch : width * 4;
+    const uint32_t destinationRowPitch = pInfo->destinationRowPitch != 0 ? pInfo->destinationRowPitch : width * (pInfo->packRGB ? 3 : 4);
+
+    auto convertRows = [&](uint32_t first, uint32_t last)
+    {
+        for (uint32_t row = first; row < last; ++row)
+            convertRow(pInfo->pSource + (size_t)row * sourceRowPitch, pInfo->pDestination + (size_t)row * destinationRowPitch,
+                       width, pInfo->swizzle == VK_TRUE, pInfo->forceAlpha == VK_TRUE, pInfo->packRGB == VK_TRUE);
+    };
 
-    vkDestroySampler(g_Device->device, material->ambientSampler, g_Allocator);
-    vkDestroySampler(g_Device->device, material->diffuseSampler, g_Allocator);
-    vkDestroySampler(g_Device->device, material->normalSampler, g_Allocator);
-    vkDestroySampler(g_Device->device, material->specularSampler, g_Allocator);
-    vkDestroySampler(g_Device->device, material->emissiveSampler, g_Allocator);
-    delete material;
+    // about a quarter million pixels per thread, so that small frames are not slowed down by waking threads
+    uint32_t threadCount = pInfo->threadCount;
+    if (threadCount == 0)
+        threadCount = std::min<uint32_t>(std::max(1u, std::thread::hardware_concurrency()), (uint32_t)((uint64_t)width * height / (1 << 18)));
+    threadCount = std::max(1u, std::min(threadCount, height));
+    // while another conversion has the pool, this one runs on its caller's thread
+    std::unique_lock<std::mutex> use(g_ConvertPool.use, std::defer_lock);
+    if (threadCount == 1 || !use.try_lock())
+    {
+        convertRows(0, height);
+        return;
+    }
+
+    const uint32_t rowsPerThread = (height + threadCount - 1) / threadCount;
+    std::unique_lock<std::mutex> lock(g_ConvertPool.mutex);
+    while (g_ConvertPool.threads.size() < threadCount - 1)
+        g_ConvertPool.threads.emplace_back(convertWorker);
+    g_ConvertPool.chunk = [&](uint32_t chunk) { convertRows(chunk * rowsPerThread, std::min(height, (chunk + 1) * rowsPerThread)); };
+    g_ConvertPool.chunkCount = (height + rowsPerThread - 1) / rowsPerThread;
+    g_ConvertPool.nextChunk = 0;
+    g_ConvertPool.wake.notify_all();
+    takeChunks(lock);
+    g_ConvertPool.done.wait(lock, []() { return g_ConvertPool.busy == 0; });
+    g_ConvertPool.chunk = nullptr;
+    g_ConvertPool.chunkCount = 0;
+    g_ConvertPool.nextChunk = 0;
 }
 
-void moBegin(uint32_t frameIndex)
+// a buffer whose memory is existing host memory, false when the device cannot import it
+static bool importBuffer(MoDevice device, MoDeviceBuffer *pDeviceBuffer, void *pHostMemory, VkDeviceSize size, VkBufferUsageFlags usage)
 {
-    g_FrameIndex = frameIndex;
-    auto & frame = g_SwapChain->frames[g_FrameIndex];
-    vkCmdBindPipeline(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipeline);
-    vkCmdBindDescriptorSets(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipelineLayout, 0, 1, &g_Pipeline->descriptorSet[g_FrameIndex], 0, nullptr);
+    VkMemoryHostPointerPropertiesEXT properties = {};
+    properties.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    if (device->pGetMemoryHostPointerProperties == nullptr ||
+        device->pGetMemoryHostPointerProperties(device->device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, pHostMemory, &properties) != VK_SUCCESS)
+        return false;
+
+    MoDeviceBuffer deviceBuffer = new MoDeviceBuffer_T();
+    *deviceBuffer = {};
+    VkResult err;
+    {
+        VkExternalMemoryBufferCreateInfo external_info = {};
+        external_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+        external_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        VkBufferCreateInfo buffer_info = {};
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.pNext = &external_info;
+        buffer_info.size = size;
+        buffer_info.usage = usage;
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        err = vkCreateBuffer(device->device, &buffer_info, g_Allocator, &deviceBuffer->buffer);
+        device->pCheckVkResultFn(err);
+    }
+    VkMemoryRequirements req;
+    vkGetBufferMemoryRequirements(device->device, deviceBuffer->buffer, &req);
+    // coherent, imported memory is never mapped so it cannot be invalidated
+    const uint32_t type = memoryType(device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, req.memoryTypeBits & properties.memoryTypeBits);
+    if (type == 0xFFFFFFFF || req.size > size)
+    {
+        vkDestroyBuffer(device->device, deviceBuffer->buffer, g_Allocator);
+        delete deviceBuffer;
+        return false;
+    }
+    {
+        VkImportMemoryHostPointerInfoEXT import_info = {};
+        import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+        import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        import_info.pHostPointer = pHostMemory;
+        VkMemoryAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.pNext = &import_info;
+        alloc_info.allocationSize = size;
+        alloc_info.memoryTypeIndex = type;
+        // the pointer may still be refused, such as when it is not aligned to minImportedHostPointerAlignment
+        err = vkAllocateMemory(device->device, &alloc_info, g_Allocator, &deviceBuffer->memory);
+    }
+    if (err == VK_SUCCESS)
+    {
+        err = vkBindBufferMemory(device->device, deviceBuffer->buffer, deviceBuffer->memory, 0);
+        if (err != VK_SUCCESS)
+            vkFreeMemory(device->device, deviceBuffer->memory, g_Allocator);
+    }
+    if (err != VK_SUCCESS)
+    {
+        vkDestroyBuffer(device->device, deviceBuffer->buffer, g_Allocator);
+        delete deviceBuffer;
+        return false;
+    }
+    deviceBuffer->size = size;
+    *pDeviceBuffer = deviceBuffer;
+    return true;
 }
 
-void moPipelineOverride(MoPipeline pipeline)
+// the copies are read as 4 bytes per pixel, one per channel
+static bool readbackFormat(VkFormat format)
 {
-    if (pipeline == VK_NULL_HANDLE)
+    switch (format)
     {
-        if (g_StashedPipeline != VK_NULL_HANDLE)
-            g_Pipeline = g_StashedPipeline;
-        g_StashedPipeline = VK_NULL_HANDLE;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+    case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+    case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+        return true;
+    default:
+        return false;
     }
-    else
+}
+
+VkResult moCreateReadback(const MoReadbackCreateInfo *pCreateInfo, MoReadback *pReadback)
+{
+    *pReadback = VK_NULL_HANDLE;
+    if (!readbackFormat(pCreateInfo->format))
+        return VK_ERROR_FORMAT_NOT_SUPPORTED;
+
+    MoReadback readback = *pReadback = new MoReadback_T();
+    readback->extent = pCreateInfo->extent;
+    readback->rowPitch = pCreateInfo->extent.width * 4;
+    readback->slots.resize(pCreateInfo->slotCount == 0 ? g_SwapChain->frameCount + 1 : pCreateInfo->slotCount);
+    readback->next = 0;
+    readback->pCallback = pCreateInfo->pCallback;
+    readback->pUserData = pCreateInfo->pUserData;
+    for (size_t i = 0; i < readback->slots.size(); ++i)
     {
-        if (g_StashedPipeline == VK_NULL_HANDLE)
-            g_StashedPipeline = g_Pipeline;
-        g_Pipeline = pipeline;
+        MoReadbackSlot & slot = readback->slots[i];
+        slot = {};
+        if (pCreateInfo->pHostMemory != nullptr && g_Device->externalMemoryHost)
+        {
+            std::uint8_t *pHostMemory = (std::uint8_t*)pCreateInfo->pHostMemory + i * pCreateInfo->hostMemoryStride;
+            slot.imported = importBuffer(g_Device, &slot.buffer, pHostMemory, pCreateInfo->hostMemoryStride, VK_BUFFER_USAGE_TRANSFER_DST_BIT) ? VK_TRUE : VK_FALSE;
+            slot.pPixels = pHostMemory;
+        }
+        if (!slot.imported)
+        {
+            createBuffer(g_Device, &slot.buffer, (VkDeviceSize)readback->rowPitch * readback->extent.height, VK_BUFFER_USAGE_TRANSFER_DST_BIT, MO_MEMORY_CATEGORY_STAGING, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+            VkResult err = vkMapMemory(g_Device->device, slot.buffer->memory, 0, VK_WHOLE_SIZE, 0, (void**)&slot.pPixels);
+            g_Device->pCheckVkResultFn(err);
+        }
     }
+    return VK_SUCCESS;
 }
 
-void moSetPMV(const MoPushConstant* pProjectionModelView)
+void moDestroyReadback(MoReadback readback)
 {
-    vkCmdPushConstants(g_SwapChain->frames[g_FrameIndex].buffer, g_Pipeline->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MoPushConstant), pProjectionModelView);
+    deferDeletion([readback]()
+    {
+        for (MoReadbackSlot & slot : readback->slots)
+        {
+            if (!slot.imported)
+                vkUnmapMemory(g_Device->device, slot.buffer->memory);
+            deleteBuffer(g_Device, slot.buffer);
+        }
+        delete readback;
+    });
 }
 
-void moSetLight(const MoUniform* pLightAndCamera)
+VkResult moRecordReadback(MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout, uint32_t *pSlot)
 {
-    uploadBuffer(g_Device, g_Pipeline->uniformBuffer[g_FrameIndex], sizeof(MoUniform), pLightAndCamera);
+    // the copy would read past the source
+    if (sourceExtent.width < readback->extent.width || sourceExtent.height < readback->extent.height)
+        return VK_ERROR_VALIDATION_FAILED_EXT;
+
+    MoReadbackSlot & slot = readback->slots[readback->next];
+    if (slot.pending)
+        return VK_NOT_READY;
+
+    VkCommandBuffer commandBuffer = g_SwapChain->frames[frameIndex].buffer;
+    g_FrameStats.stagingBytes += (uint64_t)readback->rowPitch * readback->extent.height;
+    {
+        // also orders the copy after the render pass when the image is already in the transfer layout
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.oldLayout = layout;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = source;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+    {
+        VkBufferImageCopy region = {};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { readback->extent.width, readback->extent.height, 1 };
+        vkCmdCopyImageToBuffer(commandBuffer, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer->buffer, 1, &region);
+    }
+    {
+        VkBufferMemoryBarrier bufferBarrier = {};
+        bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.buffer = slot.buffer->buffer;
+        bufferBarrier.size = VK_WHOLE_SIZE;
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = layout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = source;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &bufferBarrier,
+                             layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL ? 1 : 0, &barrier);
+    }
+
+    // the copy completes with the frame being recorded
+    slot.fence = g_SwapChain->frames[frameIndex].fence;
+    slot.serial = g_SubmitSerial + 1;
+    slot.pending = VK_TRUE;
+    slot.taken = VK_FALSE;
+    if (pSlot)
+        *pSlot = readback->next;
+    readback->next = (readback->next + 1) % (uint32_t)readback->slots.size();
+    return VK_SUCCESS;
 }
 
-void moDrawMesh(MoMesh mesh)
+VkResult moPollReadback(MoReadback readback, uint32_t slotIndex, const std::uint8_t **ppPixels, uint32_t *pRowPitch)
 {
-    auto & frame = g_SwapChain->frames[g_FrameIndex];
+    MoReadbackSlot & slot = readback->slots[slotIndex];
+    if (!slot.pending)
+        return VK_INCOMPLETE;
+    // the fence may since have been reset for a later frame, in which case the serial has retired
+    if (slot.serial > g_RetiredSerial && (slot.serial > g_SubmitSerial || vkGetFenceStatus(g_Device->device, slot.fence) != VK_SUCCESS))
+        return VK_NOT_READY;
+
+    // cached memory is read much faster by the CPU than write combined memory, but may not be coherent
+    if (!slot.imported && (slot.buffer->memoryProperties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
+    {
+        VkMappedMemoryRange range = {};
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = slot.buffer->memory;
+        range.size = VK_WHOLE_SIZE;
+        VkResult err = vkInvalidateMappedMemoryRanges(g_Device->device, 1, &range);
+        g_Device->pCheckVkResultFn(err);
+    }
+    *ppPixels = slot.pPixels;
+    if (pRowPitch)
+        *pRowPitch = readback->rowPitch;
+    return VK_SUCCESS;
+}
 
-    VkBuffer vertexBuffers[] = {mesh->verticesBuffer->buffer,
-                                mesh->textureCoordsBuffer->buffer,
-                                mesh->normalsBuffer->buffer,
-                                mesh->tangentsBuffer->buffer,
-                                mesh->bitangentsBuffer->buffer};
-    VkDeviceSize offsets[] = {0,
-                              0,
-                              0,
-                              0,
-                              0};
-    vkCmdBindVertexBuffers(frame.buffer, 0, 5, vertexBuffers, offsets);
-    vkCmdBindIndexBuffer(frame.buffer, mesh->indexBuffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+VkResult moWaitReadback(MoReadback readback, uint32_t slotIndex, const std::uint8_t **ppPixels, uint32_t *pRowPitch)
+{
+    MoReadbackSlot & slot = readback->slots[slotIndex];
+    if (!slot.pending)
+        return VK_INCOMPLETE;
+    if (slot.serial > g_SubmitSerial)
+        return VK_NOT_READY;
+    // a fence is only reset after it was waited on, when the frame it was signalled for has retired
+    if (slot.serial > g_RetiredSerial)
+    {
+        VkResult err = vkWaitForFences(g_Device->device, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+        g_Device->pCheckVkResultFn(err);
+    }
+    return moPollReadback(readback, slotIndex, ppPixels, pRowPitch);
+}
 
-    vkCmdDrawIndexed(frame.buffer, mesh->indexBufferSize, 1, 0, 0, 0);
+void moReleaseReadback(MoReadback readback, uint32_t slotIndex)
+{
+    readback->slots[slotIndex].pending = VK_FALSE;
+    readback->slots[slotIndex].taken = VK_FALSE;
 }
 
-void moBindMaterial(MoMaterial material)
+VkResult moTakeReadback(MoReadback readback, uint32_t *pSlot, const std::uint8_t **ppPixels, uint32_t *pRowPitch)
 {
-    auto & frame = g_SwapChain->frames[g_FrameIndex];
-    vkCmdBindDescriptorSets(frame.buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_Pipeline->pipelineLayout, 1, 1, &material->descriptorSet, 0, nullptr);
+    const uint32_t count = (uint32_t)readback->slots.size();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint32_t slotIndex = (readback->next + i) % count;
+        if (readback->slots[slotIndex].taken || moPollReadback(readback, slotIndex, ppPixels, pRowPitch) != VK_SUCCESS)
+            continue;
+        readback->slots[slotIndex].taken = VK_TRUE;
+        *pSlot = slotIndex;
+        return VK_SUCCESS;
+    }
+    return VK_NOT_READY;
+}
+
+uint32_t moProcessReadbacks(MoReadback readback)
+{
+    uint32_t processed = 0;
+    const uint32_t count = (uint32_t)readback->slots.size();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        // oldest first, copies complete in the order they were recorded
+        const uint32_t slotIndex = (readback->next + i) % count;
+        const std::uint8_t *pPixels = nullptr;
+        if (readback->slots[slotIndex].taken || moPollReadback(readback, slotIndex, &pPixels, nullptr) != VK_SUCCESS)
+            continue;
+        if (readback->pCallback)
+            readback->pCallback(pPixels, readback->extent, readback->rowPitch, readback->pUserData);
+        moReleaseReadback(readback, slotIndex);
+        ++processed;
+    }
+    return processed;
 }
 
 void moFramebufferReadback(VkImage source, VkExtent2D extent, std::uint8_t* pDestination, uint32_t destinationSize, VkCommandPool commandPool)
 {
+    // nothing to copy, and images cannot be empty
+    if (extent.width == 0 || extent.height == 0)
+        return;
+
     // Create the linear tiled destination image to copy to and to read the memory from
     VkImageCreateInfo imgCreateInfo = {};
     imgCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -1440,11 +4648,13 @@ void moFramebufferReadback(VkImage source, VkExtent2D extent, std::uint8_t* pDes
     vkGetImageMemoryRequirements(g_Device->device, dstImage, &memRequirements);
     memAllocInfo.allocationSize = memRequirements.size;
     // Memory must be host visible to copy from
-    memAllocInfo.memoryTypeIndex = memoryType(g_Device->physicalDevice, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, memRequirements.memoryTypeBits);
+    memAllocInfo.memoryTypeIndex = memoryType(g_Device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, memRequirements.memoryTypeBits);
     err = vkAllocateMemory(g_Device->device, &memAllocInfo, nullptr, &dstImageMemory);
     g_Device->pCheckVkResultFn(err);
     err = vkBindImageMemory(g_Device->device, dstImage, dstImageMemory, 0);
     g_Device->pCheckVkResultFn(err);
+    const uint32_t dstHeapIndex = trackMemory(g_Device, memAllocInfo.memoryTypeIndex, memRequirements.size, MO_MEMORY_CATEGORY_STAGING);
+    g_FrameStats.stagingBytes += memRequirements.size;
     // Do the actual blit from the offscreen image to our host visible destination image
     VkCommandBufferAllocateInfo cmdBufAllocateInfo = {};
     cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1561,21 +4771,23 @@ void moFramebufferReadback(VkImage source, VkExtent2D extent, std::uint8_t* pDes
     vkGetImageSubresourceLayout(g_Device->device, dstImage, &subResource, &subResourceLayout);
 
     // Map image memory so we can start copying from it
-    const char* imageData = {};
+    const std::uint8_t* imageData = {};
     vkMapMemory(g_Device->device, dstImageMemory, 0, VK_WHOLE_SIZE, 0, (void**)&imageData);
     imageData += subResourceLayout.offset;
 
-    for (std::uint32_t pixel = 0; pixel < destinationSize && pixel < subResourceLayout.size; pixel += 4)
-    {
-        pDestination[pixel + 0] = imageData[pixel + 0];
-        pDestination[pixel + 1] = imageData[pixel + 1];
-        pDestination[pixel + 2] = imageData[pixel + 2];
-        pDestination[pixel + 3] = 255; //imageData[pixel + 3];
-    }
+    MoPixelConversionInfo conversion = {};
+    conversion.pSource = imageData;
+    conversion.sourceRowPitch = (uint32_t)subResourceLayout.rowPitch;
+    conversion.pDestination = pDestination;
+    conversion.extent = {extent.width, std::min<uint32_t>(extent.height, (uint32_t)(destinationSize / ((uint64_t)extent.width * 4)))};
+    conversion.forceAlpha = VK_TRUE;
+    moConvertPixels(&conversion);
 
     // Clean up resources
+    vkFreeCommandBuffers(g_Device->device, commandPool, 1, &copyCmd);
     vkUnmapMemory(g_Device->device, dstImageMemory);
     vkFreeMemory(g_Device->device, dstImageMemory, nullptr);
+    releaseMemory(dstHeapIndex, memRequirements.size, MO_MEMORY_CATEGORY_STAGING);
     vkDestroyImage(g_Device->device, dstImage, nullptr);
 }
 
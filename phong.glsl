@@ -1,35 +1,70 @@
 #version 450 core
 
-#ifdef COMPILING_VERTEX
+#if defined(COMPILING_VERTEX) && defined(COMPILING_DEPTH)
+// depth pre-pass, position stream only; gl_Position must match the shaded pass bit for bit
+layout(location = 0) in vec3 vertexPosition;
+#ifdef COMPILING_INSTANCED
+layout(location = 5) in mat4 instanceModel;
+#endif
+layout(push_constant) uniform uPushConstant
+{
+    mat4 uniformModel;
+    mat4 uniformView;
+    mat4 uniformProjection;
+} pc;
+invariant gl_Position;
+
+void main()
+{
+#ifdef COMPILING_INSTANCED
+    mat4 model = instanceModel;
+#else
+    mat4 model = pc.uniformModel;
+#endif
+    gl_Position = pc.uniformProjection * pc.uniformView * model * vec4(vertexPosition, 1.0);
+}
+#elif defined(COMPILING_VERTEX)
 layout(location=0) out VertexData
 {
     vec3 vertex;
     vec3 normal;
     vec2 texcoord;
     mat3 TBN;
+    flat vec4 eye;
 } outData;
 layout(location = 0) in vec3 vertexPosition;
 layout(location = 1) in vec2 vertexTexcoord;
 layout(location = 2) in vec3 vertexNormal;
 layout(location = 3) in vec3 vertexTangent;
 layout(location = 4) in vec3 vertexBitangent;
+#ifdef COMPILING_INSTANCED
+layout(location = 5) in mat4 instanceModel;
+#endif
 layout(push_constant) uniform uPushConstant
 {
     mat4 uniformModel;
     mat4 uniformView;
     mat4 uniformProjection;
+    vec4 uniformEye;
 } pc;
+invariant gl_Position;
 
 void main()
 {
-    outData.vertex = vec3(pc.uniformModel * vec4(vertexPosition, 1.0));
-    outData.normal = normalize(mat3(transpose(inverse(pc.uniformModel))) * vertexNormal);
+#ifdef COMPILING_INSTANCED
+    mat4 model = instanceModel;
+#else
+    mat4 model = pc.uniformModel;
+#endif
+    outData.eye = pc.uniformEye;
+    outData.vertex = vec3(model * vec4(vertexPosition, 1.0));
+    outData.normal = normalize(mat3(transpose(inverse(model))) * vertexNormal);
     outData.texcoord = vertexTexcoord;
-    vec3 T = normalize(vec3(mat3(pc.uniformModel) * vertexTangent));
-    vec3 B = normalize(vec3(mat3(pc.uniformModel) * vertexBitangent));
-    vec3 N = normalize(vec3(mat3(pc.uniformModel) * vertexNormal));
+    vec3 T = normalize(vec3(mat3(model) * vertexTangent));
+    vec3 B = normalize(vec3(mat3(model) * vertexBitangent));
+    vec3 N = normalize(vec3(mat3(model) * vertexNormal));
     outData.TBN = mat3(T, B, N);
-    gl_Position = pc.uniformProjection * pc.uniformView * pc.uniformModel * vec4(vertexPosition, 1.0);
+    gl_Position = pc.uniformProjection * pc.uniformView * model * vec4(vertexPosition, 1.0);
 }
 #endif
 
@@ -41,6 +76,7 @@ layout(location = 0) in VertexData
     vec3 normal;
     vec2 texcoord;
     mat3 TBN;
+    flat vec4 eye;
 } inData;
 layout(std140, binding = 0) uniform Block
 {
@@ -52,12 +88,16 @@ layout(set = 1, binding = 1) uniform sampler2D uniformTextureDiffuse;
 layout(set = 1, binding = 2) uniform sampler2D uniformTextureNormal;
 layout(set = 1, binding = 3) uniform sampler2D uniformTextureSpecular;
 layout(set = 1, binding = 4) uniform sampler2D uniformTextureEmissive;
+// set for alpha-tested materials
+layout(constant_id = 0) const bool alphaTest = false;
 
 void main()
 {
     vec2 texcoord = vec2(inData.texcoord.s, inData.texcoord.t);
-    vec4 textureAmbient = texture(uniformTextureAmbient, texcoord);
     vec4 textureDiffuse = texture(uniformTextureDiffuse, texcoord);
+    if (alphaTest && textureDiffuse.a < 0.5)
+        discard;
+    vec4 textureAmbient = texture(uniformTextureAmbient, texcoord);
     fragment = vec4(textureAmbient.rgb * textureDiffuse.rgb, textureDiffuse.a);
 
     vec4 textureNormal = texture(uniformTextureNormal, texcoord);
@@ -67,7 +107,9 @@ void main()
     float diffuseFactor = dot(textureNormal_worldspace, lightDirection_worldspace);
     if (diffuseFactor > 0.0)
     {
-        vec3 eyeDirection_worldspace = normalize(uniformData.viewPosition - inData.vertex);
+        // the view's own eye when drawn replicated, see moSetViews
+        vec3 viewPosition = inData.eye.w != 0.0 ? inData.eye.xyz : uniformData.viewPosition;
+        vec3 eyeDirection_worldspace = normalize(viewPosition - inData.vertex);
         vec3 reflectDirection_worldspace = reflect(-lightDirection_worldspace, textureNormal_worldspace);
 
         float specularFactor = pow(max(dot(eyeDirection_worldspace, reflectDirection_worldspace), 0.0), 8.0);
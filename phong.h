@@ -4,39 +4,73 @@
 
 #include <vulkan/vulkan.h>
 
-#define MO_FRAME_COUNT 2
+// upper bound of the frames in flight, the actual count is MoSwapChain_T::frameCount
+#define MO_FRAME_COUNT 4
+// upper bound of the swap chain images
+#define MO_IMAGE_COUNT 8
 #define MO_PROGRAM_DESC_LAYOUT 0
 #define MO_MATERIAL_DESC_LAYOUT 1
+#define MO_MESH_LOD_COUNT 4
 
 typedef struct MoInstanceCreateInfo {
     const char* const*           pExtensions;
     uint32_t                     extensionsCount;
     VkBool32                     debugReport;
     PFN_vkDebugReportCallbackEXT pDebugReportCallback;
+    // optional, also enable the instance extensions MoDeviceCreateInfo::externalMemoryHost and memoryBudget depend
+    // on, when available
+    VkBool32                     externalMemoryHost;
+    VkBool32                     memoryBudget;
     const VkAllocationCallbacks* pAllocator;
     void                       (*pCheckVkResultFn)(VkResult err);
 } MoInstanceCreateInfo;
 
 typedef struct MoDeviceCreateInfo {
     VkInstance          instance;
+    // null for a headless device, which can only render into offscreen targets
     VkSurfaceKHR        surface;
     const VkFormat*     pRequestFormats;
     uint32_t            requestFormatsCount;
     VkColorSpaceKHR     requestColorSpace;
     VkSurfaceFormatKHR* pSurfaceFormat;
+    // optional, enable VK_EXT_external_memory_host for readbacks into shared memory, see MoDevice_T
+    VkBool32            externalMemoryHost;
+    // optional, enable VK_EXT_memory_budget for moGetMemoryStats
+    VkBool32            memoryBudget;
     void              (*pCheckVkResultFn)(VkResult err);
 } MoDeviceCreateInfo;
 
+// what device memory is used for, see moGetMemoryStats
+typedef enum MoMemoryCategory {
+    MO_MEMORY_CATEGORY_MESH       = 0, // vertex and index buffers
+    MO_MEMORY_CATEGORY_TEXTURE    = 1,
+    MO_MEMORY_CATEGORY_UNIFORM    = 2, // per-frame data written by the CPU: uniforms, instance streams and draw list objects
+    MO_MEMORY_CATEGORY_STAGING    = 3, // uploads and readbacks
+    MO_MEMORY_CATEGORY_ATTACHMENT = 4, // render targets, depth buffers and the depth pyramid
+    MO_MEMORY_CATEGORY_COMPUTE    = 5, // written by compute passes: draw list commands, counts, instances and visibility
+    MO_MEMORY_CATEGORY_COUNT      = 6,
+    MO_MEMORY_CATEGORY_MAX_ENUM   = 0x7FFFFFFF
+} MoMemoryCategory;
+
 typedef struct MoDeviceBuffer_T {
     VkBuffer buffer;
     VkDeviceMemory memory;
     VkDeviceSize size;
+    // of the memory type the buffer was allocated from
+    VkMemoryPropertyFlags memoryProperties;
+    // what the memory is accounted as, zero allocationSize when it is not, such as imported memory
+    MoMemoryCategory category;
+    uint32_t heapIndex;
+    VkDeviceSize allocationSize;
 }* MoDeviceBuffer;
 
 typedef struct MoImageBuffer_T {
     VkImage image;
     VkDeviceMemory memory;
     VkImageView view;
+    MoMemoryCategory category;
+    uint32_t heapIndex;
+    VkDeviceSize allocationSize;
 }* MoImageBuffer;
 
 typedef struct MoDevice_T {
@@ -46,6 +80,19 @@ typedef struct MoDevice_T {
     VkQueue          queue;
     VkDescriptorPool descriptorPool;
     VkDeviceSize     memoryAlignment;
+    // optional features and extensions enabled on the device, used by indirect drawing
+    VkPhysicalDeviceFeatures enabledFeatures;
+    VkBool32         drawIndirectCount;
+    // VK_EXT_external_memory_host, lets readbacks copy into caller memory such as shared memory; only when it was
+    // requested, and the instance was created by moCreateInstance with the extensions it depends on
+    VkBool32         externalMemoryHost;
+    // what host memory imported with it is aligned to, 0 when unknown; with its entry point, loaded along with it
+    VkDeviceSize     minImportedHostPointerAlignment;
+    PFN_vkGetMemoryHostPointerPropertiesEXT pGetMemoryHostPointerProperties;
+    // VK_EXT_memory_budget, likewise only when requested and the instance has VK_KHR_get_physical_device_properties2
+    VkBool32         memoryBudget;
+    // queried once, memory types and heaps do not change
+    VkPhysicalDeviceMemoryProperties memoryProperties;
     void           (*pCheckVkResultFn)(VkResult err);
 }* MoDevice;
 
@@ -56,6 +103,12 @@ typedef struct MoSwapChainCreateInfo {
     VkExtent2D                   extent;
     linalg::aliases::float4                     clearColor;
     VkBool32                     vsync;
+    // optional, present modes in order of preference, FIFO is the last resort; when empty vsync picks
+    // FIFO, or else the first supported of IMMEDIATE, MAILBOX and FIFO_RELAXED
+    const VkPresentModeKHR*      pPresentModes;
+    uint32_t                     presentModeCount;
+    // frames recorded ahead of the GPU, at least 2, at most MO_FRAME_COUNT; independent of the swap chain image count
+    uint32_t                     frameCount;
     const VkAllocationCallbacks* pAllocator;
     void                       (*pCheckVkResultFn)(VkResult err);
 } MoSwapChainCreateInfo;
@@ -65,8 +118,24 @@ typedef struct MoSwapChainRecreateInfo {
     VkSurfaceFormatKHR surfaceFormat;
     VkExtent2D         extent;
     VkBool32           vsync;
+    // same as MoSwapChainCreateInfo
+    const VkPresentModeKHR* pPresentModes;
+    uint32_t           presentModeCount;
 } MoSwapChainRecreateInfo;
 
+typedef struct MoOffscreenTargetCreateInfo {
+    MoDevice                     device;
+    VkExtent2D                   extent;
+    VkFormat                     format;
+    // images rendered into round robin, 2 when 0, at most MO_IMAGE_COUNT
+    uint32_t                     imageCount;
+    // same as MoSwapChainCreateInfo
+    uint32_t                     frameCount;
+    linalg::aliases::float4      clearColor;
+    const VkAllocationCallbacks* pAllocator;
+    void                       (*pCheckVkResultFn)(VkResult err);
+} MoOffscreenTargetCreateInfo;
+
 typedef struct MoSwapBuffer {
     VkImage       back;
     VkImageView   view;
@@ -82,15 +151,68 @@ typedef struct MoCommandBuffer {
 } MoCommandBuffer;
 
 typedef struct MoSwapChain_T {
-    MoSwapBuffer    images[MO_FRAME_COUNT];
+    // one per swap chain image, indexed by imageIndex
+    MoSwapBuffer    images[MO_IMAGE_COUNT];
+    // the fence of the frame last rendering into each image
+    VkFence         imageFences[MO_IMAGE_COUNT];
+    uint32_t        imageCount;
+    uint32_t        imageIndex;
+    // one per frame in flight, indexed by the frameIndex returned by moAcquireSwapChain
     MoCommandBuffer frames[MO_FRAME_COUNT];
+    uint32_t        frameCount;
+    uint32_t        nextFrameIndex;
+    VkPresentModeKHR presentMode;
+    // frame pacing and latency, see moSetTargetFrameTime and moGetFrameLatency; times in seconds, acquireTime and
+    // submitTimes are nanoseconds() timestamps
+    float           targetFrameTime;
+    uint64_t        acquireTime;
+    uint64_t        submitTimes[MO_FRAME_COUNT];
+    // submission serial of each frame in flight, 0 once retired
+    uint64_t        submitSerials[MO_FRAME_COUNT];
+    float           frameTime;
+    // submit to fence observed: until retireFrames, on acquire or submit, finds the fence signalled
+    float           latency;
+    float           averageLatency;
     MoImageBuffer   depthBuffer;
+    // images owned by an offscreen target, which has no swapChainKHR
+    MoImageBuffer   offscreenImages[MO_IMAGE_COUNT];
     VkSwapchainKHR  swapChainKHR;
+    VkSurfaceFormatKHR surfaceFormat;
+    VkImageUsageFlags imageUsage;
     VkRenderPass    renderPass;
+    VkRenderPass    resumeRenderPass;
     VkExtent2D      extent;
     linalg::aliases::float4 clearColor;
+    // dynamic resolution, see moSetDynamicResolution; the scene is rendered into the top left renderExtent of
+    // scaledImage, which has the full extent so rescaling allocates nothing, and blitted up by moEndRenderPass
+    MoImageBuffer   scaledImage;
+    VkFramebuffer   scaledFramebuffer;
+    VkRenderPass    scaledRenderPass;
+    VkRenderPass    scaledResumeRenderPass;
+    VkExtent2D      renderExtent;
+    float           renderScale;
+    float           minRenderScale;
+    float           targetGpuTime;
+    // seconds, from timestamps written once the acquired image is available, in moBeginRenderPass, and at submission
+    float           gpuTime;
+    VkQueryPool     gpuTimeQueries;
+    float           timestampPeriod;
+    uint64_t        timestampMask;
+    // bit i is set while frame i has timestamps to read
+    uint32_t        timedFrames;
 }* MoSwapChain;
 
+typedef struct MoBox {
+    linalg::aliases::float3 min;
+    linalg::aliases::float3 max;
+} MoBox;
+
+typedef struct MoMeshLod {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    float    error; // distance from the full mesh, in object space
+} MoMeshLod;
+
 typedef struct MoMesh_T {
     MoDeviceBuffer verticesBuffer;
     MoDeviceBuffer textureCoordsBuffer;
@@ -100,8 +222,20 @@ typedef struct MoMesh_T {
     MoDeviceBuffer indexBuffer;
     uint32_t indexBufferSize;
     uint32_t vertexCount;
+    MoBox aabb;
+    linalg::aliases::float4 boundingSphere; // local center and radius
+    MoMeshLod lods[MO_MESH_LOD_COUNT];
+    uint32_t lodCount;
 }* MoMesh;
 
+// how a material's diffuse alpha is drawn, classified by moCreateMaterial from the diffuse color and texture
+typedef enum MoMaterialClass {
+    MO_MATERIAL_CLASS_OPAQUE     = 0, // alpha is always one, drawn without blending
+    MO_MATERIAL_CLASS_ALPHA_TEST = 1, // alpha is zero or one, fragments under one half are discarded, drawn without blending
+    MO_MATERIAL_CLASS_BLENDED    = 2, // partial alpha, drawn blended without writing depth, after and back-to-front over the others
+    MO_MATERIAL_CLASS_MAX_ENUM   = 0x7FFFFFFF
+} MoMaterialClass;
+
 typedef struct MoMaterial_T {
     VkSampler ambientSampler;
     VkSampler diffuseSampler;
@@ -115,11 +249,26 @@ typedef struct MoMaterial_T {
     MoImageBuffer normalImage;
     MoImageBuffer specularImage;
     MoImageBuffer emissiveImage;
+    MoMaterialClass materialClass;
 }* MoMaterial;
 
 typedef struct MoPipeline_T {
     VkPipelineLayout pipelineLayout;
+    // drawn for opaque materials, blending disabled
     VkPipeline pipeline;
+    // same layout as the above, with the model matrix streamed per instance; null when no instanced shader was given
+    VkPipeline instancedPipeline;
+    // drawn for alpha-tested and blended materials, see MoMaterialClass
+    VkPipeline alphaTestPipeline;
+    VkPipeline instancedAlphaTestPipeline;
+    VkPipeline blendedPipeline;
+    VkPipeline instancedBlendedPipeline;
+    // position-only variants writing depth for a pre-pass, null when no depth shader was given
+    VkPipeline depthPipeline;
+    VkPipeline instancedDepthPipeline;
+    // opaque variants testing depth for equality without writing it, to follow a pre-pass
+    VkPipeline equalPipeline;
+    VkPipeline instancedEqualPipeline;
     // the buffers bound to this descriptor set may change frame to frame, one set per frame
     VkDescriptorSetLayout descriptorSetLayout[MO_MATERIAL_DESC_LAYOUT+1];
     VkDescriptorSet descriptorSet[MO_FRAME_COUNT];
@@ -138,14 +287,24 @@ typedef struct MoInitInfo {
     VkQueue                      queue;
     VkPipelineCache              pipelineCache;
     VkDescriptorPool             descriptorPool;
+    // one per swap chain image
     const MoSwapBuffer*          pSwapChainSwapBuffers;
     uint32_t                     swapChainSwapBufferCount;
+    // one per frame in flight, the frameIndex given to moBegin indexes these
     const MoCommandBuffer*       pSwapChainCommandBuffers;
     uint32_t                     swapChainCommandBufferCount;
     MoImageBuffer                depthBuffer;
     VkSwapchainKHR               swapChainKHR;
     VkRenderPass                 renderPass;
     VkExtent2D                   extent;
+    // optional, the features the device was created with and whether VK_KHR_draw_indirect_count is enabled
+    const VkPhysicalDeviceFeatures* pEnabledFeatures;
+    VkBool32                     drawIndirectCount;
+    // optional, whether VK_EXT_external_memory_host is enabled
+    VkBool32                     externalMemoryHost;
+    // optional, whether VK_EXT_memory_budget is enabled, which needs VK_KHR_get_physical_device_properties2 enabled
+    // on instance; heap usage is then queried through it
+    VkBool32                     memoryBudget;
     const VkAllocationCallbacks* pAllocator;
     void                         (*pCheckVkResultFn)(VkResult err);
 } MoInitInfo;
@@ -159,6 +318,7 @@ typedef struct MoMeshCreateInfo {
     linalg::aliases::float3* pTangents;
     linalg::aliases::float3* pBitangents;
     uint32_t                 vertexCount;
+    uint32_t                 lodCount; // levels of detail including the full mesh, each about half the triangles of the previous, up to MO_MESH_LOD_COUNT
 } MoMeshCreateInfo;
 
 typedef struct MoTextureInfo {
@@ -197,15 +357,131 @@ typedef struct MoPipelineCreateInfo {
     uint32_t              vertexShaderSize;
     const uint32_t*       pFragmentShader;
     uint32_t              fragmentShaderSize;
+    // optional, vertex shader reading the model matrix from the per-instance stream (locations 5 to 8)
+    const uint32_t*       pInstancedVertexShader;
+    uint32_t              instancedVertexShaderSize;
+    // optional, vertex shaders reading only the position stream (location 0), and the instance stream when instanced
+    // their gl_Position must be computed exactly as in the shaded vertex shaders, see invariant in phong.glsl
+    const uint32_t*       pDepthVertexShader;
+    uint32_t              depthVertexShaderSize;
+    const uint32_t*       pInstancedDepthVertexShader;
+    uint32_t              instancedDepthVertexShaderSize;
     MoPipelineCreateFlags flags;
 } MoPipelineCreateInfo;
 
+typedef enum MoDrawPass {
+    // shade with the pipeline's own depth state
+    MO_DRAW_PASS_SHADED       = 0,
+    // write depth only, from the position stream
+    MO_DRAW_PASS_DEPTH_ONLY   = 1,
+    // shade pixels whose depth equals the pre-pass's, without writing depth; each visible pixel is shaded once
+    MO_DRAW_PASS_SHADED_EQUAL = 2,
+    MO_DRAW_PASS_MAX_ENUM     = 0x7FFFFFFF
+} MoDrawPass;
+
+// per-thread recording of secondary command buffers, see moCreateRecordContext
+typedef struct MoRecordContext_T* MoRecordContext;
+
+typedef struct MoMeshPoolCreateInfo {
+    uint32_t vertexCapacity;
+    uint32_t indexCapacity;
+} MoMeshPoolCreateInfo;
+
+// shared vertex and index buffers, meshes are sub-allocated as ranges and drawn with moDrawIndirect
+typedef struct MoMeshPool_T {
+    MoDeviceBuffer verticesBuffer;
+    MoDeviceBuffer textureCoordsBuffer;
+    MoDeviceBuffer normalsBuffer;
+    MoDeviceBuffer tangentsBuffer;
+    MoDeviceBuffer bitangentsBuffer;
+    MoDeviceBuffer indexBuffer;
+    uint32_t vertexCapacity;
+    uint32_t vertexCount;
+    uint32_t indexCapacity;
+    uint32_t indexCount;
+}* MoMeshPool;
+
+typedef struct MoMeshRange {
+    uint32_t                  firstIndex;
+    uint32_t                  indexCount;
+    int32_t                   vertexOffset;
+    linalg::aliases::float4   boundingSphere; // local center and radius
+} MoMeshRange;
+
+typedef struct MoDrawObject {
+    linalg::aliases::float4x4 model;
+    MoMeshRange               range;
+    MoMaterial                material;
+} MoDrawObject;
+
+typedef struct MoDrawListCreateInfo {
+    MoMeshPool pool;
+    uint32_t   maxObjects;
+} MoDrawListCreateInfo;
+
+// objects resident on the GPU, expanded into indirect draw commands by a compute pass, see moCreateDrawList
+typedef struct MoDrawList_T* MoDrawList;
+
+typedef struct MoReadbackCreateInfo {
+    // of the copied images, 8 bit RGBA or BGRA; sources may be larger, the top left extent is copied
+    VkFormat   format;
+    VkExtent2D extent;
+    // copies in flight, a slot is reused once released; frames in flight + 1 when 0
+    uint32_t   slotCount;
+    // optional, called by moProcessReadbacks with the pixels of each completed copy
+    void     (*pCallback)(const std::uint8_t* pPixels, VkExtent2D extent, uint32_t rowPitch, void* pUserData);
+    void*      pUserData;
+    // optional, slotCount regions hostMemoryStride bytes apart that the slots copy into directly when the device
+    // has externalMemoryHost; both aligned to minImportedHostPointerAlignment, slots that cannot import allocate
+    void*        pHostMemory;
+    VkDeviceSize hostMemoryStride;
+} MoReadbackCreateInfo;
+
+// a ring of persistently mapped host buffers that frames copy their images into, see moCreateReadback
+typedef struct MoReadback_T* MoReadback;
+
+typedef struct MoPixelConversionInfo {
+    // 4 bytes per pixel, row pitches are in bytes and tightly packed when 0
+    const std::uint8_t* pSource;
+    uint32_t            sourceRowPitch;
+    std::uint8_t*       pDestination;
+    uint32_t            destinationRowPitch;
+    VkExtent2D          extent;
+    VkBool32            swizzle;     // swap the first and third channels, BGRA to RGBA and back
+    VkBool32            forceAlpha;  // write 255 to the fourth channel
+    VkBool32            packRGB;     // write 3 bytes per pixel, dropping the fourth channel
+    uint32_t            threadCount; // rows are split across pooled threads, picked from the image size when 0
+} MoPixelConversionInfo;
+
+typedef struct MoDrawListCullInfo {
+    linalg::aliases::float4x4 viewProjection;
+    VkBool32                  frustum;
+    VkBool32                  occlusion; // in two phases, see moDispatchDrawListLate
+} MoDrawListCullInfo;
+
+// objects drawn early were visible last frame, the late ones were found visible against this frame's depth
+typedef enum MoDrawListPhase {
+    MO_DRAW_LIST_PHASE_EARLY = 0,
+    MO_DRAW_LIST_PHASE_LATE  = 1,
+} MoDrawListPhase;
+
 typedef struct MoPushConstant {
     linalg::aliases::float4x4 model;
     linalg::aliases::float4x4 view;
     linalg::aliases::float4x4 projection;
+    // world space position specular is seen from when w is 1, the camera set with moSetLight when w is 0
+    linalg::aliases::float4   eye;
 } MoPushConstant;
 
+// one camera of a multi-view draw, see moSetViews; view, projection and eye are laid out as in MoPushConstant
+typedef struct MoView {
+    linalg::aliases::float4x4 view;
+    linalg::aliases::float4x4 projection;
+    linalg::aliases::float4   eye;
+    // pixels of the render target the view is drawn into, such as a cell of a thumbnail sheet
+    VkRect2D                  viewport;
+} MoView;
+
 typedef struct MoUniform {
     alignas(16) linalg::aliases::float3 camera;
     alignas(16) linalg::aliases::float3 light;
@@ -229,40 +505,166 @@ void moDestroyDevice(MoDevice device);
 // but you do not have to; use moInit(MoInitInfo) to work off an existing swap chain
 void moCreateSwapChain(MoSwapChainCreateInfo* pCreateInfo, MoSwapChain* pSwapChain);
 void moRecreateSwapChain(MoSwapChainRecreateInfo* pCreateInfo, MoSwapChain swapChain);
-void moBeginSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore);
+// begin with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS when drawing only through moExecuteRecords
+// *pFrameIndex receives the next frame in flight, once its previous submission is done; the acquired image is swapChain->imageIndex
+void moBeginSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+// moBeginSwapChain in two steps, to record compute work such as moDispatchDrawList before the render pass
+void moAcquireSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore);
+void moBeginRenderPass(MoSwapChain swapChain, uint32_t frameIndex, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 VkResult moEndSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore);
+// moEndSwapChain in two steps, to record copies such as moRecordReadback after the render pass
+void moEndRenderPass(MoSwapChain swapChain, uint32_t frameIndex);
+// end the render pass mid frame to record compute work such as moBuildDepthPyramid, and begin it again keeping what was drawn
+void moSuspendRenderPass(MoSwapChain swapChain, uint32_t frameIndex);
+void moResumeRenderPass(MoSwapChain swapChain, uint32_t frameIndex, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+VkResult moSubmitSwapChain(MoSwapChain swapChain, uint32_t *pFrameIndex, VkSemaphore *pImageAcquiredSemaphore);
 
 // free swap chain, command and swap buffers
 void moDestroySwapChain(MoDevice device, MoSwapChain pSwapChain);
 
+// a render target without a surface, for batch rendering without a display; it is used like a swap chain whose
+// moEndSwapChain does not present, and swapChain->images[swapChain->imageIndex].back holds the last rendered image
+// in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, ready for moFramebufferReadback; free it with moDestroySwapChain
+void moCreateOffscreenTarget(MoOffscreenTargetCreateInfo* pCreateInfo, MoSwapChain* pSwapChain);
+
+// two timestamps per profiled scope, scopes past this many per frame are dropped
+#define MO_PROFILE_QUERY_COUNT 512
+
+// work recorded in a frame, see moGetFrameStats
+typedef struct MoFrameStats {
+    uint32_t drawCalls;          // indirect draws count once per command or per bucket when multi-draw
+    uint64_t triangles;          // of direct draws, times their instances and views
+    uint64_t instances;
+    uint32_t pipelineBinds;
+    uint32_t descriptorSetBinds;
+    uint32_t vertexBufferBinds;  // vkCmdBindVertexBuffers calls
+    uint32_t indexBufferBinds;
+    uint64_t pushConstantBytes;
+    uint64_t uniformBytes;       // written for the frame: moSetLight, instance streams and draw list updates
+    uint64_t stagingBytes;       // mesh and texture uploads and readback copies
+    float    waitTime;           // seconds blocked in moAcquireSwapChain on the frame's fence, the next image and its fence
+    float    beginTime;          // seconds of CPU time in moAcquireSwapChain, without pacing sleeps and waits, and moBeginRenderPass
+    float    recordTime;         // from moBeginRenderPass to moEndRenderPass
+    float    endTime;            // in moEndRenderPass and moSubmitSwapChain
+} MoFrameStats;
+
+typedef struct MoMemoryHeapStats {
+    VkDeviceSize      size;
+    VkMemoryHeapFlags flags;
+    VkDeviceSize      allocated; // by meshoui
+    VkDeviceSize      usage;     // by the process according to VK_EXT_memory_budget, else allocated
+    VkDeviceSize      budget;    // what the process can allocate according to VK_EXT_memory_budget, else size
+} MoMemoryHeapStats;
+
+// device memory allocated by meshoui, see moGetMemoryStats
+typedef struct MoMemoryStats {
+    VkDeviceSize      categories[MO_MEMORY_CATEGORY_COUNT];
+    uint32_t          allocationCount;
+    // whether heap usage and budget come from VK_EXT_memory_budget
+    VkBool32          memoryBudget;
+    uint32_t          heapCount;
+    MoMemoryHeapStats heaps[VK_MAX_MEMORY_HEAPS];
+} MoMemoryStats;
+
+// a timed range of a frame's GPU work, see moGetProfile
+typedef struct MoProfileScope {
+    // the name given to moProfileBegin, "moBegin" from moBegin to the first pipeline switch, "pipeline" from a switch
+    // to the next; these last two are leaves and are closed by any other scope beginning or ending
+    const char* pName;
+    // the pipeline bound by moBegin or the switch, null for other scopes
+    VkPipeline  pipeline;
+    // index of the enclosing scope, ~0u for the whole frame
+    uint32_t    parent;
+    uint32_t    depth;
+    float       time; // seconds
+} MoProfileScope;
+
+typedef struct MoDynamicResolutionInfo {
+    // seconds of GPU time per frame the render scale is steered towards, 0 to render at full resolution again
+    float targetGpuTime;
+    // smallest fraction of the width and height rendered, 0.5 when 0
+    float minScale;
+} MoDynamicResolutionInfo;
+
+typedef struct MoFrameLatency {
+    float frameTime;      // seconds between the last two acquires
+    float latency;        // seconds from the last retired frame's submission until its fence was observed signalled
+    float averageLatency; // the same, averaged over recent frames
+} MoFrameLatency;
+
+// pace frames at most every frameTime seconds, sleeping in moAcquireSwapChain; 0 to disable
+void moSetTargetFrameTime(MoSwapChain swapChain, float frameTime);
+
+// measured frame time and submit to fence observed latency; fences are only checked on acquire and submit, so the
+// latency includes the time until then and overstates when the GPU finished; the presentation engine adds up to one
+// refresh in FIFO modes
+void moGetFrameLatency(MoSwapChain swapChain, MoFrameLatency* pLatency);
+
+// render the scene at a resolution scaled from the measured GPU frame time, swapChain->renderExtent, and scale it
+// up into the image with a bilinear blit in moEndRenderPass; projections keep their aspect ratio
+// the depth pyramid is not built while the scale is below 1, so moDispatchDrawListLate only culls the frustum
+// returns VK_ERROR_FEATURE_NOT_PRESENT when the images cannot be blitted into or the queue has no timestamps
+VkResult moSetDynamicResolution(MoSwapChain swapChain, const MoDynamicResolutionInfo* pInfo);
+
 // set global handles and create default phong pipeline
 void moInit(MoInitInfo* pInfo);
 
 // free default phong pipeline and clear global handles
 void moShutdown();
 
+// wait for the device and free everything still queued by the destroy functions; moShutdown calls it
+// destroyed objects are otherwise freed by moAcquireSwapChain once the frames that may use them have retired
+void moFlushDeletions();
+
+// time the GPU work recorded until the matching moProfileEnd, pName must outlive the frame; scopes nest
+// frames are profiled from moAcquireSwapChain to moSubmitSwapChain, on the swap chain whose frames were given to moInit
+// scopes are not recorded inside render passes begun with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+void moProfileBegin(const char* pName);
+void moProfileEnd();
+
+// the scopes of the last frame whose timestamps were read back, frameCount frames behind; scope 0 is the whole frame
+// and parents come before their children; *pCount receives the scope count when pScopes is null
+// scope 0 starts once the queue reaches the frame's commands, it includes the render pass waiting for the acquired
+// image and may overlap the previous frame; sum its children for the frame's own work
+// there are none when the queue has no timestamps
+void moGetProfile(uint32_t* pCount, MoProfileScope* pScopes);
+
+// counters of the last submitted frame, counted from the previous submission; uploads made between frames count
+// towards the next one, and work recorded into record contexts once it is executed
+void moGetFrameStats(MoFrameStats* pStats);
+
+// the device memory meshoui currently holds by category and heap; memory that is deferred for deletion still counts
+void moGetMemoryStats(MoMemoryStats* pStats);
+
 // use this function to create a different pipeline than the default
 void moCreatePipeline(const MoPipelineCreateInfo *pCreateInfo, MoPipeline *pPipeline);
 
 // override the default pipeline, the default is restored when called with null
 void moPipelineOverride(MoPipeline pipeline = VK_NULL_HANDLE);
 
-// destroy a pipeline other than the default
+// destroy a pipeline other than the default, once the frames that may use it have retired
 void moDestroyPipeline(MoPipeline pipeline);
 
+// select the pipeline variant used by the following draws, reset to MO_DRAW_PASS_SHADED by moBegin
+// only opaque materials are drawn in the pre-pass, other materials and pipelines without a depth variant draw nothing
+// in it and shade with their own depth state after it
+// record contexts use the pass set when moRecordBegin is called
+void moSetDrawPass(MoDrawPass pass);
+
 // upload a new mesh to the GPU and return a handle
 void moCreateMesh(const MoMeshCreateInfo* pCreateInfo, MoMesh* pMesh);
 
-// free a mesh
+// free a mesh, once the frames that may draw it have retired
 void moDestroyMesh(MoMesh mesh);
 
 // upload a new phong material to the GPU and return a handle
 void moCreateMaterial(const MoMaterialCreateInfo* pCreateInfo, MoMaterial* pMaterial);
 
-// free a material
+// free a material, once the frames that may bind it have retired
 void moDestroyMaterial(MoMaterial material);
 
 // start a new frame against the current pipeline
+// when the render pass expects secondary command buffers, this only selects the frame for moSetLight and moRecordBegin
 void moBegin(uint32_t frameIndex);
 
 // set view's projection and view matrices, and the mesh's model matrix (as a push constant)
@@ -271,13 +673,141 @@ void moSetPMV(const MoPushConstant* pProjectionModelView);
 // set the camera's position and light position (as a UBO)
 void moSetLight(const MoUniform* pLightAndCamera);
 
-// bind a material
+// bind a material, the following draws use the pipeline variant of its class
 void moBindMaterial(MoMaterial material);
 
 // draw a mesh
 void moDrawMesh(MoMesh mesh);
 
-// readback a framebuffer
+// replicate the following moDrawMesh, moDrawMeshLod and moDrawMeshInstanced once per view, into each view's viewport
+// with its view, projection and eye; pipelines, materials, meshes and the model matrix are bound once for all views
+// the views are copied and kept until the next call, call with no views to draw into the whole target again
+// with the view, projection and eye last set by moSetPMV, restored by the next draw
+// draws recorded into record contexts and indirect draws are not replicated
+void moSetViews(const MoView* pViews, uint32_t count);
+
+// coarsest level of detail of a mesh whose error projects to at most pixelError pixels
+uint32_t moSelectMeshLod(MoMesh mesh, const MoPushConstant* pProjectionModelView, float viewportHeight, float pixelError = 1.f);
+
+// draw one level of detail of a mesh, see moSelectMeshLod
+void moDrawMeshLod(MoMesh mesh, uint32_t lod);
+
+// draw a mesh once per model matrix in a single draw call, the model matrix set with moSetPMV is ignored
+// pipelines without an instanced variant fall back to one draw per instance, leaving the last model matrix pushed
+void moDrawMeshInstanced(MoMesh mesh, const linalg::aliases::float4x4* pModels, uint32_t count);
+
+// create a recording context, one per thread; each context owns its command pools and secondary command buffers
+void moCreateRecordContext(MoRecordContext* pContext);
+
+// free a recording context, once the frames executing it have retired
+void moDestroyRecordContext(MoRecordContext context);
+
+// begin recording against the current pipeline, once per frame and after moBegin(frameIndex)
+// contexts may record concurrently with each other, moRecord* calls on one context must stay on one thread
+void moRecordBegin(MoRecordContext context, uint32_t frameIndex);
+
+// same as moSetPMV, recorded into the context
+void moRecordSetPMV(MoRecordContext context, const MoPushConstant* pProjectionModelView);
+
+// same as moBindMaterial, recorded into the context
+void moRecordBindMaterial(MoRecordContext context, MoMaterial material);
+
+// same as moDrawMesh, recorded into the context
+void moRecordDrawMesh(MoRecordContext context, MoMesh mesh);
+
+// same as moDrawMeshLod, recorded into the context
+void moRecordDrawMeshLod(MoRecordContext context, MoMesh mesh, uint32_t lod);
+
+// same as moDrawMeshInstanced, recorded into the context
+void moRecordDrawMeshInstanced(MoRecordContext context, MoMesh mesh, const linalg::aliases::float4x4* pModels, uint32_t count);
+
+// end recording
+void moRecordEnd(MoRecordContext context);
+
+// execute ended contexts, in order, from the current frame's primary command buffer
+void moExecuteRecords(const MoRecordContext* pContexts, uint32_t count);
+
+// create shared geometry buffers for indirect drawing
+void moCreateMeshPool(const MoMeshPoolCreateInfo* pCreateInfo, MoMeshPool* pPool);
+
+// free a mesh pool and all of its ranges
+void moDestroyMeshPool(MoMeshPool pool);
+
+// upload a mesh into a pool, returns VK_ERROR_OUT_OF_DEVICE_MEMORY when the pool is full
+VkResult moCreateMeshRange(MoMeshPool pool, const MoMeshCreateInfo* pCreateInfo, MoMeshRange* pRange);
+
+// create a draw list over a mesh pool, drawn with the current pipeline's instanced variant
+void moCreateDrawList(const MoDrawListCreateInfo* pCreateInfo, MoDrawList* pDrawList);
+
+// free a draw list, once the frames drawing it have retired
+void moDestroyDrawList(MoDrawList drawList);
+
+// replace the objects of a draw list, objects sharing a material are drawn together
+void moSetDrawListObjects(MoDrawList drawList, const MoDrawObject* pObjects, uint32_t count);
+
+// move one object of a draw list, indexed as given to moSetDrawListObjects
+void moSetDrawListModel(MoDrawList drawList, uint32_t objectIndex, const linalg::aliases::float4x4 & model);
+
+// build a max depth pyramid from the depth drawn so far this frame, record once per frame between moSuspendRenderPass and moResumeRenderPass
+void moBuildDepthPyramid(uint32_t frameIndex);
+
+// build the frame's early indirect draw commands, culled when pCullInfo is set, record between moAcquireSwapChain and moBeginRenderPass
+// with occlusion only the objects found visible by the previous late phase are drawn early
+void moDispatchDrawList(MoDrawList drawList, uint32_t frameIndex, const MoDrawListCullInfo* pCullInfo = nullptr);
+
+// build the frame's late indirect draw commands, every object is tested against the pyramid of this frame's depth
+// and those visible that were not drawn early are drawn late; record after moBuildDepthPyramid, does nothing without occlusion
+void moDispatchDrawListLate(MoDrawList drawList, uint32_t frameIndex);
+
+// draw a phase of a draw list with one indirect draw per material, the model matrix set with moSetPMV is ignored
+// blended materials are drawn in bucket order, unsorted
+void moDrawIndirect(MoDrawList drawList, MoDrawListPhase phase = MO_DRAW_LIST_PHASE_EARLY);
+
+// planes of the frustum of viewProjection facing inwards, for clip space depth in [0, 1]
+void moFrustumPlanes(const linalg::aliases::float4x4 & viewProjection, linalg::aliases::float4 planes[6]);
+
+// world space box around a transformed local box
+void moTransformBox(const MoBox* pBox, const linalg::aliases::float4x4 & model, MoBox* pTransformed);
+
+// test world space boxes against the frustum of viewProjection, bit i % 32 of pVisible[i / 32] is set when box i may be visible
+void moCullFrustum(const linalg::aliases::float4x4 & viewProjection, const MoBox* pBoxes, uint32_t count, uint32_t* pVisible);
+
+// projection of the sub-frustum of a tile of pixels of an extent sized image, rendered into a target of tile.extent
+// the image may be larger than maxImageDimension2D; select levels of detail with the whole image's projection and height
+void moTileProjection(const linalg::aliases::float4x4 & projection, VkExtent2D extent, VkRect2D tile, linalg::aliases::float4x4* pTileProjection);
+
+// create a readback ring, copies are recorded in the frames' own command buffers and never block
+// VK_ERROR_FORMAT_NOT_SUPPORTED when format does not have 4 bytes per pixel, the readback is then VK_NULL_HANDLE
+VkResult moCreateReadback(const MoReadbackCreateInfo* pCreateInfo, MoReadback* pReadback);
+
+// free a readback ring, once the frames copying into it have retired
+void moDestroyReadback(MoReadback readback);
+
+// record a copy of source, sourceExtent sized, currently in layout and left in it, into the next slot; outside of a
+// render pass; returns VK_NOT_READY, recording nothing, when that slot was not released yet, and
+// VK_ERROR_VALIDATION_FAILED_EXT when source is smaller than the readback's extent
+VkResult moRecordReadback(MoReadback readback, uint32_t frameIndex, VkImage source, VkExtent2D sourceExtent, VkImageLayout layout, uint32_t* pSlot);
+
+// the pixels of a slot once its frame has retired, VK_NOT_READY before then and VK_INCOMPLETE for a released slot
+VkResult moPollReadback(MoReadback readback, uint32_t slot, const std::uint8_t** ppPixels, uint32_t* pRowPitch);
+
+// moPollReadback, blocking on the frame's fence; VK_NOT_READY without waiting when the frame was not submitted yet
+VkResult moWaitReadback(MoReadback readback, uint32_t slot, const std::uint8_t** ppPixels, uint32_t* pRowPitch);
+
+// make a slot available to moRecordReadback again, its pixels must no longer be used
+void moReleaseReadback(MoReadback readback, uint32_t slot);
+
+// the oldest completed slot not taken yet, for consumers holding on to the pixels until they release the slot
+// returns VK_NOT_READY when there is none
+VkResult moTakeReadback(MoReadback readback, uint32_t* pSlot, const std::uint8_t** ppPixels, uint32_t* pRowPitch);
+
+// pass the pixels of every completed slot not taken to the callback, oldest first, and release them; returns how many
+uint32_t moProcessReadbacks(MoReadback readback);
+
+// convert readback pixels, vectorized where the target allows it
+void moConvertPixels(const MoPixelConversionInfo* pInfo);
+
+// readback a framebuffer, blocking until the copy is done
 void moFramebufferReadback(VkImage source, VkExtent2D extent, std::uint8_t* pDestination, uint32_t destinationSize, VkCommandPool commandPool);
 
 // create a default material
@@ -0,0 +1,399 @@
+#include "scene.h"
+
+#include <linalg.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+using namespace linalg;
+using namespace linalg::aliases;
+
+// column major, each column of the result is a combination of a's columns
+static void multiply(const float4x4 & a, const float4x4 & b, float4x4 *pResult)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128 column[4] = {_mm_loadu_ps(&a.x.x), _mm_loadu_ps(&a.y.x), _mm_loadu_ps(&a.z.x), _mm_loadu_ps(&a.w.x)};
+    for (int j = 0; j < 4; ++j)
+    {
+        const float *pB = &b[j].x;
+        __m128 result = _mm_mul_ps(column[0], _mm_set1_ps(pB[0]));
+        result = _mm_add_ps(result, _mm_mul_ps(column[1], _mm_set1_ps(pB[1])));
+        result = _mm_add_ps(result, _mm_mul_ps(column[2], _mm_set1_ps(pB[2])));
+        result = _mm_add_ps(result, _mm_mul_ps(column[3], _mm_set1_ps(pB[3])));
+        _mm_storeu_ps(&(*pResult)[j].x, result);
+    }
+#else
+    *pResult = mul(a, b);
+#endif
+}
+
+void moCreateScene(MoScene *pScene)
+{
+    MoScene scene = *pScene = new MoScene_T();
+    scene->firstDirty = 0;
+}
+
+void moDestroyScene(MoScene scene)
+{
+    delete scene;
+}
+
+uint32_t moAddSceneNode(MoScene scene, uint32_t parent, const float4x4 & local)
+{
+    const uint32_t node = (uint32_t)scene->parents.size();
+    assert(parent == MO_SCENE_NO_PARENT || parent < node);
+    scene->parents.push_back(parent);
+    scene->locals.push_back(local);
+    scene->worlds.push_back(local);
+    scene->dirty.push_back(1);
+    scene->firstDirty = std::min(scene->firstDirty, node);
+    return node;
+}
+
+void moSetSceneLocal(MoScene scene, uint32_t node, const float4x4 & local)
+{
+    scene->locals[node] = local;
+    scene->dirty[node] = 1;
+    scene->firstDirty = std::min(scene->firstDirty, node);
+}
+
+void moUpdateScene(MoScene scene)
+{
+    scene->updated.clear();
+    const uint32_t count = (uint32_t)scene->parents.size();
+    if (scene->firstDirty >= count)
+        return;
+
+    // a parent's flag is final before its children are reached, so marks flow down subtrees
+    for (uint32_t node = scene->firstDirty; node < count; ++node)
+    {
+        const uint32_t parent = scene->parents[node];
+        if (parent != MO_SCENE_NO_PARENT && scene->dirty[parent])
+            scene->dirty[node] = 1;
+        if (!scene->dirty[node])
+            continue;
+
+        if (parent == MO_SCENE_NO_PARENT)
+            scene->worlds[node] = scene->locals[node];
+        else
+            multiply(scene->worlds[parent], scene->locals[node], &scene->worlds[node]);
+        scene->updated.push_back(node);
+    }
+    std::fill(scene->dirty.begin() + scene->firstDirty, scene->dirty.end(), 0);
+    scene->firstDirty = count;
+}
+
+static MoBox merge(const MoBox & a, const MoBox & b)
+{
+    return {linalg::min(a.min, b.min), linalg::max(a.max, b.max)};
+}
+
+static bool overlaps(const MoBox & a, const MoBox & b)
+{
+    return a.min.x <= b.max.x && b.min.x <= a.max.x
+        && a.min.y <= b.max.y && b.min.y <= a.max.y
+        && a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// slab test, the distance is where the ray enters the box
+static bool intersects(const MoBox & box, const float3 & origin, const float3 & inverseDirection, float maxDistance, float *pDistance)
+{
+    const float3 t0 = (box.min - origin) * inverseDirection;
+    const float3 t1 = (box.max - origin) * inverseDirection;
+    const float enter = std::max(maxelem(linalg::min(t0, t1)), 0.f);
+    const float exit = std::min(minelem(linalg::max(t0, t1)), maxDistance);
+    *pDistance = enter;
+    return enter <= exit;
+}
+
+static uint32_t buildNode(MoBvh bvh, uint32_t parent, uint32_t firstItem, uint32_t itemCount)
+{
+    const uint32_t index = (uint32_t)bvh->nodes.size();
+    bvh->nodes.push_back({});
+
+    MoBox box = bvh->boxes[bvh->items[firstItem]];
+    MoBox centroids = {(box.min + box.max) * 0.5f, (box.min + box.max) * 0.5f};
+    for (uint32_t i = firstItem + 1; i < firstItem + itemCount; ++i)
+    {
+        const MoBox & item = bvh->boxes[bvh->items[i]];
+        box = merge(box, item);
+        const float3 centroid = (item.min + item.max) * 0.5f;
+        centroids = merge(centroids, {centroid, centroid});
+    }
+    bvh->nodes[index].box = box;
+    bvh->nodes[index].parent = parent;
+    bvh->nodes[index].firstItem = firstItem;
+    bvh->nodes[index].itemCount = itemCount;
+
+    const float3 extent = centroids.max - centroids.min;
+    const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    if (itemCount <= MO_BVH_LEAF_SIZE || extent[axis] <= 0.f)
+    {
+        for (uint32_t i = firstItem; i < firstItem + itemCount; ++i)
+            bvh->leaves[bvh->items[i]] = index;
+        return index;
+    }
+
+    // split at the median centroid along the widest axis, which keeps the tree balanced
+    const uint32_t half = itemCount / 2;
+    uint32_t *pItems = bvh->items.data() + firstItem;
+    std::nth_element(pItems, pItems + half, pItems + itemCount, [&](uint32_t a, uint32_t b)
+    {
+        return bvh->boxes[a].min[axis] + bvh->boxes[a].max[axis] < bvh->boxes[b].min[axis] + bvh->boxes[b].max[axis];
+    });
+    buildNode(bvh, index, firstItem, half);
+    const uint32_t right = buildNode(bvh, index, firstItem + half, itemCount - half);
+    bvh->nodes[index].right = right;
+    return index;
+}
+
+void moCreateBvh(const MoBvhCreateInfo *pCreateInfo, MoBvh *pBvh)
+{
+    MoBvh bvh = *pBvh = new MoBvh_T();
+    bvh->boxes.assign(pCreateInfo->pBoxes, pCreateInfo->pBoxes + pCreateInfo->count);
+    bvh->items.resize(pCreateInfo->count);
+    bvh->leaves.resize(pCreateInfo->count);
+    for (uint32_t i = 0; i < pCreateInfo->count; ++i)
+        bvh->items[i] = i;
+    if (pCreateInfo->count > 0)
+    {
+        bvh->nodes.reserve(2 * (pCreateInfo->count / MO_BVH_LEAF_SIZE + 1));
+        buildNode(bvh, 0, 0, pCreateInfo->count);
+    }
+    bvh->dirty.assign(bvh->nodes.size(), 0);
+}
+
+void moDestroyBvh(MoBvh bvh)
+{
+    delete bvh;
+}
+
+void moSetBvhBox(MoBvh bvh, uint32_t item, const MoBox *pBox)
+{
+    bvh->boxes[item] = *pBox;
+    uint32_t index = bvh->leaves[item];
+    while (!bvh->dirty[index])
+    {
+        bvh->dirty[index] = 1;
+        if (index == 0)
+            break;
+        index = bvh->nodes[index].parent;
+    }
+}
+
+void moRefitBvh(MoBvh bvh)
+{
+    // children always come after their parent
+    for (size_t index = bvh->nodes.size(); index-- > 0;)
+    {
+        if (!bvh->dirty[index])
+            continue;
+        bvh->dirty[index] = 0;
+
+        MoBvhNode & node = bvh->nodes[index];
+        if (node.right == 0)
+        {
+            node.box = bvh->boxes[bvh->items[node.firstItem]];
+            for (uint32_t i = node.firstItem + 1; i < node.firstItem + node.itemCount; ++i)
+                node.box = merge(node.box, bvh->boxes[bvh->items[i]]);
+        }
+        else
+        {
+            node.box = merge(bvh->nodes[index + 1].box, bvh->nodes[node.right].box);
+        }
+    }
+}
+
+// clears the planes a box is entirely in front of, they need not be tested below it
+static bool inFrustum(const MoBox & box, const float4 planes[6], uint32_t *pPlaneMask)
+{
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+        if ((*pPlaneMask & (1u << i)) == 0)
+            continue;
+
+        // corners furthest along and against the plane's normal
+        const float4 & plane = planes[i];
+        const float3 positive(plane.x >= 0.f ? box.max.x : box.min.x, plane.y >= 0.f ? box.max.y : box.min.y, plane.z >= 0.f ? box.max.z : box.min.z);
+        const float3 negative(plane.x >= 0.f ? box.min.x : box.max.x, plane.y >= 0.f ? box.min.y : box.max.y, plane.z >= 0.f ? box.min.z : box.max.z);
+        if (dot(plane.xyz(), positive) + plane.w < 0.f)
+            return false;
+        if (dot(plane.xyz(), negative) + plane.w >= 0.f)
+            *pPlaneMask &= ~(1u << i);
+    }
+    return true;
+}
+
+static void cullNode(MoBvh bvh, uint32_t index, const float4 planes[6], uint32_t planeMask, uint32_t *pVisible)
+{
+    const MoBvhNode & node = bvh->nodes[index];
+    if (!inFrustum(node.box, planes, &planeMask))
+        return;
+
+    if (planeMask == 0)
+    {
+        for (uint32_t i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+            pVisible[bvh->items[i] / 32] |= 1u << (bvh->items[i] % 32);
+    }
+    else if (node.right == 0)
+    {
+        for (uint32_t i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            uint32_t itemPlaneMask = planeMask;
+            if (inFrustum(bvh->boxes[bvh->items[i]], planes, &itemPlaneMask))
+                pVisible[bvh->items[i] / 32] |= 1u << (bvh->items[i] % 32);
+        }
+    }
+    else
+    {
+        cullNode(bvh, index + 1, planes, planeMask, pVisible);
+        cullNode(bvh, node.right, planes, planeMask, pVisible);
+    }
+}
+
+void moCullBvh(MoBvh bvh, const float4x4 & viewProjection, uint32_t *pVisible)
+{
+    memset(pVisible, 0, ((bvh->boxes.size() + 31) / 32) * sizeof(uint32_t));
+    if (bvh->nodes.empty())
+        return;
+
+    float4 planes[6];
+    moFrustumPlanes(viewProjection, planes);
+    cullNode(bvh, 0, planes, 0x3F, pVisible);
+}
+
+VkBool32 moRayBvh(MoBvh bvh, const float3 & origin, const float3 & direction, uint32_t *pItem, float *pDistance)
+{
+    const float3 inverseDirection = float3(1.f) / direction;
+    float closest = std::numeric_limits<float>::infinity();
+    VkBool32 hit = VK_FALSE;
+
+    // the tree is balanced, its depth stays far below the stack's size
+    uint32_t stack[64];
+    uint32_t stackSize = 0;
+    if (!bvh->nodes.empty())
+        stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const uint32_t index = stack[--stackSize];
+        const MoBvhNode & node = bvh->nodes[index];
+        float distance;
+        if (!intersects(node.box, origin, inverseDirection, closest, &distance))
+            continue;
+
+        if (node.right == 0)
+        {
+            for (uint32_t i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+            {
+                if (intersects(bvh->boxes[bvh->items[i]], origin, inverseDirection, closest, &distance))
+                {
+                    closest = distance;
+                    *pItem = bvh->items[i];
+                    hit = VK_TRUE;
+                }
+            }
+            continue;
+        }
+
+        // visit the nearer child first so that it can prune the other
+        float leftDistance, rightDistance;
+        const bool leftHit = intersects(bvh->nodes[index + 1].box, origin, inverseDirection, closest, &leftDistance);
+        const bool rightHit = intersects(bvh->nodes[node.right].box, origin, inverseDirection, closest, &rightDistance);
+        if (leftHit && rightHit)
+        {
+            const bool leftFirst = leftDistance <= rightDistance;
+            stack[stackSize++] = leftFirst ? node.right : index + 1;
+            stack[stackSize++] = leftFirst ? index + 1 : node.right;
+        }
+        else if (leftHit || rightHit)
+        {
+            stack[stackSize++] = leftHit ? index + 1 : node.right;
+        }
+    }
+
+    if (hit)
+        *pDistance = closest;
+    return hit;
+}
+
+uint32_t moQueryBvh(MoBvh bvh, const MoBox *pRegion, uint32_t *pItems, uint32_t maxItems)
+{
+    uint32_t count = 0;
+    uint32_t stack[64];
+    uint32_t stackSize = 0;
+    if (!bvh->nodes.empty())
+        stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const uint32_t index = stack[--stackSize];
+        const MoBvhNode & node = bvh->nodes[index];
+        if (!overlaps(node.box, *pRegion))
+            continue;
+
+        if (node.right == 0)
+        {
+            for (uint32_t i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+            {
+                if (!overlaps(bvh->boxes[bvh->items[i]], *pRegion))
+                    continue;
+                if (count < maxItems)
+                    pItems[count] = bvh->items[i];
+                ++count;
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.right;
+            stack[stackSize++] = index + 1;
+        }
+    }
+    return count;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2018 Patrick Pelletier
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "phong.h"
+
+#include <linalg.h>
+
+#include <vector>
+
+#define MO_BVH_LEAF_SIZE 4
+#define MO_SCENE_NO_PARENT 0xFFFFFFFF
+
+typedef struct MoBvhNode {
+    MoBox    box;
+    uint32_t parent;
+    uint32_t right;     // the left child follows its parent, 0 for leaves
+    uint32_t firstItem; // the items below a node are contiguous in MoBvh_T::items
+    uint32_t itemCount;
+} MoBvhNode;
+
+typedef struct MoBvh_T {
+    std::vector<MoBvhNode> nodes;
+    std::vector<MoBox>     boxes;
+    std::vector<uint32_t>  items;
+    std::vector<uint32_t>  leaves;
+    std::vector<uint8_t>   dirty;
+}* MoBvh;
+
+typedef struct MoBvhCreateInfo {
+    const MoBox* pBoxes;
+    uint32_t     count;
+} MoBvhCreateInfo;
+
+// nodes are stored parents first, so that world matrices are computed in one forward sweep
+typedef struct MoScene_T {
+    std::vector<uint32_t>                  parents;
+    std::vector<linalg::aliases::float4x4> locals;
+    std::vector<linalg::aliases::float4x4> worlds;
+    std::vector<uint8_t>                   dirty;
+    uint32_t                               firstDirty;
+    // nodes whose world matrix changed in the last moUpdateScene
+    std::vector<uint32_t>                  updated;
+}* MoScene;
+
+// create an empty transform hierarchy
+void moCreateScene(MoScene* pScene);
+
+// free a transform hierarchy
+void moDestroyScene(MoScene scene);
+
+// append a node under a parent already in the scene or MO_SCENE_NO_PARENT, returns its index
+uint32_t moAddSceneNode(MoScene scene, uint32_t parent, const linalg::aliases::float4x4 & local);
+
+// move a node, its world matrix and those below it are recomputed by the next moUpdateScene
+void moSetSceneLocal(MoScene scene, uint32_t node, const linalg::aliases::float4x4 & local);
+
+// recompute the world matrices of moved nodes and their descendants
+void moUpdateScene(MoScene scene);
+
+// build a bounding volume hierarchy over world space boxes, an item is the index of its box
+void moCreateBvh(const MoBvhCreateInfo* pCreateInfo, MoBvh* pBvh);
+
+// free a bounding volume hierarchy
+void moDestroyBvh(MoBvh bvh);
+
+// move an item, the nodes above it are refit by the next moRefitBvh
+void moSetBvhBox(MoBvh bvh, uint32_t item, const MoBox* pBox);
+
+// refit the nodes above moved items, the tree is not rebuilt so it loosens as items move far
+void moRefitBvh(MoBvh bvh);
+
+// frustum cull, bit i % 32 of pVisible[i / 32] is set when item i may be visible
+void moCullBvh(MoBvh bvh, const linalg::aliases::float4x4 & viewProjection, uint32_t* pVisible);
+
+// closest item whose box is hit by a ray, returns VK_FALSE when nothing is hit
+VkBool32 moRayBvh(MoBvh bvh, const linalg::aliases::float3 & origin, const linalg::aliases::float3 & direction, uint32_t* pItem, float* pDistance);
+
+// items whose box overlaps a region, writes at most maxItems and returns how many there are
+uint32_t moQueryBvh(MoBvh bvh, const MoBox* pRegion, uint32_t* pItems, uint32_t maxItems);
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2018 Patrick Pelletier
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/